@@ -10,8 +10,10 @@
     #include <mach/vm_statistics.h>
 #elif __linux__
     #include <sys/mman.h>
+    #include <unistd.h>
 #endif
 #include <string>
+#include <cstdint>
 
 // These are the four strategies we may use when allocating memory.
 enum struct alloc_mem_state
@@ -88,6 +90,50 @@ void alloc_hugepage(T*& ptr,
   #endif
 }
 
+// Like `alloc_hugepage()`, but the memory is all zeros.  Where possible this
+// maps fresh anonymous pages, which the kernel zeroes when each page is first
+// touched: so nothing is touched here, and pages are zeroed in parallel (and,
+// with NUMA, placed) by the threads that first use them, instead of by one
+// thread up front.  Free with `free_hugepage()` as usual.
+template<typename T>
+void alloc_zeroed_hugepage(T*& ptr,
+                           alloc_mem_state& mem_state,
+                           size_t count,
+                           const char* purpose)
+{
+  #if __linux__
+    // Map 2MB more than we need, and trim the mapping so that it starts on a
+    // 2MB boundary (or there can't be any transparent huge pages).
+    const size_t bytes = sizeof(T) * count;
+    const uintptr_t align = (1 << 21);
+    void* map = mmap(NULL, bytes + align, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED)
+    {
+      const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+      const uintptr_t begin = uintptr_t(map);
+      const uintptr_t end = begin + bytes + align;
+      const uintptr_t alignedBegin = (begin + align - 1) & ~(align - 1);
+      const uintptr_t alignedEnd = (alignedBegin + bytes + pageSize - 1) &
+          ~(pageSize - 1);
+      if (alignedBegin > begin)
+        munmap(map, alignedBegin - begin);
+      if (end > alignedEnd)
+        munmap((void*) alignedEnd, end - alignedEnd);
+
+      ptr = (T*) alignedBegin;
+      madvise(ptr, bytes, MADV_HUGEPAGE);
+      mem_state = alloc_mem_state::mem_state_mmap;
+      return;
+    }
+  #endif
+
+  // Anonymous mappings are already zeroed; anything else is not.
+  alloc_hugepage<T>(ptr, mem_state, count, purpose);
+  if (mem_state != alloc_mem_state::mem_state_mmap)
+    memset((void*) ptr, 0, sizeof(T) * count);
+}
+
 template<typename T>
 void free_hugepage(T*& ptr, alloc_mem_state mem_state, size_t count)
 {
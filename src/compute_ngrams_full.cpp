@@ -5,19 +5,62 @@
 #include "single_ngram_thread.hpp"
 #include "prefix_single_ngram_thread.hpp"
 #include "packed_byte_trie.hpp"
+#include "reader_tuning.hpp"
 #include "find_top_k.hpp"
+#include "counts_replicas.hpp"
 #include "alloc.hpp"
 #include <armadillo>
 #include <fstream>
+#include <chrono>
+#include <memory>
+#include <bit>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Print how long the slowest thread kept running after the median thread had
+// finished; a large tail means the work was not evenly balanced.
+void PrintTailTime(const size_t n,
+                   const std::chrono::steady_clock::time_point passStart,
+                   const std::vector<std::chrono::steady_clock::time_point>& finishTimes)
+{
+  if (finishTimes.empty())
+    return;
+
+  std::vector<double> times;
+  for (const std::chrono::steady_clock::time_point& t : finishTimes)
+    times.push_back(std::chrono::duration<double>(t - passStart).count());
+  std::sort(times.begin(), times.end());
+
+  const double median = times[times.size() / 2];
+  std::cout << n << "-gram pass tail time: " << (times.back() - median)
+      << "s (median thread finished at " << median << "s, last at "
+      << times.back() << "s)." << std::endl;
+}
 
 int main(int argc, char** argv)
 {
-  if (argc != 9)
+  ReaderOptions readerOptions;
+  bool badOption = false;
+  for (int i = 9; i < argc; ++i)
+  {
+    if (!ParseReaderOption(argv[i], readerOptions))
+    {
+      std::cerr << "Unknown option '" << argv[i] << "'." << std::endl;
+      badOption = true;
+    }
+  }
+
+  if (!CheckReaderOptions(readerOptions, std::cerr))
+    badOption = true;
+
+  if (argc < 9 || badOption)
   {
     std::cerr << "Usage: " << argv[0] << " directory/ <n> <k> <overage> "
-        << "<n_threads> <verbosity> <save_intermediate> <output_file_prefix>" << std::endl;
+        << "<n_threads> <verbosity> <save_intermediate> <output_file_prefix> "
+        << "[options]" << std::endl;
     std::cout << " - if save_intermediate is 1, then you get e.g. <output_file_prefix>.3.txt, etc." << std::endl;
     std::cout << " - try <output_file_prefix> as just 'ngrams' to get 'ngrams.n.txt'" << std::endl;
+    PrintReaderOptions(std::cout);
     exit(1);
   }
 
@@ -34,32 +77,173 @@ int main(int argc, char** argv)
   // First pass: 3-grams.
   //
 
-  DirectoryIterator iter({ directory }, false);
+  // A tar stream is read by all reader threads in turn.  If it can't be read
+  // again from the start (e.g. it is stdin) and more than one pass is needed,
+  // it is copied into a pack during the first pass, and later passes read that.
+  const bool tarInput = (readerOptions.backend == reader_backend::backend_tar);
+  int tarFd = -1;
+  std::unique_ptr<TarStream> tarStream;
+  PackWriter spoolWriter;
+  std::string spoolPath;
+  if (tarInput)
+  {
+    tarFd = (directory == "-") ? STDIN_FILENO : open(directory.c_str(), O_RDONLY);
+    if (tarFd == -1)
+    {
+      std::cerr << "Could not open " << directory << "." << std::endl;
+      exit(1);
+    }
+
+    tarStream.reset(new TarStream(tarFd));
+    readerOptions.tarStream = tarStream.get();
+    if (n > 3 && !tarStream->Seekable())
+    {
+      spoolPath = readerOptions.spoolDir + "/pngram-spool-" +
+          std::to_string(getpid()) + ".pack";
+      spoolWriter.Open(spoolPath);
+      tarStream->SpoolTo(&spoolWriter);
+    }
+  }
+
+  DirectoryIterator iter(tarInput ? std::vector<std::filesystem::path>() :
+      std::vector<std::filesystem::path>({ directory }), false);
+  // Which files later passes read (this changes if a tar stream was spooled).
+  DirectoryIterator* passIter = &iter;
+  std::unique_ptr<DirectoryIterator> spoolIter;
 
-  arma::wall_clock overallC, stepC;
+  arma::wall_clock overallC, stepC, allocC;
   overallC.tic();
+
+  if (verbosity > 0)
+  {
+    std::cout << "Using " << CpuLevelName(CpuLevel()) << " counting kernels."
+        << std::endl;
+    std::cout << "Flushing counting threads every "
+        << readerOptions.batchDepth << " files." << std::endl;
+    if (readerOptions.counterPlanes > 0)
+    {
+      // (The counters need enough planes for at least one batch.)
+      const size_t depth = readerOptions.batchDepth;
+      const size_t planes = std::max(readerOptions.counterPlanes,
+          (size_t) std::bit_width(depth));
+      std::cout << "Using " << planes << "-bit sliced counters (flushing "
+          << "every " << ((size_t(1) << planes) - 1) / depth * depth
+          << " files)." << std::endl;
+    }
+  }
+
+  // If requested, list the files once (or load the list) so that later passes
+  // don't have to walk the directory tree again.
+  FileCatalog catalog;
+  if (readerOptions.useCatalog && !tarInput)
+  {
+    stepC.tic();
+    const std::string& catalogFile = readerOptions.catalogFile;
+    const size_t catalogThreads = readerOptions.catalogThreads > 0 ?
+        readerOptions.catalogThreads : threads;
+    if (!catalogFile.empty() && std::filesystem::exists(catalogFile))
+    {
+      catalog.Load(catalogFile);
+    }
+    else
+    {
+      catalog.Build({ directory }, catalogThreads);
+      if (!catalogFile.empty())
+        catalog.Save(catalogFile);
+    }
+
+    if (readerOptions.schedule == file_schedule::schedule_size)
+      catalog.ScheduleBySize();
+    else if (readerOptions.schedule == file_schedule::schedule_inode)
+      catalog.ScheduleByInode();
+    else if (readerOptions.schedule == file_schedule::schedule_extent)
+      catalog.ScheduleByExtent(catalogThreads);
+
+    iter.use_catalog(catalog);
+    iter.set_readers_per_device(readerOptions.readersPerDevice);
+    std::cout << "File catalog time: " << stepC.toc() << "s ("
+        << catalog.Size() << " files)." << std::endl;
+  }
+
+  // If requested, time some reads of the first files to pick the chunk and
+  // ring sizes.  (Packs and tar streams are read differently, so this is only
+  // for directories of files.)
+  if (readerOptions.autoTune &&
+      readerOptions.backend != reader_backend::backend_pack && !tarInput)
+  {
+    stepC.tic();
+    std::vector<std::filesystem::path> sample;
+    DirectoryIterator sampleIter({ directory }, false);
+    std::filesystem::path p;
+    size_t i;
+    while (sample.size() < 64 && sampleIter.get_next(p, i))
+      sample.push_back(p);
+
+    AutoTuneReaderOptions(readerOptions, sample, verbosity);
+    std::cout << "Reader calibration time: " << stepC.toc() << "s."
+        << std::endl;
+  }
+
   stepC.tic();
+  std::chrono::steady_clock::time_point passStart =
+      std::chrono::steady_clock::now();
+  std::vector<std::chrono::steady_clock::time_point> finishTimes(threads);
 
-  CountsArray globalCounts;
+  // Files that are too big for one thread are split across all of them.
+  std::unique_ptr<SplitFileQueue> splitQueue;
+  if (readerOptions.splitThreshold > 0)
+  {
+    splitQueue.reset(new SplitFileQueue(readerOptions.splitThreshold, threads,
+        3, MultiThreadHashCounter::bitsetLen));
+    readerOptions.splitQueue = splitQueue.get();
+  }
+
+  // With more than one NUMA node, each node gets its own replica of the counts
+  // arrays, and its threads only flush into that.
+  std::vector<size_t> numaNodes;
+  if (readerOptions.numa == numa_mode::numa_replicate ||
+      (readerOptions.numa == numa_mode::numa_auto && NumaNodes().size() > 1))
+    numaNodes = NumaNodes();
+
+  // The counts arrays and the bitsets of the counting threads are not zeroed
+  // here: they are fresh pages that the kernel zeroes as the counting threads
+  // first touch them.  So this is only the time to map them.
+  allocC.tic();
+  CountsReplicas<> globalReplicas(numaNodes, readerOptions.narrowCounts);
+  for (size_t r = 0; r < globalReplicas.Replicas(); ++r)
+    globalReplicas.Replica(r).SetPartitioned(readerOptions.partitionedFlush);
+  double allocTime = allocC.toc();
+  if (verbosity > 0 && !numaNodes.empty())
+  {
+    std::cout << "Using " << globalReplicas.Replicas() << " NUMA replicas of "
+        << "the counts arrays." << std::endl;
+  }
   SingleReaderThread** readerThreads = new SingleReaderThread*[threads];
   for (size_t i = 0; i < threads; ++i)
-    readerThreads[i] = new SingleReaderThread(iter, 3, i, verbosity);
+    readerThreads[i] = new SingleReaderThread(iter, 3, i, verbosity,
+        readerOptions);
 
   // Allow readers to initialize.
   usleep(500);
 
+  allocC.tic();
   SingleNgramThread** ngramThreads = new SingleNgramThread*[threads];
   for (size_t i = 0; i < threads; ++i)
   {
-    ngramThreads[i] = new SingleNgramThread(*readerThreads[i], globalCounts, 3,
-        i, verbosity);
+    const size_t r = i % globalReplicas.Replicas();
+    ngramThreads[i] = new SingleNgramThread(*readerThreads[i],
+        globalReplicas.Replica(r), 3, i, verbosity, globalReplicas.Node(r));
   }
+  allocTime += allocC.toc();
 
   // Allow ngram threads to initialize.
   usleep(1000);
 
   for (size_t i = 0; i < threads; ++i)
+  {
     ngramThreads[i]->Finish();
+    finishTimes[i] = ngramThreads[i]->FinishTime();
+  }
 
   for (size_t i = 0; i < threads; ++i)
   {
@@ -67,11 +251,39 @@ int main(int argc, char** argv)
     delete ngramThreads[i];
   }
 
-  std::cout << "3-gram computation time: " << stepC.toc() << "s." << std::endl;
+  std::cout << "3-gram computation time: " << stepC.toc() << "s (including "
+      << allocTime << "s of allocation)." << std::endl;
+  PrintTailTime(3, passStart, finishTimes);
+  if (globalReplicas.Replicas() > 1)
+  {
+    stepC.tic();
+    globalReplicas.Reduce(threads);
+    std::cout << "Replica reduction time: " << stepC.toc() << "s." << std::endl;
+  }
+  CountsArray<>& globalCounts = globalReplicas.Replica(0);
+  if (splitQueue && splitQueue->SplitFiles() > 0)
+  {
+    std::cout << "Split " << splitQueue->SplitFiles() << " large files across "
+        << "threads." << std::endl;
+  }
+  if (verbosity > 0 && globalCounts.Narrow())
+  {
+    std::cout << globalCounts.Spilled() << " 3-gram counts outgrew 16 bits."
+        << std::endl;
+  }
 
   delete[] readerThreads;
   delete[] ngramThreads;
 
+  if (spoolWriter.IsOpen())
+  {
+    tarStream->SpoolTo(NULL);
+    spoolWriter.Close();
+    spoolIter.reset(new DirectoryIterator({ spoolPath }, false));
+    passIter = spoolIter.get();
+    readerOptions.backend = reader_backend::backend_pack;
+  }
+
   // Now sort the top-k.
   stepC.tic();
   size_t keepSize = size_t(double(k) * (n == 3 ? 1.0 : overage));
@@ -116,34 +328,65 @@ int main(int argc, char** argv)
     std::cout << "keepSize: " << keepSize << ", len " << (nIter - 1) << "\n";
     PackedByteTrie<uint32_t> trie(prefixes, prefixCounts, keepSize, nIter - 1);
 
-    CountsArray<false> prefixedCounts(256 * keepSize, &trie);
-
     std::cout << "Trie construction time for length-" << (nIter - 1) << " prefixes: " << stepC.toc()
         << "s." << std::endl;
+    if (verbosity > 0)
+    {
+      std::cout << "Trie takes " << trie.Bytes() << " bytes; looking up "
+          << PrefixMultiThreadHashCounter::TrieGroup(trie,
+          readerOptions.trieGroup) << " prefixes at a time." << std::endl;
+    }
 
     // Take the pass over the data.
     stepC.tic();
-    iter.reset();
+    allocC.tic();
+    CountsReplicas<false> prefixedReplicas(numaNodes, 256 * keepSize, &trie,
+        readerOptions.narrowCounts);
+    for (size_t r = 0; r < prefixedReplicas.Replicas(); ++r)
+    {
+      prefixedReplicas.Replica(r).SetPartitioned(
+          readerOptions.partitionedFlush);
+    }
+    allocTime = allocC.toc();
+
+    passStart = std::chrono::steady_clock::now();
+    passIter->reset();
+    if (readerOptions.backend == reader_backend::backend_tar)
+      tarStream->Rewind();
+    if (readerOptions.splitThreshold > 0)
+    {
+      splitQueue.reset(new SplitFileQueue(readerOptions.splitThreshold,
+          threads, nIter, (256 * keepSize + 63) / 64));
+      readerOptions.splitQueue = splitQueue.get();
+    }
     readerThreads = new SingleReaderThread*[threads];
     for (size_t i = 0; i < threads; ++i)
-      readerThreads[i] = new SingleReaderThread(iter, nIter, i, verbosity);
+      readerThreads[i] = new SingleReaderThread(*passIter, nIter, i, verbosity,
+          readerOptions);
 
     // Allow readers to initialize.
     usleep(500);
 
+    allocC.tic();
     PrefixSingleNgramThread** prefixNgramThreads =
         new PrefixSingleNgramThread*[threads];
     for (size_t i = 0; i < threads; ++i)
     {
+      const size_t r = i % prefixedReplicas.Replicas();
       prefixNgramThreads[i] = new PrefixSingleNgramThread(*readerThreads[i],
-          prefixedCounts, keepSize, &trie, nIter, i, verbosity);
+          prefixedReplicas.Replica(r), keepSize, &trie, nIter, i, verbosity,
+          prefixedReplicas.Node(r));
     }
+    allocTime += allocC.toc();
 
     // Allow ngram threads to initialize.
     usleep(1000);
 
     for (size_t i = 0; i < threads; ++i)
+    {
       prefixNgramThreads[i]->Finish();
+      finishTimes[i] = prefixNgramThreads[i]->FinishTime();
+    }
 
     for (size_t i = 0; i < threads; ++i)
     {
@@ -151,7 +394,27 @@ int main(int argc, char** argv)
       delete prefixNgramThreads[i];
     }
 
-    std::cout << nIter << "-gram computation time: " << stepC.toc() << "s." << std::endl;
+    std::cout << nIter << "-gram computation time: " << stepC.toc()
+        << "s (including " << allocTime << "s of allocation)." << std::endl;
+    PrintTailTime(nIter, passStart, finishTimes);
+    if (prefixedReplicas.Replicas() > 1)
+    {
+      stepC.tic();
+      prefixedReplicas.Reduce(threads);
+      std::cout << "Replica reduction time: " << stepC.toc() << "s."
+          << std::endl;
+    }
+    CountsArray<false>& prefixedCounts = prefixedReplicas.Replica(0);
+    if (splitQueue && splitQueue->SplitFiles() > 0)
+    {
+      std::cout << "Split " << splitQueue->SplitFiles() << " large files "
+          << "across threads." << std::endl;
+    }
+    if (verbosity > 0 && prefixedCounts.Narrow())
+    {
+      std::cout << prefixedCounts.Spilled() << " " << nIter << "-gram counts "
+          << "outgrew 16 bits." << std::endl;
+    }
 
     // Compute top-k results.
     stepC.tic();
@@ -190,6 +453,11 @@ int main(int argc, char** argv)
   free_hugepage<uint8_t>(prefixes, prefixMemState, n * keepSize);
   delete[] prefixCounts;
 
+  if (!spoolPath.empty())
+    unlink(spoolPath.c_str());
+  if (tarFd != -1 && tarFd != STDIN_FILENO)
+    close(tarFd);
+
   std::cout << "Total " << n << "-gram computation time: " << overallC.toc()
       << "s." << std::endl;
 }
@@ -1,5 +1,6 @@
 #include <bitset>
 #include "directory_iterator.hpp"
+#include "alloc.hpp"
 #include <fstream>
 #include <stdint.h>
 #include <unistd.h>
@@ -21,8 +22,15 @@ int main(int argc, char** argv)
   uint32_t* counts = new uint32_t[16777216];
   memset(counts, 0, sizeof(uint32_t) * 16777216);
 
-  unsigned char local_buffer[4096];
-  size_t chunk_size = 4096;
+  // O_DIRECT needs an aligned buffer; the first 4KB holds the last two bytes of
+  // the previous read, so each read still lands on an aligned address.
+  constexpr size_t align = 4096;
+  constexpr size_t chunk_size = (1 << 20);
+  unsigned char* local_buffer;
+  alloc_mem_state buffer_mem_state;
+  alloc_hugepage<unsigned char>(local_buffer, buffer_mem_state,
+      align + chunk_size, "reading");
+  bool use_direct = true;
 
   std::filesystem::path p;
   size_t i;
@@ -31,7 +39,14 @@ int main(int argc, char** argv)
     if (i % 100 == 0)
       std::cout << "Processing file " << i << "..." << std::endl;
 
-    int fd = open(p.c_str(), O_RDONLY); // TODO: O_DIRECT
+    int fd = open(p.c_str(), O_RDONLY | (use_direct ? O_DIRECT : 0));
+    if (fd == -1 && use_direct && errno == EINVAL)
+    {
+      // This filesystem doesn't support O_DIRECT.
+      use_direct = false;
+      fd = open(p.c_str(), O_RDONLY);
+    }
+
     if (fd == -1)
     {
       // check errno, something went wrong
@@ -39,25 +54,35 @@ int main(int argc, char** argv)
       continue;
     }
 
-    // read into buffer
+    // read into buffer, keeping the last two bytes of each read so that no
+    // 3-gram is split across reads
+    size_t carry = 0;
     ssize_t bytes_read = 0;
     do
     {
-      bytes_read = read(fd, local_buffer, chunk_size);
-      if (bytes_read > 2)
+      bytes_read = read(fd, local_buffer + align, chunk_size);
+      if (bytes_read == -1 && errno == EINVAL && use_direct)
+      {
+        // O_DIRECT was accepted by open() but not by read().
+        use_direct = false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        bytes_read = read(fd, local_buffer + align, chunk_size);
+      }
+
+      if (bytes_read > 0)
       {
         // process chunk
-        for (size_t b = 0; b < (bytes_read - 2); ++b)
+        const unsigned char* chunk = local_buffer + align - carry;
+        const size_t bytes = carry + bytes_read;
+        for (size_t b = 0; b + 2 < bytes; ++b)
         {
-          const size_t index = ((size_t(local_buffer[b]) << 16) +
-              (size_t(local_buffer[b + 1]) << 8) + size_t(local_buffer[b + 2]));
+          const size_t index = ((size_t(chunk[b]) << 16) +
+              (size_t(chunk[b + 1]) << 8) + size_t(chunk[b + 2]));
           bits[index] = true;
         }
 
-        // rewind for next read
-        off_t o = -2;
-        if (lseek(fd, -o, SEEK_CUR) == -1)
-          std::cout << "lseek fail!\n";
+        carry = std::min(bytes, (size_t) 2);
+        memmove(local_buffer + align - carry, chunk + bytes - carry, carry);
       }
       else if (bytes_read == -1)
       {
@@ -86,4 +111,6 @@ int main(int argc, char** argv)
   }
 
   delete[] counts;
+  free_hugepage<unsigned char>(local_buffer, buffer_mem_state,
+      align + chunk_size);
 }
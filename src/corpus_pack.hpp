@@ -0,0 +1,89 @@
+// corpus_pack.hpp: the on-disk format of a corpus pack, which holds the
+// contents of many samples (files) back to back so that they can be read with a
+// few large sequential reads instead of one open()/read()/close() per sample.
+//
+// A pack looks like this:
+//
+//   PackHeader                  (padded to packDataAlignment bytes)
+//   sample data                 (each sample starts at a multiple of
+//                                packSampleAlignment)
+//   PackIndexEntry[count]       (at header.indexOffset)
+//
+// Packs are written by pack_corpus and read by SingleReaderThread when
+// --reader=pack is given.
+#ifndef PNGRAM_CORPUS_PACK_HPP
+#define PNGRAM_CORPUS_PACK_HPP
+
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+#include <string>
+
+static constexpr char packMagic[8] = { 'P', 'N', 'G', 'P', 'A', 'C', 'K', '1' };
+// Sample data starts at this offset, so it can be read with O_DIRECT.
+static constexpr size_t packDataAlignment = 4096;
+// Each sample starts at a multiple of this.
+static constexpr size_t packSampleAlignment = 64;
+
+struct PackHeader
+{
+  char magic[8];
+  uint64_t count; // number of samples in the pack
+  uint64_t indexOffset; // where the index starts (and the sample data ends)
+  uint64_t dataOffset; // where the sample data starts
+};
+
+struct PackIndexEntry
+{
+  uint64_t fileId; // unique across all packs made from the same directory
+  uint64_t offset; // where the sample starts, from the start of the pack
+  uint64_t length;
+  uint32_t label; // optional label given to pack_corpus (0 if none)
+  uint32_t reserved;
+};
+
+// Read and check the header and index of an open pack.  The index is returned
+// sorted by offset.  Returns false if this is not a valid pack.
+inline bool ReadPackIndex(const int fd,
+                          PackHeader& header,
+                          std::vector<PackIndexEntry>& index);
+
+// Writes samples into a pack, one after another.
+class PackWriter
+{
+ public:
+  PackWriter() : fd(-1), offset(0) { }
+  inline ~PackWriter();
+
+  // Start a new pack.  Throws a std::runtime_error on any I/O error (here or
+  // in any of the other functions).
+  inline void Open(const std::string& filename);
+  bool IsOpen() const { return fd != -1; }
+
+  // Add a sample: call BeginSample(), then Write() its contents (in as many
+  // pieces as needed), then EndSample().
+  inline void BeginSample(const uint64_t fileId, const uint32_t label = 0);
+  inline void Write(const void* data, const size_t len);
+  inline void EndSample();
+
+  // Write the index and header, and close the pack.
+  inline void Close();
+
+  // Bytes of sample data written to the current pack so far.
+  size_t DataBytes() const { return IsOpen() ? offset - packDataAlignment : 0; }
+  size_t Samples() const { return index.size(); }
+
+ private:
+  // Write zeros until the pack is `newOffset` bytes long.
+  inline void PadTo(const size_t newOffset);
+
+  std::string filename;
+  int fd;
+  size_t offset;
+  std::vector<PackIndexEntry> index;
+};
+
+#include "corpus_pack_impl.hpp"
+
+#endif
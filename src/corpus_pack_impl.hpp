@@ -0,0 +1,131 @@
+// corpus_pack_impl.hpp: implementation of corpus pack reading and writing.
+#ifndef PNGRAM_CORPUS_PACK_IMPL_HPP
+#define PNGRAM_CORPUS_PACK_IMPL_HPP
+
+#include "corpus_pack.hpp"
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <stdexcept>
+
+inline bool ReadPackIndex(const int fd,
+                          PackHeader& header,
+                          std::vector<PackIndexEntry>& index)
+{
+  if (pread(fd, &header, sizeof(PackHeader), 0) != sizeof(PackHeader) ||
+      memcmp(header.magic, packMagic, sizeof(packMagic)) != 0 ||
+      header.dataOffset > header.indexOffset)
+    return false;
+
+  index.resize(header.count);
+  const size_t indexBytes = sizeof(PackIndexEntry) * header.count;
+  if (pread(fd, index.data(), indexBytes, header.indexOffset) !=
+      ssize_t(indexBytes))
+    return false;
+
+  for (const PackIndexEntry& e : index)
+  {
+    if (e.offset < header.dataOffset || e.offset > header.indexOffset ||
+        e.length > header.indexOffset - e.offset)
+      return false;
+  }
+
+  std::sort(index.begin(), index.end(),
+      [](const PackIndexEntry& a, const PackIndexEntry& b)
+      { return a.offset < b.offset; });
+  return true;
+}
+
+inline PackWriter::~PackWriter()
+{
+  if (IsOpen())
+    Close();
+}
+
+inline void PackWriter::Open(const std::string& filenameIn)
+{
+  if (IsOpen())
+    Close();
+
+  filename = filenameIn;
+  fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+  {
+    throw std::runtime_error("could not open " + filename + ": " +
+        strerror(errno));
+  }
+
+  // The header is written last, once we know where the index is.
+  offset = 0;
+  index.clear();
+  PadTo(packDataAlignment);
+}
+
+inline void PackWriter::BeginSample(const uint64_t fileId,
+                                    const uint32_t label)
+{
+  PadTo(((offset + packSampleAlignment - 1) / packSampleAlignment) *
+      packSampleAlignment);
+
+  PackIndexEntry e;
+  memset(&e, 0, sizeof(PackIndexEntry));
+  e.fileId = fileId;
+  e.offset = offset;
+  e.label = label;
+  index.push_back(e);
+}
+
+inline void PackWriter::Write(const void* data, size_t len)
+{
+  const char* p = (const char*) data;
+  while (len > 0)
+  {
+    const ssize_t written = write(fd, p, len);
+    if (written == -1)
+    {
+      throw std::runtime_error("write to " + filename + " failed: " +
+          strerror(errno));
+    }
+
+    p += written;
+    len -= written;
+    offset += written;
+  }
+}
+
+inline void PackWriter::EndSample()
+{
+  index.back().length = offset - index.back().offset;
+}
+
+inline void PackWriter::Close()
+{
+  const size_t indexOffset = ((offset + packSampleAlignment - 1) /
+      packSampleAlignment) * packSampleAlignment;
+  PadTo(indexOffset);
+  Write(index.data(), sizeof(PackIndexEntry) * index.size());
+
+  PackHeader header;
+  memset(&header, 0, sizeof(PackHeader));
+  memcpy(header.magic, packMagic, sizeof(packMagic));
+  header.count = index.size();
+  header.indexOffset = indexOffset;
+  header.dataOffset = packDataAlignment;
+  if (pwrite(fd, &header, sizeof(PackHeader), 0) != sizeof(PackHeader))
+  {
+    throw std::runtime_error("write to " + filename + " failed: " +
+        strerror(errno));
+  }
+
+  close(fd);
+  fd = -1;
+}
+
+inline void PackWriter::PadTo(const size_t newOffset)
+{
+  static const char zeros[packSampleAlignment] = { 0 };
+  while (offset < newOffset)
+    Write(zeros, std::min(newOffset - offset, packSampleAlignment));
+}
+
+#endif
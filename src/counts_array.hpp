@@ -3,70 +3,100 @@
 
 #include "simd_util.hpp"
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <utility>
 #include "alloc.hpp"
 #include <string>
 #include "packed_byte_trie.hpp"
+#include "numa_util.hpp"
+
+// The most bitsets that can be flushed into a CountsArray at once.
+constexpr size_t maxBatchDepth = 32;
+
+// Call f.template operator()<Depth>() with Depth equal to `depth` (1 to
+// maxBatchDepth), so that flush loops can be compiled for each batch depth and
+// picked at runtime.
+template<typename F>
+inline void WithBatchDepth(const size_t depth, F&& f);
 
 template<bool FixedSize = true>
 class CountsArray
 {
  public:
-  CountsArray();
-  CountsArray(const size_t size, const PackedByteTrie<uint32_t>* prefixTrie);
+  // If `narrow` is true, counts are stored in 16 bits, and whatever does not
+  // fit goes to an overflow table; this halves the size of the array (and the
+  // memory traffic of flushes into it), and the counts are still exact.  If
+  // `numaNode` is not -1, the array is placed on that NUMA node.
+  CountsArray(const bool narrow = false, const int numaNode = -1);
+  CountsArray(const size_t size,
+              const PackedByteTrie<uint32_t>* prefixTrie,
+              const bool narrow = false,
+              const int numaNode = -1);
   ~CountsArray();
 
-  inline void Increment(const size_t index,
-                        const uint64_t bits);
-
-  inline void Increment(const size_t index,
-                        const uint64_t bits1,
-                        const uint64_t bits2);
-
-  inline void Increment(const size_t index,
-                        const uint64_t bits1,
-                        const uint64_t bits2,
-                        const uint64_t bits3);
-
-  inline void Increment(const size_t index,
-                        const uint64_t bits1,
-                        const uint64_t bits2,
-                        const uint64_t bits3,
-                        const uint64_t bits4);
-
-  inline void Increment(const size_t index,
-                        const uint64_t bits1,
-                        const uint64_t bits2,
-                        const uint64_t bits3,
-                        const uint64_t bits4,
-                        const uint64_t bits5,
-                        const uint64_t bits6,
-                        const uint64_t bits7,
-                        const uint64_t bits8);
-
-  inline void Increment(const size_t index,
-                        const uint64_t bits1,
-                        const uint64_t bits2,
-                        const uint64_t bits3,
-                        const uint64_t bits4,
-                        const uint64_t bits5,
-                        const uint64_t bits6,
-                        const uint64_t bits7,
-                        const uint64_t bits8,
-                        const uint64_t bits9,
-                        const uint64_t bits10,
-                        const uint64_t bits11,
-                        const uint64_t bits12,
-                        const uint64_t bits13,
-                        const uint64_t bits14,
-                        const uint64_t bits15,
-                        const uint64_t bits16);
+  // Each Increment() takes one of the striped mutexes, because each u32_512 is
+  // not atomic.  With Locked = false it doesn't, and the caller must own the
+  // range of the array that `index` is in (see ForEachOwnedRange()).
+  //
+  // Count each set bit of each of `bits` (1 to maxBatchDepth words, one from
+  // each of a batch of bitsets): bit j counts towards element 64 * index + j.
+  template<bool Locked = true, typename... Bits>
+  inline void Increment(const size_t index, const Bits... bits);
+
+  // The same, for the Depth words bits[0], bits[stride], ...,
+  // bits[(Depth - 1) * stride].  Use WithBatchDepth() to pick Depth at
+  // runtime.
+  template<size_t Depth, bool Locked = true>
+  inline void IncrementBatch(const size_t index,
+                             const uint64_t* bits,
+                             const size_t stride);
+
+  // Add the numbers held bit-sliced in planes[0], planes[stride], ...,
+  // planes[(numPlanes - 1) * stride]: bit j of plane p is bit p of the number
+  // to add to element 64 * index + j.
+  template<bool Locked = true>
+  inline void IncrementSliced(const size_t index,
+                              const uint64_t* planes,
+                              const size_t stride,
+                              const size_t numPlanes);
+
+  // In partitioned mode, every flush into the array must go through
+  // ForEachOwnedRange() and Increment<false>(), instead of taking a mutex for
+  // each Increment().  Set this before any thread flushes into the array.
+  void SetPartitioned(const bool p) { partitioned = p; }
+  bool Partitioned() const { return partitioned; }
+
+  // Call f(begin, end) for pieces [begin, end) of the bitset indices [0, len)
+  // (index i covers counts 64 * i to 64 * i + 63), together covering all of
+  // them, while this thread owns the part of the array that the piece maps to.
+  // Each call starts at a different range, so that threads that flush at the
+  // same time don't chase each other through the array; ranges owned by
+  // another thread are skipped and come back to at the end.
+  template<typename F>
+  inline void ForEachOwnedRange(const size_t len, F&& f);
+
+  // Bitset indices in each owned range (256KB of counts).
+  static constexpr size_t rangeLen = 1024;
 
   uint32_t Maximum() const;
 
   void Save(const std::string& filename) const;
 
+  // Add blocks [begin, end) (16 counts each) of `other`, which must be the
+  // same size, to this array.  Threads may do this for different ranges at
+  // once, but nothing else may use the arrays meanwhile.
+  inline void AddFrom(const CountsArray& other,
+                      const size_t begin,
+                      const size_t end);
+
   uint32_t operator[](const size_t i) const;
+  bool Narrow() const { return narrowCounts != nullptr; }
+  // The number of counts that have outgrown 16 bits (if Narrow()).
+  size_t Spilled() const { return overflow.size(); }
   constexpr size_t Size() const { return FixedSize ? 16777216 : 16 * size; }
+  constexpr size_t Blocks() const { return FixedSize ? 1048576 : size; }
   size_t CopyPrefixes(uint8_t* prefixes,
                       const uint32_t minValForCopy,
                       size_t numWithMinValToCopy,
@@ -75,8 +105,36 @@ class CountsArray
  private:
   u32_512* counts;
   alloc_mem_state countsMemState;
+  // With narrow counts, the low 16 bits of count i are in narrowCounts, and
+  // if bit i of spilledBits is set, overflow[i] holds the rest.
+  u16_256* narrowCounts;
+  alloc_mem_state narrowCountsMemState;
+  std::mutex overflowMutex;
+  std::unordered_map<size_t, uint32_t> overflow;
+  std::vector<uint64_t> spilledBits;
   std::mutex* mutexes;
   size_t size;
+
+  bool partitioned;
+  std::atomic<uint8_t>* owners;
+  size_t numRanges;
+  std::atomic<size_t> flushTicket;
+
+  inline void Allocate(const size_t blocks,
+                       const bool narrow,
+                       const int numaNode);
+  // Get the 16 counts of block `block` into `out` (an out-parameter, since
+  // returning a 64-byte vector changes the ABI outside AVX-512 code).
+  inline void Block(const size_t block, u32_512& out) const;
+  // Add `incr` to the 16 counts of block `block`.
+  inline void Add(const size_t block, const u32_512& incr);
+  // Move the parts of narrow counts past 16 bits to the overflow table.
+  // This is kept out of line, so that the flush kernels (which are compiled
+  // for each instruction set and batch depth) stay small.
+  void Spill(const size_t block, const u32_512& high);
+
+  inline bool TryOwn(const size_t range);
+  inline void Disown(const size_t range);
   const PackedByteTrie<uint32_t>* prefixTrie;
   uint8_t* prefixTrieKey;
   size_t prefixTrieLoc;
@@ -4,405 +4,224 @@
 #include "counts_array.hpp"
 #include <cstring>
 #include <fstream>
+#include <vector>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+
+template<typename F, size_t... Depths>
+inline void WithBatchDepth(const size_t depth,
+                           F& f,
+                           std::index_sequence<Depths...>)
+{
+  const bool found = ((depth == Depths + 1 &&
+      (f.template operator()<Depths + 1>(), true)) || ...);
+  if (!found)
+    throw std::runtime_error("Batch depth must be between 1 and " +
+        std::to_string(maxBatchDepth) + "!");
+}
+
+template<typename F>
+inline void WithBatchDepth(const size_t depth, F&& f)
+{
+  WithBatchDepth(depth, f, std::make_index_sequence<maxBatchDepth>());
+}
 
 template<bool FixedSize>
-inline CountsArray<FixedSize>::CountsArray() :
+inline CountsArray<FixedSize>::CountsArray(const bool narrow,
+                                           const int numaNode) :
+    partitioned(false),
+    numRanges(262144 / rangeLen),
+    flushTicket(0),
     prefixTrie(nullptr)
 {
   if (FixedSize == false)
     throw std::runtime_error("Must initialize CountsArray with a size!");
 
-  alloc_hugepage<u32_512>(counts, countsMemState, 1048576, "n-gramming");
+  Allocate(1048576, narrow, numaNode);
   mutexes = new std::mutex[8192];
-
-  for (size_t i = 0; i < 1048576; ++i)
-    for (size_t j = 0; j < 16; ++j)
-      counts[i][j] = uint32_t(0);
+  owners = new std::atomic<uint8_t>[numRanges];
+  for (size_t i = 0; i < numRanges; ++i)
+    owners[i] = 0;
 }
 
 template<bool FixedSize>
 inline CountsArray<FixedSize>::CountsArray(const size_t sizeIn,
-                                           const PackedByteTrie<uint32_t>* prefixTrieIn) :
+                                           const PackedByteTrie<uint32_t>* prefixTrieIn,
+                                           const bool narrow,
+                                           const int numaNode) :
     size(sizeIn / 16),
+    partitioned(false),
+    numRanges((size / 4 + rangeLen - 1) / rangeLen),
+    flushTicket(0),
     prefixTrie(prefixTrieIn)
 {
   if (FixedSize == true)
     throw std::runtime_error("Must initialize CountsArray without a size!");
 
-  alloc_hugepage<u32_512>(counts, countsMemState, size, "n-gramming");
+  Allocate(size, narrow, numaNode);
   mutexes = new std::mutex[(size + 127) / 128];
-
-  for (size_t i = 0; i < size; ++i)
-    for (size_t j = 0; j < 16; ++j)
-      counts[i][j] = uint32_t(0);
+  owners = new std::atomic<uint8_t>[numRanges];
+  for (size_t i = 0; i < numRanges; ++i)
+    owners[i] = 0;
 }
 
 template<bool FixedSize>
 inline CountsArray<FixedSize>::~CountsArray()
 {
   delete[] mutexes;
-  free_hugepage<u32_512>(counts, countsMemState, FixedSize ? 1048576 : size);
+  delete[] owners;
+  if (narrowCounts != nullptr)
+  {
+    free_hugepage<u16_256>(narrowCounts, narrowCountsMemState,
+        FixedSize ? 1048576 : size);
+  }
+  else
+  {
+    free_hugepage<u32_512>(counts, countsMemState, FixedSize ? 1048576 : size);
+  }
 }
 
 template<bool FixedSize>
-inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits)
+inline void CountsArray<FixedSize>::Allocate(const size_t blocks,
+                                             const bool narrow,
+                                             const int numaNode)
 {
-  // required because each u32_512 is not atomic
-  const size_t blockIndex = index * 4;
-  const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
-
-  // After tuning, this prefetch does make a bit of a difference, and the right
-  // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  __builtin_prefetch(&counts[blockIndex + 5], 1, 3);
-
-  constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
-                                   0x0010, 0x0020, 0x0040, 0x0080,
-                                   0x0100, 0x0200, 0x0400, 0x0800,
-                                   0x1000, 0x2000, 0x4000, 0x8000 };
-  constexpr const u32_512 shift = { 0x0000, 0x0001, 0x0002, 0x0003,
-                                    0x0004, 0x0005, 0x0006, 0x0007,
-                                    0x0008, 0x0009, 0x000a, 0x000b,
-                                    0x000c, 0x000d, 0x000e, 0x000f };
-
-  uint32_t bits32_1 = (uint32_t(bits) & 0x0000FFFF);
-  uint32_t bits32_2 = ((uint32_t(bits) & 0xFFFF0000) >> 16);
-  uint32_t bits32_3 = (uint64_t(bits >> 32) & 0x0000FFFF);
-  uint32_t bits32_4 = ((uint64_t(bits >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1 = { bits32_1, bits32_1, bits32_1, bits32_1,
-                    bits32_1, bits32_1, bits32_1, bits32_1,
-                    bits32_1, bits32_1, bits32_1, bits32_1,
-                    bits32_1, bits32_1, bits32_1, bits32_1 };
-  u32_512 incr2 = { bits32_2, bits32_2, bits32_2, bits32_2,
-                    bits32_2, bits32_2, bits32_2, bits32_2,
-                    bits32_2, bits32_2, bits32_2, bits32_2,
-                    bits32_2, bits32_2, bits32_2, bits32_2 };
-  u32_512 incr3 = { bits32_3, bits32_3, bits32_3, bits32_3,
-                    bits32_3, bits32_3, bits32_3, bits32_3,
-                    bits32_3, bits32_3, bits32_3, bits32_3,
-                    bits32_3, bits32_3, bits32_3, bits32_3 };
-  u32_512 incr4 = { bits32_4, bits32_4, bits32_4, bits32_4,
-                    bits32_4, bits32_4, bits32_4, bits32_4,
-                    bits32_4, bits32_4, bits32_4, bits32_4,
-                    bits32_4, bits32_4, bits32_4, bits32_4 };
-
-  counts[blockIndex]     += ((incr1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr4 & mask) >> shift);
+  counts = nullptr;
+  narrowCounts = nullptr;
+  if (narrow)
+  {
+    alloc_zeroed_hugepage<u16_256>(narrowCounts, narrowCountsMemState, blocks,
+        "n-gramming");
+    if (numaNode >= 0)
+      BindToNumaNode(narrowCounts, sizeof(u16_256) * blocks, numaNode);
+    spilledBits.resize((16 * blocks + 63) / 64, 0);
+  }
+  else
+  {
+    alloc_zeroed_hugepage<u32_512>(counts, countsMemState, blocks,
+        "n-gramming");
+    if (numaNode >= 0)
+      BindToNumaNode(counts, sizeof(u32_512) * blocks, numaNode);
+  }
 }
 
 template<bool FixedSize>
-inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits1,
-                                              const uint64_t bits2)
+inline void CountsArray<FixedSize>::Add(const size_t block,
+                                        const u32_512& incr)
 {
-  // required because each u32_512 is not atomic
-  const size_t blockIndex = index * 4;
-  const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
-
-  // After tuning, this prefetch does make a bit of a difference, and the right
-  // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  //__builtin_prefetch(&counts[blockIndex + 16], 1, 3);
-
-  constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
-                                   0x0010, 0x0020, 0x0040, 0x0080,
-                                   0x0100, 0x0200, 0x0400, 0x0800,
-                                   0x1000, 0x2000, 0x4000, 0x8000 };
-  constexpr const u32_512 shift = { 0x0000, 0x0001, 0x0002, 0x0003,
-                                    0x0004, 0x0005, 0x0006, 0x0007,
-                                    0x0008, 0x0009, 0x000a, 0x000b,
-                                    0x000c, 0x000d, 0x000e, 0x000f };
-
-  uint32_t bits32_1_1 = (uint32_t(bits1) & 0x0000FFFF);
-  uint32_t bits32_1_2 = ((uint32_t(bits1) & 0xFFFF0000) >> 16);
-  uint32_t bits32_1_3 = (uint64_t(bits1 >> 32) & 0x0000FFFF);
-  uint32_t bits32_1_4 = ((uint64_t(bits1 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1_1 = { bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1 };
-  u32_512 incr1_2 = { bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2 };
-  u32_512 incr1_3 = { bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3 };
-  u32_512 incr1_4 = { bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4 };
+  if (narrowCounts == nullptr)
+  {
+    counts[block] += incr;
+    return;
+  }
 
-  uint32_t bits32_2_1 = (uint32_t(bits2) & 0x0000FFFF);
-  uint32_t bits32_2_2 = ((uint32_t(bits2) & 0xFFFF0000) >> 16);
-  uint32_t bits32_2_3 = (uint64_t(bits2 >> 32) & 0x0000FFFF);
-  uint32_t bits32_2_4 = ((uint64_t(bits2 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr2_1 = { bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1 };
-  u32_512 incr2_2 = { bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2 };
-  u32_512 incr2_3 = { bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3 };
-  u32_512 incr2_4 = { bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4 };
+  const u32_512 sum = __builtin_convertvector(narrowCounts[block], u32_512) +
+      incr;
+  narrowCounts[block] = __builtin_convertvector(sum, u16_256);
 
-  counts[blockIndex]     += ((incr1_1 & mask) >> shift) + ((incr2_1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr1_2 & mask) >> shift) + ((incr2_2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr1_3 & mask) >> shift) + ((incr2_3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr1_4 & mask) >> shift) + ((incr2_4 & mask) >> shift);
+  // This is rare: even the most common n-grams only spill once every 65536
+  // increments.
+  const u512 high = (u512) (sum >> 16);
+  if ((high[0] | high[1] | high[2] | high[3] | high[4] | high[5] | high[6] |
+       high[7]) != 0)
+  {
+    const u32_512 spill = (sum >> 16);
+    Spill(block, spill);
+  }
 }
 
 template<bool FixedSize>
-inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits1,
-                                              const uint64_t bits2,
-                                              const uint64_t bits3)
+__attribute__((noinline))
+void CountsArray<FixedSize>::Spill(const size_t block, const u32_512& high)
 {
-  // required because each u32_512 is not atomic
-  const size_t blockIndex = index * 4;
-  const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
-
-  // After tuning, this prefetch does make a bit of a difference, and the right
-  // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  //__builtin_prefetch(&counts[blockIndex + 16], 1, 3);
-
-  constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
-                                   0x0010, 0x0020, 0x0040, 0x0080,
-                                   0x0100, 0x0200, 0x0400, 0x0800,
-                                   0x1000, 0x2000, 0x4000, 0x8000 };
-  constexpr const u32_512 shift = { 0x0000, 0x0001, 0x0002, 0x0003,
-                                    0x0004, 0x0005, 0x0006, 0x0007,
-                                    0x0008, 0x0009, 0x000a, 0x000b,
-                                    0x000c, 0x000d, 0x000e, 0x000f };
+  std::unique_lock lock(overflowMutex);
+  for (size_t j = 0; j < 16; ++j)
+  {
+    if (high[j] == 0)
+      continue;
 
-  uint32_t bits32_1_1 = (uint32_t(bits1) & 0x0000FFFF);
-  uint32_t bits32_1_2 = ((uint32_t(bits1) & 0xFFFF0000) >> 16);
-  uint32_t bits32_1_3 = (uint64_t(bits1 >> 32) & 0x0000FFFF);
-  uint32_t bits32_1_4 = ((uint64_t(bits1 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1_1 = { bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1 };
-  u32_512 incr1_2 = { bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2 };
-  u32_512 incr1_3 = { bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3 };
-  u32_512 incr1_4 = { bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4 };
+    const size_t i = 16 * block + j;
+    overflow[i] += high[j];
+    spilledBits[i / 64] |= (uint64_t(1) << (i % 64));
+  }
+}
 
-  uint32_t bits32_2_1 = (uint32_t(bits2) & 0x0000FFFF);
-  uint32_t bits32_2_2 = ((uint32_t(bits2) & 0xFFFF0000) >> 16);
-  uint32_t bits32_2_3 = (uint64_t(bits2 >> 32) & 0x0000FFFF);
-  uint32_t bits32_2_4 = ((uint64_t(bits2 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr2_1 = { bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1 };
-  u32_512 incr2_2 = { bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2 };
-  u32_512 incr2_3 = { bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3 };
-  u32_512 incr2_4 = { bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4 };
+template<bool FixedSize>
+inline void CountsArray<FixedSize>::Block(const size_t block,
+                                          u32_512& out) const
+{
+  if (narrowCounts == nullptr)
+  {
+    out = counts[block];
+    return;
+  }
 
-  uint32_t bits32_3_1 = (uint32_t(bits3) & 0x0000FFFF);
-  uint32_t bits32_3_2 = ((uint32_t(bits3) & 0xFFFF0000) >> 16);
-  uint32_t bits32_3_3 = (uint64_t(bits3 >> 32) & 0x0000FFFF);
-  uint32_t bits32_3_4 = ((uint64_t(bits3 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr3_1 = { bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1 };
-  u32_512 incr3_2 = { bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2 };
-  u32_512 incr3_3 = { bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3 };
-  u32_512 incr3_4 = { bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4 };
+  out = __builtin_convertvector(narrowCounts[block], u32_512);
+  // The 16 spilled bits of the block.
+  const uint64_t spilled = (spilledBits[block / 4] >> (16 * (block % 4))) &
+      0xFFFF;
+  if (spilled != 0)
+  {
+    for (size_t j = 0; j < 16; ++j)
+    {
+      if (spilled & (uint64_t(1) << j))
+        out[j] += (overflow.at(16 * block + j) << 16);
+    }
+  }
+}
 
-  counts[blockIndex]     += ((incr1_1 & mask) >> shift) +
-      ((incr2_1 & mask) >> shift) + ((incr3_1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr1_2 & mask) >> shift) +
-      ((incr2_2 & mask) >> shift) + ((incr3_2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr1_3 & mask) >> shift) +
-      ((incr2_3 & mask) >> shift) + ((incr3_3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr1_4 & mask) >> shift) +
-      ((incr2_4 & mask) >> shift) + ((incr3_4 & mask) >> shift);
+template<bool FixedSize>
+inline void CountsArray<FixedSize>::AddFrom(const CountsArray& other,
+                                            const size_t begin,
+                                            const size_t end)
+{
+  for (size_t b = begin; b < end; ++b)
+  {
+    u32_512 incr;
+    other.Block(b, incr);
+    const u512 any = (u512) incr;
+    if ((any[0] | any[1] | any[2] | any[3] | any[4] | any[5] | any[6] |
+         any[7]) != 0)
+      Add(b, incr);
+  }
 }
 
 template<bool FixedSize>
+template<bool Locked, typename... Bits>
 inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits1,
-                                              const uint64_t bits2,
-                                              const uint64_t bits3,
-                                              const uint64_t bits4)
+                                              const Bits... bits)
 {
-  // required because each u32_512 is not atomic
-  const size_t blockIndex = index * 4;
-  const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
-
-  // After tuning, this prefetch does make a bit of a difference, and the right
-  // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  //__builtin_prefetch(&counts[blockIndex + 16], 1, 3);
-
-  constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
-                                   0x0010, 0x0020, 0x0040, 0x0080,
-                                   0x0100, 0x0200, 0x0400, 0x0800,
-                                   0x1000, 0x2000, 0x4000, 0x8000 };
-  constexpr const u32_512 shift = { 0x0000, 0x0001, 0x0002, 0x0003,
-                                    0x0004, 0x0005, 0x0006, 0x0007,
-                                    0x0008, 0x0009, 0x000a, 0x000b,
-                                    0x000c, 0x000d, 0x000e, 0x000f };
-
-  uint32_t bits32_1_1 = (uint32_t(bits1) & 0x0000FFFF);
-  uint32_t bits32_1_2 = ((uint32_t(bits1) & 0xFFFF0000) >> 16);
-  uint32_t bits32_1_3 = (uint64_t(bits1 >> 32) & 0x0000FFFF);
-  uint32_t bits32_1_4 = ((uint64_t(bits1 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1_1 = { bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1 };
-  u32_512 incr1_2 = { bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2 };
-  u32_512 incr1_3 = { bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3 };
-  u32_512 incr1_4 = { bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4 };
-
-  uint32_t bits32_2_1 = (uint32_t(bits2) & 0x0000FFFF);
-  uint32_t bits32_2_2 = ((uint32_t(bits2) & 0xFFFF0000) >> 16);
-  uint32_t bits32_2_3 = (uint64_t(bits2 >> 32) & 0x0000FFFF);
-  uint32_t bits32_2_4 = ((uint64_t(bits2 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr2_1 = { bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1 };
-  u32_512 incr2_2 = { bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2 };
-  u32_512 incr2_3 = { bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3 };
-  u32_512 incr2_4 = { bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4 };
-
-  uint32_t bits32_3_1 = (uint32_t(bits3) & 0x0000FFFF);
-  uint32_t bits32_3_2 = ((uint32_t(bits3) & 0xFFFF0000) >> 16);
-  uint32_t bits32_3_3 = (uint64_t(bits3 >> 32) & 0x0000FFFF);
-  uint32_t bits32_3_4 = ((uint64_t(bits3 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr3_1 = { bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1 };
-  u32_512 incr3_2 = { bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2 };
-  u32_512 incr3_3 = { bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3 };
-  u32_512 incr3_4 = { bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4 };
-
-  uint32_t bits32_4_1 = (uint32_t(bits4) & 0x0000FFFF);
-  uint32_t bits32_4_2 = ((uint32_t(bits4) & 0xFFFF0000) >> 16);
-  uint32_t bits32_4_3 = (uint64_t(bits4 >> 32) & 0x0000FFFF);
-  uint32_t bits32_4_4 = ((uint64_t(bits4 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr4_1 = { bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1 };
-  u32_512 incr4_2 = { bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2 };
-  u32_512 incr4_3 = { bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3 };
-  u32_512 incr4_4 = { bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4 };
-
-  counts[blockIndex]     += ((incr1_1 & mask) >> shift) +
-      ((incr2_1 & mask) >> shift) + ((incr3_1 & mask) >> shift) +
-      ((incr4_1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr1_2 & mask) >> shift) +
-      ((incr2_2 & mask) >> shift) + ((incr3_2 & mask) >> shift) +
-      ((incr4_2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr1_3 & mask) >> shift) +
-      ((incr2_3 & mask) >> shift) + ((incr3_3 & mask) >> shift) +
-      ((incr4_3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr1_4 & mask) >> shift) +
-      ((incr2_4 & mask) >> shift) + ((incr3_4 & mask) >> shift) +
-      ((incr4_4 & mask) >> shift);
+  const uint64_t words[] = { uint64_t(bits)... };
+  IncrementBatch<sizeof...(Bits), Locked>(index, words, 1);
 }
 
 template<bool FixedSize>
-inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits1,
-                                              const uint64_t bits2,
-                                              const uint64_t bits3,
-                                              const uint64_t bits4,
-                                              const uint64_t bits5,
-                                              const uint64_t bits6,
-                                              const uint64_t bits7,
-                                              const uint64_t bits8)
+template<size_t Depth, bool Locked>
+inline void CountsArray<FixedSize>::IncrementBatch(const size_t index,
+                                                   const uint64_t* bits,
+                                                   const size_t stride)
 {
-  // required because each u32_512 is not atomic
+  static_assert(Depth >= 1 && Depth <= maxBatchDepth,
+      "batch depth must be between 1 and maxBatchDepth");
+
+  // required because each u32_512 is not atomic (unless we own the range)
   const size_t blockIndex = index * 4;
   const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
+  std::unique_lock lock(mutexes[mutexIndex], std::defer_lock);
+  if constexpr (Locked)
+    lock.lock();
 
   // After tuning, this prefetch does make a bit of a difference, and the right
   // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  //__builtin_prefetch(&counts[blockIndex + 16], 1, 3);
+  // (Deeper batches spend long enough on each block that it doesn't help.)
+  if constexpr (Depth == 1)
+  {
+    if (narrowCounts == nullptr)
+      __builtin_prefetch(&counts[blockIndex + 5], 1, 3);
+    else
+      __builtin_prefetch(&narrowCounts[blockIndex + 5], 1, 3);
+  }
 
   constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
                                    0x0010, 0x0020, 0x0040, 0x0080,
@@ -413,223 +232,43 @@ inline void CountsArray<FixedSize>::Increment(const size_t index,
                                     0x0008, 0x0009, 0x000a, 0x000b,
                                     0x000c, 0x000d, 0x000e, 0x000f };
 
-  uint32_t bits32_1_1 = (uint32_t(bits1) & 0x0000FFFF);
-  uint32_t bits32_1_2 = ((uint32_t(bits1) & 0xFFFF0000) >> 16);
-  uint32_t bits32_1_3 = (uint64_t(bits1 >> 32) & 0x0000FFFF);
-  uint32_t bits32_1_4 = ((uint64_t(bits1 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1_1 = { bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1 };
-  u32_512 incr1_2 = { bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2 };
-  u32_512 incr1_3 = { bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3 };
-  u32_512 incr1_4 = { bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4 };
-
-  uint32_t bits32_2_1 = (uint32_t(bits2) & 0x0000FFFF);
-  uint32_t bits32_2_2 = ((uint32_t(bits2) & 0xFFFF0000) >> 16);
-  uint32_t bits32_2_3 = (uint64_t(bits2 >> 32) & 0x0000FFFF);
-  uint32_t bits32_2_4 = ((uint64_t(bits2 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr2_1 = { bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1 };
-  u32_512 incr2_2 = { bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2 };
-  u32_512 incr2_3 = { bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3 };
-  u32_512 incr2_4 = { bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4 };
-
-  uint32_t bits32_3_1 = (uint32_t(bits3) & 0x0000FFFF);
-  uint32_t bits32_3_2 = ((uint32_t(bits3) & 0xFFFF0000) >> 16);
-  uint32_t bits32_3_3 = (uint64_t(bits3 >> 32) & 0x0000FFFF);
-  uint32_t bits32_3_4 = ((uint64_t(bits3 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr3_1 = { bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1 };
-  u32_512 incr3_2 = { bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2 };
-  u32_512 incr3_3 = { bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3 };
-  u32_512 incr3_4 = { bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4 };
-
-  uint32_t bits32_4_1 = (uint32_t(bits4) & 0x0000FFFF);
-  uint32_t bits32_4_2 = ((uint32_t(bits4) & 0xFFFF0000) >> 16);
-  uint32_t bits32_4_3 = (uint64_t(bits4 >> 32) & 0x0000FFFF);
-  uint32_t bits32_4_4 = ((uint64_t(bits4 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr4_1 = { bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1 };
-  u32_512 incr4_2 = { bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2 };
-  u32_512 incr4_3 = { bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3 };
-  u32_512 incr4_4 = { bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4 };
-
-  uint32_t bits32_5_1 = (uint32_t(bits5) & 0x0000FFFF);
-  uint32_t bits32_5_2 = ((uint32_t(bits5) & 0xFFFF0000) >> 16);
-  uint32_t bits32_5_3 = (uint64_t(bits5 >> 32) & 0x0000FFFF);
-  uint32_t bits32_5_4 = ((uint64_t(bits5 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr5_1 = { bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1 };
-  u32_512 incr5_2 = { bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2 };
-  u32_512 incr5_3 = { bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3 };
-  u32_512 incr5_4 = { bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4 };
-
-  uint32_t bits32_6_1 = (uint32_t(bits6) & 0x0000FFFF);
-  uint32_t bits32_6_2 = ((uint32_t(bits6) & 0xFFFF0000) >> 16);
-  uint32_t bits32_6_3 = (uint64_t(bits6 >> 32) & 0x0000FFFF);
-  uint32_t bits32_6_4 = ((uint64_t(bits6 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr6_1 = { bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1 };
-  u32_512 incr6_2 = { bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2 };
-  u32_512 incr6_3 = { bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3 };
-  u32_512 incr6_4 = { bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4 };
-
-  uint32_t bits32_7_1 = (uint32_t(bits7) & 0x0000FFFF);
-  uint32_t bits32_7_2 = ((uint32_t(bits7) & 0xFFFF0000) >> 16);
-  uint32_t bits32_7_3 = (uint64_t(bits7 >> 32) & 0x0000FFFF);
-  uint32_t bits32_7_4 = ((uint64_t(bits7 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr7_1 = { bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1 };
-  u32_512 incr7_2 = { bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2 };
-  u32_512 incr7_3 = { bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3 };
-  u32_512 incr7_4 = { bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4 };
-
-  uint32_t bits32_8_1 = (uint32_t(bits8) & 0x0000FFFF);
-  uint32_t bits32_8_2 = ((uint32_t(bits8) & 0xFFFF0000) >> 16);
-  uint32_t bits32_8_3 = (uint64_t(bits8 >> 32) & 0x0000FFFF);
-  uint32_t bits32_8_4 = ((uint64_t(bits8 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr8_1 = { bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1 };
-  u32_512 incr8_2 = { bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2 };
-  u32_512 incr8_3 = { bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3 };
-  u32_512 incr8_4 = { bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4 };
+  // Each 16 bits of a word expand to the 0/1 increments of one block.  Depth
+  // is a constant, so the compiler unrolls this as far as it pays.  (Forcing a
+  // full unroll is no faster, and makes builds twice as slow.)
+  u32_512 sums[4] = { };
+  for (size_t d = 0; d < Depth; ++d)
+  {
+    const uint64_t word = bits[d * stride];
+    for (size_t q = 0; q < 4; ++q)
+    {
+      const uint32_t bits32 = uint32_t((word >> (16 * q)) & 0xFFFF);
+      const u32_512 incr = { bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32 };
+      sums[q] += ((incr & mask) >> shift);
+    }
+  }
 
-  counts[blockIndex]     += ((incr1_1 & mask) >> shift) +
-      ((incr2_1 & mask) >> shift) + ((incr3_1 & mask) >> shift) +
-      ((incr4_1 & mask) >> shift) + ((incr5_1 & mask) >> shift) +
-      ((incr6_1 & mask) >> shift) + ((incr7_1 & mask) >> shift) +
-      ((incr8_1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr1_2 & mask) >> shift) +
-      ((incr2_2 & mask) >> shift) + ((incr3_2 & mask) >> shift) +
-      ((incr4_2 & mask) >> shift) + ((incr5_2 & mask) >> shift) +
-      ((incr6_2 & mask) >> shift) + ((incr7_2 & mask) >> shift) +
-      ((incr8_2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr1_3 & mask) >> shift) +
-      ((incr2_3 & mask) >> shift) + ((incr3_3 & mask) >> shift) +
-      ((incr4_3 & mask) >> shift) + ((incr5_3 & mask) >> shift) +
-      ((incr6_3 & mask) >> shift) + ((incr7_3 & mask) >> shift) +
-      ((incr8_3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr1_4 & mask) >> shift) +
-      ((incr2_4 & mask) >> shift) + ((incr3_4 & mask) >> shift) +
-      ((incr4_4 & mask) >> shift) + ((incr5_4 & mask) >> shift) +
-      ((incr6_4 & mask) >> shift) + ((incr7_4 & mask) >> shift) +
-      ((incr8_4 & mask) >> shift);
+  Add(blockIndex, sums[0]);
+  Add(blockIndex + 1, sums[1]);
+  Add(blockIndex + 2, sums[2]);
+  Add(blockIndex + 3, sums[3]);
 }
 
 template<bool FixedSize>
-inline void CountsArray<FixedSize>::Increment(const size_t index,
-                                              const uint64_t bits1,
-                                              const uint64_t bits2,
-                                              const uint64_t bits3,
-                                              const uint64_t bits4,
-                                              const uint64_t bits5,
-                                              const uint64_t bits6,
-                                              const uint64_t bits7,
-                                              const uint64_t bits8,
-                                              const uint64_t bits9,
-                                              const uint64_t bits10,
-                                              const uint64_t bits11,
-                                              const uint64_t bits12,
-                                              const uint64_t bits13,
-                                              const uint64_t bits14,
-                                              const uint64_t bits15,
-                                              const uint64_t bits16)
+template<bool Locked>
+inline void CountsArray<FixedSize>::IncrementSliced(const size_t index,
+                                                    const uint64_t* planes,
+                                                    const size_t stride,
+                                                    const size_t numPlanes)
 {
-  // required because each u32_512 is not atomic
+  // required because each u32_512 is not atomic (unless we own the range)
   const size_t blockIndex = index * 4;
   const size_t mutexIndex = blockIndex / 128;
-  const std::lock_guard lock(mutexes[mutexIndex]);
-
-  // After tuning, this prefetch does make a bit of a difference, and the right
-  // lookahead appears to be 1 blocks.  ...at least when we have 64 threads.
-  //__builtin_prefetch(&counts[blockIndex + 16], 1, 3);
+  std::unique_lock lock(mutexes[mutexIndex], std::defer_lock);
+  if constexpr (Locked)
+    lock.lock();
 
   constexpr const u32_512 mask = { 0x0001, 0x0002, 0x0004, 0x0008,
                                    0x0010, 0x0020, 0x0040, 0x0080,
@@ -640,378 +279,96 @@ inline void CountsArray<FixedSize>::Increment(const size_t index,
                                     0x0008, 0x0009, 0x000a, 0x000b,
                                     0x000c, 0x000d, 0x000e, 0x000f };
 
-  uint32_t bits32_1_1 = (uint32_t(bits1) & 0x0000FFFF);
-  uint32_t bits32_1_2 = ((uint32_t(bits1) & 0xFFFF0000) >> 16);
-  uint32_t bits32_1_3 = (uint64_t(bits1 >> 32) & 0x0000FFFF);
-  uint32_t bits32_1_4 = ((uint64_t(bits1 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr1_1 = { bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1,
-                      bits32_1_1, bits32_1_1, bits32_1_1, bits32_1_1 };
-  u32_512 incr1_2 = { bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2,
-                      bits32_1_2, bits32_1_2, bits32_1_2, bits32_1_2 };
-  u32_512 incr1_3 = { bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3,
-                      bits32_1_3, bits32_1_3, bits32_1_3, bits32_1_3 };
-  u32_512 incr1_4 = { bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4,
-                      bits32_1_4, bits32_1_4, bits32_1_4, bits32_1_4 };
-
-  uint32_t bits32_2_1 = (uint32_t(bits2) & 0x0000FFFF);
-  uint32_t bits32_2_2 = ((uint32_t(bits2) & 0xFFFF0000) >> 16);
-  uint32_t bits32_2_3 = (uint64_t(bits2 >> 32) & 0x0000FFFF);
-  uint32_t bits32_2_4 = ((uint64_t(bits2 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr2_1 = { bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1,
-                      bits32_2_1, bits32_2_1, bits32_2_1, bits32_2_1 };
-  u32_512 incr2_2 = { bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2,
-                      bits32_2_2, bits32_2_2, bits32_2_2, bits32_2_2 };
-  u32_512 incr2_3 = { bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3,
-                      bits32_2_3, bits32_2_3, bits32_2_3, bits32_2_3 };
-  u32_512 incr2_4 = { bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4,
-                      bits32_2_4, bits32_2_4, bits32_2_4, bits32_2_4 };
-
-  uint32_t bits32_3_1 = (uint32_t(bits3) & 0x0000FFFF);
-  uint32_t bits32_3_2 = ((uint32_t(bits3) & 0xFFFF0000) >> 16);
-  uint32_t bits32_3_3 = (uint64_t(bits3 >> 32) & 0x0000FFFF);
-  uint32_t bits32_3_4 = ((uint64_t(bits3 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr3_1 = { bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1,
-                      bits32_3_1, bits32_3_1, bits32_3_1, bits32_3_1 };
-  u32_512 incr3_2 = { bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2,
-                      bits32_3_2, bits32_3_2, bits32_3_2, bits32_3_2 };
-  u32_512 incr3_3 = { bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3,
-                      bits32_3_3, bits32_3_3, bits32_3_3, bits32_3_3 };
-  u32_512 incr3_4 = { bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4,
-                      bits32_3_4, bits32_3_4, bits32_3_4, bits32_3_4 };
-
-  uint32_t bits32_4_1 = (uint32_t(bits4) & 0x0000FFFF);
-  uint32_t bits32_4_2 = ((uint32_t(bits4) & 0xFFFF0000) >> 16);
-  uint32_t bits32_4_3 = (uint64_t(bits4 >> 32) & 0x0000FFFF);
-  uint32_t bits32_4_4 = ((uint64_t(bits4 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr4_1 = { bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1,
-                      bits32_4_1, bits32_4_1, bits32_4_1, bits32_4_1 };
-  u32_512 incr4_2 = { bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2,
-                      bits32_4_2, bits32_4_2, bits32_4_2, bits32_4_2 };
-  u32_512 incr4_3 = { bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3,
-                      bits32_4_3, bits32_4_3, bits32_4_3, bits32_4_3 };
-  u32_512 incr4_4 = { bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4,
-                      bits32_4_4, bits32_4_4, bits32_4_4, bits32_4_4 };
-
-  uint32_t bits32_5_1 = (uint32_t(bits5) & 0x0000FFFF);
-  uint32_t bits32_5_2 = ((uint32_t(bits5) & 0xFFFF0000) >> 16);
-  uint32_t bits32_5_3 = (uint64_t(bits5 >> 32) & 0x0000FFFF);
-  uint32_t bits32_5_4 = ((uint64_t(bits5 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr5_1 = { bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1,
-                      bits32_5_1, bits32_5_1, bits32_5_1, bits32_5_1 };
-  u32_512 incr5_2 = { bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2,
-                      bits32_5_2, bits32_5_2, bits32_5_2, bits32_5_2 };
-  u32_512 incr5_3 = { bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3,
-                      bits32_5_3, bits32_5_3, bits32_5_3, bits32_5_3 };
-  u32_512 incr5_4 = { bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4,
-                      bits32_5_4, bits32_5_4, bits32_5_4, bits32_5_4 };
-
-  uint32_t bits32_6_1 = (uint32_t(bits6) & 0x0000FFFF);
-  uint32_t bits32_6_2 = ((uint32_t(bits6) & 0xFFFF0000) >> 16);
-  uint32_t bits32_6_3 = (uint64_t(bits6 >> 32) & 0x0000FFFF);
-  uint32_t bits32_6_4 = ((uint64_t(bits6 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr6_1 = { bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1,
-                      bits32_6_1, bits32_6_1, bits32_6_1, bits32_6_1 };
-  u32_512 incr6_2 = { bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2,
-                      bits32_6_2, bits32_6_2, bits32_6_2, bits32_6_2 };
-  u32_512 incr6_3 = { bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3,
-                      bits32_6_3, bits32_6_3, bits32_6_3, bits32_6_3 };
-  u32_512 incr6_4 = { bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4,
-                      bits32_6_4, bits32_6_4, bits32_6_4, bits32_6_4 };
-
-  uint32_t bits32_7_1 = (uint32_t(bits7) & 0x0000FFFF);
-  uint32_t bits32_7_2 = ((uint32_t(bits7) & 0xFFFF0000) >> 16);
-  uint32_t bits32_7_3 = (uint64_t(bits7 >> 32) & 0x0000FFFF);
-  uint32_t bits32_7_4 = ((uint64_t(bits7 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr7_1 = { bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1,
-                      bits32_7_1, bits32_7_1, bits32_7_1, bits32_7_1 };
-  u32_512 incr7_2 = { bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2,
-                      bits32_7_2, bits32_7_2, bits32_7_2, bits32_7_2 };
-  u32_512 incr7_3 = { bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3,
-                      bits32_7_3, bits32_7_3, bits32_7_3, bits32_7_3 };
-  u32_512 incr7_4 = { bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4,
-                      bits32_7_4, bits32_7_4, bits32_7_4, bits32_7_4 };
-
-  uint32_t bits32_8_1 = (uint32_t(bits8) & 0x0000FFFF);
-  uint32_t bits32_8_2 = ((uint32_t(bits8) & 0xFFFF0000) >> 16);
-  uint32_t bits32_8_3 = (uint64_t(bits8 >> 32) & 0x0000FFFF);
-  uint32_t bits32_8_4 = ((uint64_t(bits8 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr8_1 = { bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1,
-                      bits32_8_1, bits32_8_1, bits32_8_1, bits32_8_1 };
-  u32_512 incr8_2 = { bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2,
-                      bits32_8_2, bits32_8_2, bits32_8_2, bits32_8_2 };
-  u32_512 incr8_3 = { bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3,
-                      bits32_8_3, bits32_8_3, bits32_8_3, bits32_8_3 };
-  u32_512 incr8_4 = { bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4,
-                      bits32_8_4, bits32_8_4, bits32_8_4, bits32_8_4 };
-
-  uint32_t bits32_9_1 = (uint32_t(bits9) & 0x0000FFFF);
-  uint32_t bits32_9_2 = ((uint32_t(bits9) & 0xFFFF0000) >> 16);
-  uint32_t bits32_9_3 = (uint64_t(bits9 >> 32) & 0x0000FFFF);
-  uint32_t bits32_9_4 = ((uint64_t(bits9 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr9_1 = { bits32_9_1, bits32_9_1, bits32_9_1, bits32_9_1,
-                      bits32_9_1, bits32_9_1, bits32_9_1, bits32_9_1,
-                      bits32_9_1, bits32_9_1, bits32_9_1, bits32_9_1,
-                      bits32_9_1, bits32_9_1, bits32_9_1, bits32_9_1 };
-  u32_512 incr9_2 = { bits32_9_2, bits32_9_2, bits32_9_2, bits32_9_2,
-                      bits32_9_2, bits32_9_2, bits32_9_2, bits32_9_2,
-                      bits32_9_2, bits32_9_2, bits32_9_2, bits32_9_2,
-                      bits32_9_2, bits32_9_2, bits32_9_2, bits32_9_2 };
-  u32_512 incr9_3 = { bits32_9_3, bits32_9_3, bits32_9_3, bits32_9_3,
-                      bits32_9_3, bits32_9_3, bits32_9_3, bits32_9_3,
-                      bits32_9_3, bits32_9_3, bits32_9_3, bits32_9_3,
-                      bits32_9_3, bits32_9_3, bits32_9_3, bits32_9_3 };
-  u32_512 incr9_4 = { bits32_9_4, bits32_9_4, bits32_9_4, bits32_9_4,
-                      bits32_9_4, bits32_9_4, bits32_9_4, bits32_9_4,
-                      bits32_9_4, bits32_9_4, bits32_9_4, bits32_9_4,
-                      bits32_9_4, bits32_9_4, bits32_9_4, bits32_9_4 };
+  u32_512 sums[4] = { };
+  for (size_t p = 0; p < numPlanes; ++p)
+  {
+    const uint64_t bits = planes[p * stride];
+    if (bits == 0)
+      continue;
 
-  uint32_t bits32_10_1 = (uint32_t(bits10) & 0x0000FFFF);
-  uint32_t bits32_10_2 = ((uint32_t(bits10) & 0xFFFF0000) >> 16);
-  uint32_t bits32_10_3 = (uint64_t(bits10 >> 32) & 0x0000FFFF);
-  uint32_t bits32_10_4 = ((uint64_t(bits10 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr10_1 = { bits32_10_1, bits32_10_1, bits32_10_1, bits32_10_1,
-                       bits32_10_1, bits32_10_1, bits32_10_1, bits32_10_1,
-                       bits32_10_1, bits32_10_1, bits32_10_1, bits32_10_1,
-                       bits32_10_1, bits32_10_1, bits32_10_1, bits32_10_1 };
-  u32_512 incr10_2 = { bits32_10_2, bits32_10_2, bits32_10_2, bits32_10_2,
-                       bits32_10_2, bits32_10_2, bits32_10_2, bits32_10_2,
-                       bits32_10_2, bits32_10_2, bits32_10_2, bits32_10_2,
-                       bits32_10_2, bits32_10_2, bits32_10_2, bits32_10_2 };
-  u32_512 incr10_3 = { bits32_10_3, bits32_10_3, bits32_10_3, bits32_10_3,
-                       bits32_10_3, bits32_10_3, bits32_10_3, bits32_10_3,
-                       bits32_10_3, bits32_10_3, bits32_10_3, bits32_10_3,
-                       bits32_10_3, bits32_10_3, bits32_10_3, bits32_10_3 };
-  u32_512 incr10_4 = { bits32_10_4, bits32_10_4, bits32_10_4, bits32_10_4,
-                       bits32_10_4, bits32_10_4, bits32_10_4, bits32_10_4,
-                       bits32_10_4, bits32_10_4, bits32_10_4, bits32_10_4,
-                       bits32_10_4, bits32_10_4, bits32_10_4, bits32_10_4 };
+    for (size_t q = 0; q < 4; ++q)
+    {
+      const uint32_t bits32 = uint32_t((bits >> (16 * q)) & 0xFFFF);
+      const u32_512 incr = { bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32,
+                             bits32, bits32, bits32, bits32 };
+      sums[q] += (((incr & mask) >> shift) << uint32_t(p));
+    }
+  }
 
-  uint32_t bits32_11_1 = (uint32_t(bits11) & 0x0000FFFF);
-  uint32_t bits32_11_2 = ((uint32_t(bits11) & 0xFFFF0000) >> 16);
-  uint32_t bits32_11_3 = (uint64_t(bits11 >> 32) & 0x0000FFFF);
-  uint32_t bits32_11_4 = ((uint64_t(bits11 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr11_1 = { bits32_11_1, bits32_11_1, bits32_11_1, bits32_11_1,
-                       bits32_11_1, bits32_11_1, bits32_11_1, bits32_11_1,
-                       bits32_11_1, bits32_11_1, bits32_11_1, bits32_11_1,
-                       bits32_11_1, bits32_11_1, bits32_11_1, bits32_11_1 };
-  u32_512 incr11_2 = { bits32_11_2, bits32_11_2, bits32_11_2, bits32_11_2,
-                       bits32_11_2, bits32_11_2, bits32_11_2, bits32_11_2,
-                       bits32_11_2, bits32_11_2, bits32_11_2, bits32_11_2,
-                       bits32_11_2, bits32_11_2, bits32_11_2, bits32_11_2 };
-  u32_512 incr11_3 = { bits32_11_3, bits32_11_3, bits32_11_3, bits32_11_3,
-                       bits32_11_3, bits32_11_3, bits32_11_3, bits32_11_3,
-                       bits32_11_3, bits32_11_3, bits32_11_3, bits32_11_3,
-                       bits32_11_3, bits32_11_3, bits32_11_3, bits32_11_3 };
-  u32_512 incr11_4 = { bits32_11_4, bits32_11_4, bits32_11_4, bits32_11_4,
-                       bits32_11_4, bits32_11_4, bits32_11_4, bits32_11_4,
-                       bits32_11_4, bits32_11_4, bits32_11_4, bits32_11_4,
-                       bits32_11_4, bits32_11_4, bits32_11_4, bits32_11_4 };
+  Add(blockIndex, sums[0]);
+  Add(blockIndex + 1, sums[1]);
+  Add(blockIndex + 2, sums[2]);
+  Add(blockIndex + 3, sums[3]);
+}
 
-  uint32_t bits32_12_1 = (uint32_t(bits12) & 0x0000FFFF);
-  uint32_t bits32_12_2 = ((uint32_t(bits12) & 0xFFFF0000) >> 16);
-  uint32_t bits32_12_3 = (uint64_t(bits12 >> 32) & 0x0000FFFF);
-  uint32_t bits32_12_4 = ((uint64_t(bits12 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr12_1 = { bits32_12_1, bits32_12_1, bits32_12_1, bits32_12_1,
-                       bits32_12_1, bits32_12_1, bits32_12_1, bits32_12_1,
-                       bits32_12_1, bits32_12_1, bits32_12_1, bits32_12_1,
-                       bits32_12_1, bits32_12_1, bits32_12_1, bits32_12_1 };
-  u32_512 incr12_2 = { bits32_12_2, bits32_12_2, bits32_12_2, bits32_12_2,
-                       bits32_12_2, bits32_12_2, bits32_12_2, bits32_12_2,
-                       bits32_12_2, bits32_12_2, bits32_12_2, bits32_12_2,
-                       bits32_12_2, bits32_12_2, bits32_12_2, bits32_12_2 };
-  u32_512 incr12_3 = { bits32_12_3, bits32_12_3, bits32_12_3, bits32_12_3,
-                       bits32_12_3, bits32_12_3, bits32_12_3, bits32_12_3,
-                       bits32_12_3, bits32_12_3, bits32_12_3, bits32_12_3,
-                       bits32_12_3, bits32_12_3, bits32_12_3, bits32_12_3 };
-  u32_512 incr12_4 = { bits32_12_4, bits32_12_4, bits32_12_4, bits32_12_4,
-                       bits32_12_4, bits32_12_4, bits32_12_4, bits32_12_4,
-                       bits32_12_4, bits32_12_4, bits32_12_4, bits32_12_4,
-                       bits32_12_4, bits32_12_4, bits32_12_4, bits32_12_4 };
+template<bool FixedSize>
+template<typename F>
+inline void CountsArray<FixedSize>::ForEachOwnedRange(const size_t len, F&& f)
+{
+  const size_t ranges = std::min(numRanges, (len + rangeLen - 1) / rangeLen);
+  if (ranges == 0)
+    return;
+
+  // Each call starts about 0.618 of the way around the array from the last
+  // one, which keeps any number of concurrent flushes spread out.
+  const double x = 0.6180339887498949 *
+      flushTicket.fetch_add(1, std::memory_order_relaxed);
+  size_t r = std::min(size_t((x - std::floor(x)) * ranges), ranges - 1);
+
+  std::vector<size_t> skipped;
+  for (size_t k = 0; k < ranges; ++k, ++r)
+  {
+    if (r == ranges)
+      r = 0;
 
-  uint32_t bits32_13_1 = (uint32_t(bits13) & 0x0000FFFF);
-  uint32_t bits32_13_2 = ((uint32_t(bits13) & 0xFFFF0000) >> 16);
-  uint32_t bits32_13_3 = (uint64_t(bits13 >> 32) & 0x0000FFFF);
-  uint32_t bits32_13_4 = ((uint64_t(bits13 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr13_1 = { bits32_13_1, bits32_13_1, bits32_13_1, bits32_13_1,
-                       bits32_13_1, bits32_13_1, bits32_13_1, bits32_13_1,
-                       bits32_13_1, bits32_13_1, bits32_13_1, bits32_13_1,
-                       bits32_13_1, bits32_13_1, bits32_13_1, bits32_13_1 };
-  u32_512 incr13_2 = { bits32_13_2, bits32_13_2, bits32_13_2, bits32_13_2,
-                       bits32_13_2, bits32_13_2, bits32_13_2, bits32_13_2,
-                       bits32_13_2, bits32_13_2, bits32_13_2, bits32_13_2,
-                       bits32_13_2, bits32_13_2, bits32_13_2, bits32_13_2 };
-  u32_512 incr13_3 = { bits32_13_3, bits32_13_3, bits32_13_3, bits32_13_3,
-                       bits32_13_3, bits32_13_3, bits32_13_3, bits32_13_3,
-                       bits32_13_3, bits32_13_3, bits32_13_3, bits32_13_3,
-                       bits32_13_3, bits32_13_3, bits32_13_3, bits32_13_3 };
-  u32_512 incr13_4 = { bits32_13_4, bits32_13_4, bits32_13_4, bits32_13_4,
-                       bits32_13_4, bits32_13_4, bits32_13_4, bits32_13_4,
-                       bits32_13_4, bits32_13_4, bits32_13_4, bits32_13_4,
-                       bits32_13_4, bits32_13_4, bits32_13_4, bits32_13_4 };
+    if (TryOwn(r))
+    {
+      f(r * rangeLen, std::min(len, (r + 1) * rangeLen));
+      Disown(r);
+    }
+    else
+    {
+      skipped.push_back(r);
+    }
+  }
 
-  uint32_t bits32_14_1 = (uint32_t(bits14) & 0x0000FFFF);
-  uint32_t bits32_14_2 = ((uint32_t(bits14) & 0xFFFF0000) >> 16);
-  uint32_t bits32_14_3 = (uint64_t(bits14 >> 32) & 0x0000FFFF);
-  uint32_t bits32_14_4 = ((uint64_t(bits14 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr14_1 = { bits32_14_1, bits32_14_1, bits32_14_1, bits32_14_1,
-                       bits32_14_1, bits32_14_1, bits32_14_1, bits32_14_1,
-                       bits32_14_1, bits32_14_1, bits32_14_1, bits32_14_1,
-                       bits32_14_1, bits32_14_1, bits32_14_1, bits32_14_1 };
-  u32_512 incr14_2 = { bits32_14_2, bits32_14_2, bits32_14_2, bits32_14_2,
-                       bits32_14_2, bits32_14_2, bits32_14_2, bits32_14_2,
-                       bits32_14_2, bits32_14_2, bits32_14_2, bits32_14_2,
-                       bits32_14_2, bits32_14_2, bits32_14_2, bits32_14_2 };
-  u32_512 incr14_3 = { bits32_14_3, bits32_14_3, bits32_14_3, bits32_14_3,
-                       bits32_14_3, bits32_14_3, bits32_14_3, bits32_14_3,
-                       bits32_14_3, bits32_14_3, bits32_14_3, bits32_14_3,
-                       bits32_14_3, bits32_14_3, bits32_14_3, bits32_14_3 };
-  u32_512 incr14_4 = { bits32_14_4, bits32_14_4, bits32_14_4, bits32_14_4,
-                       bits32_14_4, bits32_14_4, bits32_14_4, bits32_14_4,
-                       bits32_14_4, bits32_14_4, bits32_14_4, bits32_14_4,
-                       bits32_14_4, bits32_14_4, bits32_14_4, bits32_14_4 };
+  // Whoever has the skipped ranges will be done with them soon.
+  while (!skipped.empty())
+  {
+    for (size_t k = 0; k < skipped.size(); )
+    {
+      if (TryOwn(skipped[k]))
+      {
+        f(skipped[k] * rangeLen, std::min(len, (skipped[k] + 1) * rangeLen));
+        Disown(skipped[k]);
+        skipped[k] = skipped.back();
+        skipped.pop_back();
+      }
+      else
+      {
+        ++k;
+      }
+    }
 
-  uint32_t bits32_15_1 = (uint32_t(bits15) & 0x0000FFFF);
-  uint32_t bits32_15_2 = ((uint32_t(bits15) & 0xFFFF0000) >> 16);
-  uint32_t bits32_15_3 = (uint64_t(bits15 >> 32) & 0x0000FFFF);
-  uint32_t bits32_15_4 = ((uint64_t(bits15 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr15_1 = { bits32_15_1, bits32_15_1, bits32_15_1, bits32_15_1,
-                       bits32_15_1, bits32_15_1, bits32_15_1, bits32_15_1,
-                       bits32_15_1, bits32_15_1, bits32_15_1, bits32_15_1,
-                       bits32_15_1, bits32_15_1, bits32_15_1, bits32_15_1 };
-  u32_512 incr15_2 = { bits32_15_2, bits32_15_2, bits32_15_2, bits32_15_2,
-                       bits32_15_2, bits32_15_2, bits32_15_2, bits32_15_2,
-                       bits32_15_2, bits32_15_2, bits32_15_2, bits32_15_2,
-                       bits32_15_2, bits32_15_2, bits32_15_2, bits32_15_2 };
-  u32_512 incr15_3 = { bits32_15_3, bits32_15_3, bits32_15_3, bits32_15_3,
-                       bits32_15_3, bits32_15_3, bits32_15_3, bits32_15_3,
-                       bits32_15_3, bits32_15_3, bits32_15_3, bits32_15_3,
-                       bits32_15_3, bits32_15_3, bits32_15_3, bits32_15_3 };
-  u32_512 incr15_4 = { bits32_15_4, bits32_15_4, bits32_15_4, bits32_15_4,
-                       bits32_15_4, bits32_15_4, bits32_15_4, bits32_15_4,
-                       bits32_15_4, bits32_15_4, bits32_15_4, bits32_15_4,
-                       bits32_15_4, bits32_15_4, bits32_15_4, bits32_15_4 };
+    if (!skipped.empty())
+      std::this_thread::yield();
+  }
+}
 
-  uint32_t bits32_16_1 = (uint32_t(bits16) & 0x0000FFFF);
-  uint32_t bits32_16_2 = ((uint32_t(bits16) & 0xFFFF0000) >> 16);
-  uint32_t bits32_16_3 = (uint64_t(bits16 >> 32) & 0x0000FFFF);
-  uint32_t bits32_16_4 = ((uint64_t(bits16 >> 32) & 0xFFFF0000) >> 16);
-  u32_512 incr16_1 = { bits32_16_1, bits32_16_1, bits32_16_1, bits32_16_1,
-                       bits32_16_1, bits32_16_1, bits32_16_1, bits32_16_1,
-                       bits32_16_1, bits32_16_1, bits32_16_1, bits32_16_1,
-                       bits32_16_1, bits32_16_1, bits32_16_1, bits32_16_1 };
-  u32_512 incr16_2 = { bits32_16_2, bits32_16_2, bits32_16_2, bits32_16_2,
-                       bits32_16_2, bits32_16_2, bits32_16_2, bits32_16_2,
-                       bits32_16_2, bits32_16_2, bits32_16_2, bits32_16_2,
-                       bits32_16_2, bits32_16_2, bits32_16_2, bits32_16_2 };
-  u32_512 incr16_3 = { bits32_16_3, bits32_16_3, bits32_16_3, bits32_16_3,
-                       bits32_16_3, bits32_16_3, bits32_16_3, bits32_16_3,
-                       bits32_16_3, bits32_16_3, bits32_16_3, bits32_16_3,
-                       bits32_16_3, bits32_16_3, bits32_16_3, bits32_16_3 };
-  u32_512 incr16_4 = { bits32_16_4, bits32_16_4, bits32_16_4, bits32_16_4,
-                       bits32_16_4, bits32_16_4, bits32_16_4, bits32_16_4,
-                       bits32_16_4, bits32_16_4, bits32_16_4, bits32_16_4,
-                       bits32_16_4, bits32_16_4, bits32_16_4, bits32_16_4 };
+template<bool FixedSize>
+inline bool CountsArray<FixedSize>::TryOwn(const size_t range)
+{
+  // Only try the exchange if it has a chance, to keep the line shared.
+  return (owners[range].load(std::memory_order_relaxed) == 0 &&
+          owners[range].exchange(1, std::memory_order_acquire) == 0);
+}
 
-  counts[blockIndex]     += ((incr1_1 & mask) >> shift) +
-      ((incr2_1 & mask) >> shift) + ((incr3_1 & mask) >> shift) +
-      ((incr4_1 & mask) >> shift) + ((incr5_1 & mask) >> shift) +
-      ((incr6_1 & mask) >> shift) + ((incr7_1 & mask) >> shift) +
-      ((incr8_1 & mask) >> shift) + ((incr9_1 & mask) >> shift) +
-      ((incr10_1 & mask) >> shift) + ((incr11_1 & mask) >> shift) +
-      ((incr12_1 & mask) >> shift) + ((incr13_1 & mask) >> shift) +
-      ((incr14_1 & mask) >> shift) + ((incr15_1 & mask) >> shift) +
-      ((incr16_1 & mask) >> shift);
-  counts[blockIndex + 1] += ((incr1_2 & mask) >> shift) +
-      ((incr2_2 & mask) >> shift) + ((incr3_2 & mask) >> shift) +
-      ((incr4_2 & mask) >> shift) + ((incr5_2 & mask) >> shift) +
-      ((incr6_2 & mask) >> shift) + ((incr7_2 & mask) >> shift) +
-      ((incr8_2 & mask) >> shift) + ((incr9_2 & mask) >> shift) +
-      ((incr10_2 & mask) >> shift) + ((incr11_2 & mask) >> shift) +
-      ((incr12_2 & mask) >> shift) + ((incr13_2 & mask) >> shift) +
-      ((incr14_2 & mask) >> shift) + ((incr15_2 & mask) >> shift) +
-      ((incr16_2 & mask) >> shift);
-  counts[blockIndex + 2] += ((incr1_3 & mask) >> shift) +
-      ((incr2_3 & mask) >> shift) + ((incr3_3 & mask) >> shift) +
-      ((incr4_3 & mask) >> shift) + ((incr5_3 & mask) >> shift) +
-      ((incr6_3 & mask) >> shift) + ((incr7_3 & mask) >> shift) +
-      ((incr8_3 & mask) >> shift) + ((incr9_3 & mask) >> shift) +
-      ((incr10_3 & mask) >> shift) + ((incr11_3 & mask) >> shift) +
-      ((incr12_3 & mask) >> shift) + ((incr13_3 & mask) >> shift) +
-      ((incr14_3 & mask) >> shift) + ((incr15_3 & mask) >> shift) +
-      ((incr16_3 & mask) >> shift);
-  counts[blockIndex + 3] += ((incr1_4 & mask) >> shift) +
-      ((incr2_4 & mask) >> shift) + ((incr3_4 & mask) >> shift) +
-      ((incr4_4 & mask) >> shift) + ((incr5_4 & mask) >> shift) +
-      ((incr6_4 & mask) >> shift) + ((incr7_4 & mask) >> shift) +
-      ((incr8_4 & mask) >> shift) + ((incr9_4 & mask) >> shift) +
-      ((incr10_4 & mask) >> shift) + ((incr11_4 & mask) >> shift) +
-      ((incr12_4 & mask) >> shift) + ((incr13_4 & mask) >> shift) +
-      ((incr14_4 & mask) >> shift) + ((incr15_4 & mask) >> shift) +
-      ((incr16_4 & mask) >> shift);
+template<bool FixedSize>
+inline void CountsArray<FixedSize>::Disown(const size_t range)
+{
+  owners[range].store(0, std::memory_order_release);
 }
 
 template<bool FixedSize>
@@ -1020,7 +377,7 @@ inline uint32_t CountsArray<FixedSize>::Maximum() const
   uint32_t maxVal = 0;
   for (size_t i = 0; i < 1048576; ++i)
     for (size_t j = 0; j < 16; ++j)
-      maxVal = std::max(maxVal, (uint32_t) counts[i][j]);
+      maxVal = std::max(maxVal, (*this)[16 * i + j]);
 
   return maxVal;
 }
@@ -1035,7 +392,7 @@ inline void CountsArray<FixedSize>::Save(const std::string& filename) const
     for (size_t j = 0; j < 16; ++j, ++index)
     {
       f << "0x" << std::hex << std::setw(6) << std::setfill('0') << index
-          << ", " << std::dec << (size_t) counts[i][j] << std::endl;
+          << ", " << std::dec << (size_t) (*this)[index] << std::endl;
     }
   }
 }
@@ -1045,7 +402,13 @@ inline uint32_t CountsArray<FixedSize>::operator[](const size_t i) const
 {
   const size_t outerIndex = i / 16;
   const size_t innerIndex = i % 16;
-  return counts[outerIndex][innerIndex];
+  if (narrowCounts == nullptr)
+    return counts[outerIndex][innerIndex];
+
+  uint32_t count = narrowCounts[outerIndex][innerIndex];
+  if ((spilledBits[i / 64] >> (i % 64)) & 1)
+    count += (overflow.at(i) << 16);
+  return count;
 }
 
 template<bool FixedSize>
@@ -1070,25 +433,22 @@ inline size_t CountsArray<FixedSize>::CopyPrefixes(
     // Copy all relevant 3-gram prefixes.
     for (size_t i = 0; i < 16777216; ++i)
     {
-      const size_t outerIndex = i / 16;
-      const size_t innerIndex = i % 16;
-
-      if (counts[outerIndex][innerIndex] > minValForCopy)
+      const uint32_t count = (*this)[i];
+      if (count > minValForCopy)
       {
         prefixes[3 * j    ] = (i & 0xFF0000) >> 16;
         prefixes[3 * j + 1] = (i & 0x00FF00) >> 8;
         prefixes[3 * j + 2] = (i & 0x0000FF);
-        prefixCounts[j] = counts[outerIndex][innerIndex];
+        prefixCounts[j] = count;
 
         ++j;
       }
-      else if (counts[outerIndex][innerIndex] == minValForCopy &&
-               numWithMinValToCopy != 0)
+      else if (count == minValForCopy && numWithMinValToCopy != 0)
       {
         prefixes[3 * j    ] = (i & 0xFF0000) >> 16;
         prefixes[3 * j + 1] = (i & 0x00FF00) >> 8;
         prefixes[3 * j + 2] = (i & 0x0000FF);
-        prefixCounts[j] = counts[outerIndex][innerIndex];
+        prefixCounts[j] = count;
 
         --numWithMinValToCopy;
         ++j;
@@ -1131,40 +491,37 @@ inline void CountsArray<FixedSize>::PrefixTrieIterate(
     for (size_t b = 0; b < 256; ++b)
     {
       const size_t prefixIndex = (leafIndex * 256) + b;
+      const uint32_t count = (*this)[prefixIndex];
 
-      const size_t outerIndex = prefixIndex / 16;
-      const size_t innerIndex = prefixIndex % 16;
-
-      if (counts[outerIndex][innerIndex] > 0)
+      if (count > 0)
         any = true;
 
-      if (counts[outerIndex][innerIndex] > minValForCopy)
+      if (count > minValForCopy)
       {
         //std::cout << "counts leafIndex " << leafIndex << " prefixIndex " << prefixIndex << ", keep\n";
         memcpy(&prefixes[j * (prefixTrie->PrefixLen() + 1)], triePrefix,
             prefixTrie->PrefixLen());
         prefixes[j * (prefixTrie->PrefixLen() + 1) + prefixTrie->PrefixLen()] =
             b;
-        prefixCounts[j] = counts[outerIndex][innerIndex];
+        prefixCounts[j] = count;
 
         ++j;
       }
-      else if (counts[outerIndex][innerIndex] == minValForCopy &&
-               numWithMinValToCopy != 0)
+      else if (count == minValForCopy && numWithMinValToCopy != 0)
       {
         //std::cout << "counts leafIndex " << leafIndex << " prefixIndex " << prefixIndex << ", numWithMinValToCopy " << numWithMinValToCopy << ", keep\n";
         memcpy(&prefixes[j * (prefixTrie->PrefixLen() + 1)], triePrefix,
             prefixTrie->PrefixLen());
         prefixes[j * (prefixTrie->PrefixLen() + 1) + prefixTrie->PrefixLen()] =
             b;
-        prefixCounts[j] = counts[outerIndex][innerIndex];
+        prefixCounts[j] = count;
 
         --numWithMinValToCopy;
         ++j;
       }
       //else
       //{
-      //  std::cout << "prefix with byte " << b << " has count " << counts[outerIndex][innerIndex] << "\n";
+      //  std::cout << "prefix with byte " << b << " has count " << count << "\n";
       //}
     }
 
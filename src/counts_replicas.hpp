@@ -0,0 +1,40 @@
+// counts_replicas.hpp: one CountsArray per NUMA node, so that the counting
+// threads on each node flush into memory on their own node instead of across
+// the interconnect; the replicas are added up once at the end of the pass.
+#ifndef PNGRAM_COUNTS_REPLICAS_HPP
+#define PNGRAM_COUNTS_REPLICAS_HPP
+
+#include "counts_array.hpp"
+#include "numa_util.hpp"
+#include "cpu_dispatch.hpp"
+#include <vector>
+#include <memory>
+
+template<bool FixedSize = true>
+class CountsReplicas
+{
+ public:
+  // Make a replica on each of `nodes` (or a single array that isn't bound to
+  // any node, if `nodes` is empty).  `args` are passed to the CountsArray
+  // constructor, followed by the node.
+  template<typename... Args>
+  inline CountsReplicas(const std::vector<size_t>& nodes, const Args&... args);
+
+  size_t Replicas() const { return replicas.size(); }
+  // The replica that threads on node nodes[r] should flush into.
+  CountsArray<FixedSize>& Replica(const size_t r) { return *replicas[r]; }
+  // The NUMA node of replica r (-1 if it isn't bound to one).
+  int Node(const size_t r) const { return nodes.empty() ? -1 : nodes[r]; }
+
+  // Add all replicas into the first one (with `threads` threads, each taking a
+  // range of blocks), free the others, and return the first one.
+  inline CountsArray<FixedSize>& Reduce(const size_t threads);
+
+ private:
+  std::vector<size_t> nodes;
+  std::vector<std::unique_ptr<CountsArray<FixedSize>>> replicas;
+};
+
+#include "counts_replicas_impl.hpp"
+
+#endif
@@ -0,0 +1,59 @@
+// counts_replicas_impl.hpp: implementation of CountsReplicas.
+#ifndef PNGRAM_COUNTS_REPLICAS_IMPL_HPP
+#define PNGRAM_COUNTS_REPLICAS_IMPL_HPP
+
+#include "counts_replicas.hpp"
+#include <thread>
+#include <algorithm>
+
+template<bool FixedSize>
+template<typename... Args>
+inline CountsReplicas<FixedSize>::CountsReplicas(
+    const std::vector<size_t>& nodes,
+    const Args&... args) :
+    nodes(nodes)
+{
+  if (nodes.empty())
+  {
+    replicas.emplace_back(new CountsArray<FixedSize>(args..., -1));
+    return;
+  }
+
+  for (const size_t node : nodes)
+    replicas.emplace_back(new CountsArray<FixedSize>(args..., int(node)));
+}
+
+template<bool FixedSize>
+inline CountsArray<FixedSize>& CountsReplicas<FixedSize>::Reduce(
+    const size_t threads)
+{
+  if (replicas.size() > 1)
+  {
+    const size_t blocks = replicas[0]->Blocks();
+    const size_t numThreads = std::max(threads, (size_t) 1);
+    const size_t step = (blocks + numThreads - 1) / numThreads;
+    std::vector<std::thread> reducers;
+    for (size_t t = 0; t < numThreads; ++t)
+    {
+      const size_t begin = std::min(blocks, t * step);
+      const size_t end = std::min(blocks, begin + step);
+      reducers.emplace_back([this, begin, end]()
+      {
+        RunKernel([&]()
+        {
+          for (size_t r = 1; r < replicas.size(); ++r)
+            replicas[0]->AddFrom(*replicas[r], begin, end);
+        });
+      });
+    }
+
+    for (std::thread& t : reducers)
+      t.join();
+
+    replicas.resize(1);
+  }
+
+  return *replicas[0];
+}
+
+#endif
@@ -0,0 +1,113 @@
+// cpu_dispatch.hpp: run the hot counting kernels (the bit expansion in
+// CountsArray::Increment(), the flush loops, and the set() loops) with the best
+// instruction set the CPU has, picked once at startup.  That way one binary
+// built for any x86-64 CPU runs about as fast as a -march=native build on each
+// host, and a binary built on an AVX-512 machine still runs on older ones.
+//
+// Set the PNGRAM_CPU environment variable to scalar, avx2 or avx512 to use a
+// lower level than the CPU supports (e.g. to compare them).
+#ifndef PNGRAM_CPU_DISPATCH_HPP
+#define PNGRAM_CPU_DISPATCH_HPP
+
+#include <cstdlib>
+#include <cstring>
+
+enum struct cpu_level
+{
+  cpu_scalar, // whatever the binary was built for
+  cpu_avx2,
+  cpu_avx512
+};
+
+// The best level the CPU supports (lowered by PNGRAM_CPU, if it is set).
+inline cpu_level DetectCpuLevel()
+{
+  cpu_level level = cpu_level::cpu_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vl"))
+    level = cpu_level::cpu_avx512;
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+    level = cpu_level::cpu_avx2;
+#endif
+
+  const char* env = getenv("PNGRAM_CPU");
+  if (env != NULL)
+  {
+    if (strcmp(env, "scalar") == 0)
+      level = cpu_level::cpu_scalar;
+    else if (strcmp(env, "avx2") == 0 && level == cpu_level::cpu_avx512)
+      level = cpu_level::cpu_avx2;
+  }
+
+  return level;
+}
+
+// The level that kernels run at; this is only detected once.
+inline cpu_level CpuLevel()
+{
+  static const cpu_level level = DetectCpuLevel();
+  return level;
+}
+
+inline const char* CpuLevelName(const cpu_level level)
+{
+  if (level == cpu_level::cpu_avx512)
+    return "avx512";
+  else if (level == cpu_level::cpu_avx2)
+    return "avx2";
+  else
+    return "scalar";
+}
+
+// Each of these runs f() with everything it calls inlined into it (that is
+// what `flatten` does), so the whole kernel is compiled for that instruction
+// set.  GCC vector types like u32_512 then become single AVX-512 operations, or
+// pairs of AVX2 operations, instead of four SSE operations.
+#if defined(__x86_64__) || defined(__i386__)
+template<typename F>
+__attribute__((target("avx512f,avx512bw,avx512vl,avx2,bmi,bmi2,popcnt"),
+               flatten))
+inline void RunAvx512Kernel(F& f)
+{
+  f();
+}
+
+template<typename F>
+__attribute__((target("avx2,bmi,bmi2,popcnt"), flatten))
+inline void RunAvx2Kernel(F& f)
+{
+  f();
+}
+#endif
+
+template<typename F>
+__attribute__((flatten))
+inline void RunScalarKernel(F& f)
+{
+  f();
+}
+
+// Run f() (a lambda holding the kernel) with the best version for this CPU.
+template<typename F>
+inline void RunKernel(F&& f)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  switch (CpuLevel())
+  {
+    case cpu_level::cpu_avx512:
+      RunAvx512Kernel(f);
+      return;
+    case cpu_level::cpu_avx2:
+      RunAvx2Kernel(f);
+      return;
+    default:
+      break;
+  }
+#endif
+
+  RunScalarKernel(f);
+}
+
+#endif
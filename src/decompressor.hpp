@@ -0,0 +1,62 @@
+// decompressor.hpp: streaming decompression of gzip (and, if built with
+// PNGRAM_USE_ZSTD, zstd) inputs, so that reader threads can hand the raw bytes
+// of compressed samples to the ngram threads without decompressing them to
+// disk first.
+#ifndef PNGRAM_DECOMPRESSOR_HPP
+#define PNGRAM_DECOMPRESSOR_HPP
+
+#include <zlib.h>
+#ifdef PNGRAM_USE_ZSTD
+  #include <zstd.h>
+#endif
+#include <stddef.h>
+
+enum struct compression_type
+{
+  compression_none,
+  compression_gzip,
+  compression_zstd
+};
+
+class Decompressor
+{
+ public:
+  inline Decompressor();
+  inline ~Decompressor();
+
+  // Guess the compression of a file from its first `len` bytes.
+  static inline compression_type Detect(const unsigned char* data,
+                                        const size_t len);
+  // Returns false if we were built without support for `type`.
+  static inline bool Supported(const compression_type type);
+
+  // Get ready to decompress a new stream of the given type.
+  inline void Start(const compression_type type);
+
+  // Decompress as much of in[inPos, inLen) into out[outPos, outLen) as
+  // possible, advancing inPos and outPos.  Concatenated streams (several gzip
+  // members, or several zstd frames) are decompressed one after another.
+  // Returns false if the data is corrupt.
+  inline bool Decompress(const unsigned char* in,
+                         const size_t inLen,
+                         size_t& inPos,
+                         unsigned char* out,
+                         const size_t outLen,
+                         size_t& outPos);
+
+ private:
+  compression_type type;
+
+  z_stream zs;
+  bool zsInitialized;
+  // True if the last gzip member ended, and no new one has started yet.
+  bool zsEnded;
+
+#ifdef PNGRAM_USE_ZSTD
+  ZSTD_DCtx* zstdCtx;
+#endif
+};
+
+#include "decompressor_impl.hpp"
+
+#endif
@@ -0,0 +1,145 @@
+// decompressor_impl.hpp: implementation of Decompressor.
+#ifndef PNGRAM_DECOMPRESSOR_IMPL_HPP
+#define PNGRAM_DECOMPRESSOR_IMPL_HPP
+
+#include "decompressor.hpp"
+#include <cstring>
+#include <stdexcept>
+
+inline Decompressor::Decompressor() :
+    type(compression_type::compression_none),
+    zsInitialized(false),
+    zsEnded(false)
+{
+  memset(&zs, 0, sizeof(z_stream));
+#ifdef PNGRAM_USE_ZSTD
+  zstdCtx = ZSTD_createDCtx();
+  if (zstdCtx == NULL)
+    throw std::runtime_error("could not create zstd decompression context");
+#endif
+}
+
+inline Decompressor::~Decompressor()
+{
+  if (zsInitialized)
+    inflateEnd(&zs);
+#ifdef PNGRAM_USE_ZSTD
+  ZSTD_freeDCtx(zstdCtx);
+#endif
+}
+
+inline compression_type Decompressor::Detect(const unsigned char* data,
+                                             const size_t len)
+{
+  if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return compression_type::compression_gzip;
+  else if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f &&
+      data[3] == 0xfd)
+    return compression_type::compression_zstd;
+  else
+    return compression_type::compression_none;
+}
+
+inline bool Decompressor::Supported(const compression_type type)
+{
+#ifdef PNGRAM_USE_ZSTD
+  return true;
+#else
+  return (type != compression_type::compression_zstd);
+#endif
+}
+
+inline void Decompressor::Start(const compression_type typeIn)
+{
+  type = typeIn;
+  if (type == compression_type::compression_gzip)
+  {
+    // 15 + 16: a window of up to 32KB, and expect a gzip header.
+    if (!zsInitialized)
+    {
+      if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        throw std::runtime_error("could not initialize zlib");
+      zsInitialized = true;
+    }
+    else
+    {
+      inflateReset(&zs);
+    }
+    zsEnded = false;
+  }
+#ifdef PNGRAM_USE_ZSTD
+  else if (type == compression_type::compression_zstd)
+  {
+    ZSTD_DCtx_reset(zstdCtx, ZSTD_reset_session_only);
+  }
+#endif
+}
+
+inline bool Decompressor::Decompress(const unsigned char* in,
+                                     const size_t inLen,
+                                     size_t& inPos,
+                                     unsigned char* out,
+                                     const size_t outLen,
+                                     size_t& outPos)
+{
+  if (type == compression_type::compression_gzip)
+  {
+    // inflate() may hold on to output that did not fit last time, so keep
+    // calling it even if all of the input has been consumed.
+    while (outPos < outLen)
+    {
+      // Another gzip member may follow the one that just ended.
+      if (zsEnded)
+      {
+        if (inPos == inLen)
+          break;
+        inflateReset(&zs);
+        zsEnded = false;
+      }
+
+      zs.next_in = (Bytef*) (in + inPos);
+      zs.avail_in = inLen - inPos;
+      zs.next_out = out + outPos;
+      zs.avail_out = outLen - outPos;
+      const int result = inflate(&zs, Z_NO_FLUSH);
+      const size_t consumed = (inLen - inPos) - zs.avail_in;
+      const size_t produced = (outLen - outPos) - zs.avail_out;
+      inPos += consumed;
+      outPos += produced;
+
+      if (result == Z_STREAM_END)
+        zsEnded = true;
+      else if (result != Z_OK && result != Z_BUF_ERROR)
+        return false;
+      else if (consumed == 0 && produced == 0)
+        break; // We need more input.
+    }
+
+    return true;
+  }
+#ifdef PNGRAM_USE_ZSTD
+  else if (type == compression_type::compression_zstd)
+  {
+    ZSTD_inBuffer inBuf = { in, inLen, inPos };
+    ZSTD_outBuffer outBuf = { out, outLen, outPos };
+    while (outBuf.pos < outBuf.size)
+    {
+      const size_t oldInPos = inBuf.pos;
+      const size_t oldOutPos = outBuf.pos;
+      const size_t result = ZSTD_decompressStream(zstdCtx, &outBuf, &inBuf);
+      if (ZSTD_isError(result))
+        return false;
+      if (inBuf.pos == oldInPos && outBuf.pos == oldOutPos)
+        break; // We need more input.
+    }
+
+    inPos = inBuf.pos;
+    outPos = outBuf.pos;
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+#endif
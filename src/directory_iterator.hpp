@@ -4,22 +4,40 @@
 #include <filesystem>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include "file_catalog.hpp"
 
 namespace fs = std::filesystem;
 
-// An iterator that returns files in a threadsafe manner.
+// An iterator that returns files in a threadsafe manner.  By default it walks
+// the directory tree on every pass; if use_catalog() is called, it instead
+// hands out the files in a FileCatalog, without taking a lock.
 struct DirectoryIterator
 {
  public:
   DirectoryIterator(const std::vector<fs::path>& paths_to_explore, const bool count_files);
 
-  size_t get_current_file() const { return current_file; }
-  size_t get_file_count() const { return file_count; }
+  inline size_t get_current_file() const;
+  inline size_t get_file_count() const;
 
   inline bool get_next(fs::path& result, size_t& file_index);
 
   inline void reset();
 
+  // Return files from `catalog` (which must outlive this iterator) instead of
+  // walking the directory tree, in the catalog's schedule order.  The file
+  // index of each file is its ID in the catalog.
+  inline void use_catalog(const FileCatalog& catalog);
+
+  // When using a catalog, let at most `limit` threads work on files from the
+  // same device at once (0 means no limit).  A thread is working on a device
+  // from the time get_next() gives it a file there until it calls get_next()
+  // again.
+  inline void set_readers_per_device(const size_t limit);
+
  private:
   inline void step();
 
@@ -34,6 +52,17 @@ struct DirectoryIterator
 
   // Locally-cached next file, needed because we step at the end of get_next()
   fs::path local_result;
+
+  // If not NULL, files come from here, and catalog_cursor is the next one.
+  const FileCatalog* catalog;
+  std::atomic<size_t> catalog_cursor;
+
+  // Used to limit the number of threads working on each device.
+  size_t readers_per_device;
+  std::mutex device_mutex;
+  std::condition_variable device_cv;
+  std::unordered_map<uint64_t, size_t> device_readers;
+  std::unordered_map<std::thread::id, uint64_t> reader_devices;
 };
 
 #include "directory_iterator_impl.hpp"
@@ -15,7 +15,10 @@ inline DirectoryIterator::DirectoryIterator(
     paths(paths_to_explore),
     path_index(0),
     file_count(0),
-    current_file(size_t(-1)) /* so that we will wrap over to 0 on the first step */
+    current_file(size_t(-1)), /* so that we will wrap over to 0 on the first step */
+    catalog(nullptr),
+    catalog_cursor(0),
+    readers_per_device(0)
 {
   // Count files, if needed.
   if (count_files)
@@ -86,8 +89,66 @@ inline DirectoryIterator::DirectoryIterator(
   }
 }
 
+inline size_t DirectoryIterator::get_current_file() const
+{
+  if (this->catalog != nullptr)
+    return std::min(this->catalog_cursor.load(), this->catalog->Size());
+
+  return this->current_file;
+}
+
+inline size_t DirectoryIterator::get_file_count() const
+{
+  if (this->catalog != nullptr)
+    return this->catalog->Size();
+
+  return this->file_count;
+}
+
 inline bool DirectoryIterator::get_next(fs::path& result, size_t& file_index)
 {
+  if (this->catalog != nullptr)
+  {
+    // Each reader just claims the next entry; no lock or stat() is needed.
+    if (this->readers_per_device > 0)
+    {
+      // This thread is done with its last file, so it no longer counts
+      // against that file's device.
+      std::unique_lock<std::mutex> lock(this->device_mutex);
+      std::unordered_map<std::thread::id, uint64_t>::iterator held =
+          this->reader_devices.find(std::this_thread::get_id());
+      if (held != this->reader_devices.end())
+      {
+        --this->device_readers[held->second];
+        this->reader_devices.erase(held);
+        this->device_cv.notify_all();
+      }
+    }
+
+    const size_t pos = this->catalog_cursor.fetch_add(1);
+    if (pos >= this->catalog->Size())
+    {
+      file_index = 0;
+      return false;
+    }
+
+    const size_t id = this->catalog->Scheduled(pos);
+    if (this->readers_per_device > 0)
+    {
+      // Wait until the device has room for another reader.
+      const uint64_t device = this->catalog->Device(id);
+      std::unique_lock<std::mutex> lock(this->device_mutex);
+      this->device_cv.wait(lock, [&]()
+          { return this->device_readers[device] < this->readers_per_device; });
+      ++this->device_readers[device];
+      this->reader_devices[std::this_thread::get_id()] = device;
+    }
+
+    result = this->catalog->Path(id);
+    file_index = id;
+    return true;
+  }
+
   this->it_mutex.lock();
   if (this->local_result.empty())
   {
@@ -171,8 +232,26 @@ inline void DirectoryIterator::step()
   }
 }
 
+inline void DirectoryIterator::use_catalog(const FileCatalog& catalogIn)
+{
+  this->catalog = &catalogIn;
+  this->catalog_cursor = 0;
+}
+
+inline void DirectoryIterator::set_readers_per_device(const size_t limit)
+{
+  this->readers_per_device = limit;
+}
+
 inline void DirectoryIterator::reset()
 {
+  if (this->catalog != nullptr)
+  {
+    // No need to walk the directory tree again.
+    this->catalog_cursor = 0;
+    return;
+  }
+
   this->current_file = size_t(-1);
   this->path_index = 0;
   if (this->paths.size() > 0)
@@ -0,0 +1,52 @@
+// dirty_blocks.hpp: a summary of which blocks of a bitset (or of a group of
+// bitsets indexed the same way) have had any bits set, so that flushing and
+// clearing a counter's bitsets takes time proportional to the part of them
+// that was touched, instead of to their size.  With small files, a bitset of
+// millions of words may only have a few hundred words set.
+#ifndef PNGRAM_DIRTY_BLOCKS_HPP
+#define PNGRAM_DIRTY_BLOCKS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class DirtyBlocks
+{
+ public:
+  // Track a bitset of `len` uint64_ts.
+  inline DirtyBlocks(const size_t len);
+
+  // Mark the block that holds word `word` of the bitset as dirty.
+  void Mark(const size_t word)
+  {
+    summary[word / summaryLen] |= (uint64_t(1) << ((word / blockLen) % 64));
+  }
+
+  // Mark every block that is dirty in `other` (which must track a bitset of
+  // the same length).
+  inline void Merge(const DirtyBlocks& other);
+
+  // Call f(b, e) for each run [b, e) of consecutive dirty words in [begin,
+  // end), and mark them clean.  The caller must clear the bitset words in each
+  // run (flushing does that anyway).  `begin` should be a multiple of
+  // summaryLen, so that different ranges don't share summary words.
+  template<typename F>
+  inline void ForEachDirtyRange(const size_t begin, const size_t end, F&& f);
+
+  // Mark everything clean.
+  inline void Clear();
+  // Mark everything dirty.
+  inline void MarkAll();
+
+  // Words of the bitset per block (one cache line).
+  static constexpr size_t blockLen = 8;
+  // Words of the bitset per word of the summary.
+  static constexpr size_t summaryLen = 64 * blockLen;
+
+ private:
+  std::vector<uint64_t> summary;
+};
+
+#include "dirty_blocks_impl.hpp"
+
+#endif
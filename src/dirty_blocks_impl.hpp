@@ -0,0 +1,67 @@
+// dirty_blocks_impl.hpp: implementation of DirtyBlocks.
+#ifndef PNGRAM_DIRTY_BLOCKS_IMPL_HPP
+#define PNGRAM_DIRTY_BLOCKS_IMPL_HPP
+
+#include "dirty_blocks.hpp"
+#include <algorithm>
+
+inline DirtyBlocks::DirtyBlocks(const size_t len) :
+    summary((len + summaryLen - 1) / summaryLen, 0)
+{
+}
+
+inline void DirtyBlocks::Merge(const DirtyBlocks& other)
+{
+  for (size_t i = 0; i < summary.size(); ++i)
+    summary[i] |= other.summary[i];
+}
+
+template<typename F>
+inline void DirtyBlocks::ForEachDirtyRange(const size_t begin,
+                                           const size_t end,
+                                           F&& f)
+{
+  // Runs that continue from one summary word into the next are joined.
+  size_t runBegin = 0;
+  size_t runEnd = 0;
+  const size_t last = std::min(summary.size(),
+      (end + summaryLen - 1) / summaryLen);
+  for (size_t s = begin / summaryLen; s < last; ++s)
+  {
+    uint64_t dirty = summary[s];
+    summary[s] = 0;
+    while (dirty != 0)
+    {
+      const size_t first = __builtin_ctzll(dirty);
+      const uint64_t rest = ~(dirty >> first);
+      const size_t run = (rest == 0) ? (64 - first) : __builtin_ctzll(rest);
+      const size_t b = std::max(begin, (64 * s + first) * blockLen);
+      const size_t e = std::min(end, (64 * s + first + run) * blockLen);
+      if (b != runEnd)
+      {
+        if (runEnd > runBegin)
+          f(runBegin, runEnd);
+        runBegin = b;
+      }
+      runEnd = e;
+
+      dirty = (first + run == 64) ? 0 :
+          (dirty & ~((uint64_t(1) << (first + run)) - 1));
+    }
+  }
+
+  if (runEnd > runBegin)
+    f(runBegin, runEnd);
+}
+
+inline void DirtyBlocks::Clear()
+{
+  std::fill(summary.begin(), summary.end(), 0);
+}
+
+inline void DirtyBlocks::MarkAll()
+{
+  std::fill(summary.begin(), summary.end(), ~uint64_t(0));
+}
+
+#endif
@@ -0,0 +1,74 @@
+// file_catalog.hpp: a compact in-memory list of every file under a set of
+// paths, with its size, inode and device.  It is built once (in parallel), can be saved
+// to and loaded from disk, and can then be reused by every pass instead of
+// walking the directory tree again.
+#ifndef PNGRAM_FILE_CATALOG_HPP
+#define PNGRAM_FILE_CATALOG_HPP
+
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace fs = std::filesystem;
+
+class FileCatalog
+{
+ public:
+  FileCatalog() { }
+
+  // Walk all of the given paths (files or directories) using `threads`
+  // threads, replacing anything already in the catalog.  Files are sorted by
+  // path, so the same tree always gives the same file IDs.
+  inline void Build(const std::vector<fs::path>& paths, const size_t threads);
+
+  // Save the catalog to a binary file, or load it from one.  Throws a
+  // std::runtime_error on failure.
+  inline void Save(const std::string& filename) const;
+  inline void Load(const std::string& filename);
+
+  // Hand out the largest files first (longest-processing-time-first), so that
+  // the big files do not all land at the end of a pass and leave one thread
+  // working while the rest sit idle.  Small files fill in at the end.
+  inline void ScheduleBySize();
+  // Hand out files in path order (the default).
+  void ScheduleByPath() { order.clear(); }
+  // Hand out files in inode order, or in the order of their first physical
+  // extent on disk (from FIEMAP, using `threads` threads; files without one
+  // fall back to inode order).  On rotational disks, this turns the random
+  // seeks of directory order into a mostly sequential sweep.  If the files
+  // are on several devices, the devices take turns.
+  inline void ScheduleByInode();
+  inline void ScheduleByExtent(const size_t threads);
+
+  // The ID of the file that should be handed out `pos`-th during a pass.
+  size_t Scheduled(const size_t pos) const
+  {
+    return order.empty() ? pos : order[pos];
+  }
+
+  // The ID of each file is its index in the catalog.
+  size_t Size() const { return sizes.size(); }
+  const char* Path(const size_t id) const { return paths.data() + pathOffsets[id]; }
+  uint64_t FileSize(const size_t id) const { return sizes[id]; }
+  uint64_t Inode(const size_t id) const { return inodes[id]; }
+  uint64_t Device(const size_t id) const { return devices[id]; }
+
+ private:
+  // Set the order to all files sorted by (device, key, inode), then
+  // interleave the devices.
+  inline void ScheduleByDevice(const std::vector<uint64_t>& keys);
+
+  // All paths, each terminated with a '\0'.
+  std::vector<char> paths;
+  std::vector<uint64_t> pathOffsets;
+  std::vector<uint64_t> sizes;
+  std::vector<uint64_t> inodes;
+  std::vector<uint64_t> devices;
+  // If not empty, the order in which file IDs are handed out.
+  std::vector<uint64_t> order;
+};
+
+#include "file_catalog_impl.hpp"
+
+#endif
@@ -0,0 +1,309 @@
+// file_catalog_impl.hpp: implementation of FileCatalog.
+#ifndef PNGRAM_FILE_CATALOG_IMPL_HPP
+#define PNGRAM_FILE_CATALOG_IMPL_HPP
+
+#include "file_catalog.hpp"
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifndef MAX_DEPTH
+  #define MAX_DEPTH 10
+#endif
+
+inline void FileCatalog::Build(const std::vector<fs::path>& rootPaths,
+                               const size_t threads)
+{
+  struct Entry
+  {
+    std::string path;
+    uint64_t size;
+    uint64_t inode;
+    uint64_t device;
+  };
+
+  // Directories still to be listed, with their depth.  Each walker thread takes
+  // a directory, lists it, and pushes any subdirectories back onto the queue.
+  std::vector<std::pair<fs::path, size_t>> dirQueue;
+  std::mutex queueMutex;
+  std::condition_variable queueCv;
+  size_t busyWalkers = 0;
+  bool depthWarning = false;
+
+  std::vector<std::vector<Entry>> found(std::max(threads, (size_t) 1));
+
+  // The paths we were given may be files or directories.  (stat() follows
+  // symlinks, so symlinks to either are fine.)
+  for (const fs::path& p : rootPaths)
+  {
+    struct stat st;
+    if (stat(p.c_str(), &st) != 0)
+    {
+      std::cerr << "Warning: could not stat " << p << "; skipping." << std::endl;
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+      found[0].push_back({ p.string(), uint64_t(st.st_size),
+          uint64_t(st.st_ino), uint64_t(st.st_dev) });
+    }
+    else if (S_ISDIR(st.st_mode))
+    {
+      dirQueue.emplace_back(p, 0);
+    }
+  }
+
+  auto walk = [&](std::vector<Entry>& result)
+  {
+    while (true)
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCv.wait(lock, [&]() { return !dirQueue.empty() || busyWalkers == 0; });
+      if (dirQueue.empty())
+        return; // Nobody is busy, so nothing else will be found.
+
+      const std::pair<fs::path, size_t> dir = std::move(dirQueue.back());
+      dirQueue.pop_back();
+      ++busyWalkers;
+      lock.unlock();
+
+      std::vector<std::pair<fs::path, size_t>> subdirs;
+      bool tooDeep = false;
+      std::error_code ec;
+      for (fs::directory_iterator it(dir.first,
+               fs::directory_options::skip_permission_denied, ec);
+           !ec && it != fs::directory_iterator(); it.increment(ec))
+      {
+        struct stat st;
+        if (stat(it->path().c_str(), &st) != 0)
+          continue;
+
+        if (S_ISREG(st.st_mode))
+        {
+          result.push_back({ it->path().string(), uint64_t(st.st_size),
+              uint64_t(st.st_ino), uint64_t(st.st_dev) });
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+          if (dir.second + 1 > MAX_DEPTH)
+            tooDeep = true;
+          else
+            subdirs.emplace_back(it->path(), dir.second + 1);
+        }
+      }
+
+      lock.lock();
+      for (std::pair<fs::path, size_t>& s : subdirs)
+        dirQueue.push_back(std::move(s));
+      depthWarning |= tooDeep;
+      --busyWalkers;
+      lock.unlock();
+      queueCv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> walkers;
+  for (size_t t = 0; t < found.size(); ++t)
+    walkers.emplace_back(walk, std::ref(found[t]));
+  for (std::thread& w : walkers)
+    w.join();
+
+  if (depthWarning)
+  {
+    std::cerr << "Warning: Load file path reached the max depth of "
+        << MAX_DEPTH << ", not visiting any deeper files" << std::endl;
+  }
+
+  // Sort everything by path so that file IDs do not depend on which thread
+  // found what.
+  std::vector<Entry> all;
+  for (std::vector<Entry>& f : found)
+  {
+    all.insert(all.end(), std::make_move_iterator(f.begin()),
+        std::make_move_iterator(f.end()));
+    std::vector<Entry>().swap(f);
+  }
+  std::sort(all.begin(), all.end(),
+      [](const Entry& a, const Entry& b) { return a.path < b.path; });
+
+  size_t totalPathLen = 0;
+  for (const Entry& e : all)
+    totalPathLen += e.path.size() + 1;
+
+  paths.clear();
+  paths.reserve(totalPathLen);
+  order.clear();
+  pathOffsets.resize(all.size());
+  sizes.resize(all.size());
+  inodes.resize(all.size());
+  devices.resize(all.size());
+  for (size_t i = 0; i < all.size(); ++i)
+  {
+    pathOffsets[i] = paths.size();
+    paths.insert(paths.end(), all[i].path.begin(), all[i].path.end());
+    paths.push_back('\0');
+    sizes[i] = all[i].size;
+    inodes[i] = all[i].inode;
+    devices[i] = all[i].device;
+  }
+}
+
+// On-disk format: the magic string, then the number of files and the total
+// length of all paths, then the path offsets, sizes, inodes, devices, and path
+// data.
+static constexpr char fileCatalogMagic[8] = { 'P', 'N', 'G', 'C', 'A', 'T',
+                                              '0', '2' };
+
+inline void FileCatalog::Save(const std::string& filename) const
+{
+  std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+  const uint64_t header[2] = { uint64_t(Size()), uint64_t(paths.size()) };
+  f.write(fileCatalogMagic, sizeof(fileCatalogMagic));
+  f.write((const char*) header, sizeof(header));
+  f.write((const char*) pathOffsets.data(), sizeof(uint64_t) * Size());
+  f.write((const char*) sizes.data(), sizeof(uint64_t) * Size());
+  f.write((const char*) inodes.data(), sizeof(uint64_t) * Size());
+  f.write((const char*) devices.data(), sizeof(uint64_t) * Size());
+  f.write(paths.data(), paths.size());
+  if (!f)
+    throw std::runtime_error("could not save file catalog to " + filename);
+}
+
+inline void FileCatalog::Load(const std::string& filename)
+{
+  std::ifstream f(filename, std::ios::binary);
+  char magic[sizeof(fileCatalogMagic)];
+  uint64_t header[2];
+  f.read(magic, sizeof(magic));
+  f.read((char*) header, sizeof(header));
+  if (!f || memcmp(magic, fileCatalogMagic, sizeof(magic)) != 0)
+    throw std::runtime_error(filename + " is not a file catalog");
+
+  order.clear();
+  pathOffsets.resize(header[0]);
+  sizes.resize(header[0]);
+  inodes.resize(header[0]);
+  devices.resize(header[0]);
+  paths.resize(header[1]);
+  f.read((char*) pathOffsets.data(), sizeof(uint64_t) * header[0]);
+  f.read((char*) sizes.data(), sizeof(uint64_t) * header[0]);
+  f.read((char*) inodes.data(), sizeof(uint64_t) * header[0]);
+  f.read((char*) devices.data(), sizeof(uint64_t) * header[0]);
+  f.read(paths.data(), header[1]);
+  bool valid = f && (header[1] == 0 || paths.back() == '\0');
+  for (size_t i = 0; i < header[0] && valid; ++i)
+    valid = (pathOffsets[i] < header[1]);
+  if (!valid)
+    throw std::runtime_error("could not load file catalog from " + filename);
+}
+
+inline void FileCatalog::ScheduleBySize()
+{
+  order.resize(Size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  // Ties are broken by ID, so that files of the same size stay in path order.
+  std::stable_sort(order.begin(), order.end(),
+      [this](const uint64_t a, const uint64_t b) { return sizes[a] > sizes[b]; });
+}
+
+inline void FileCatalog::ScheduleByInode()
+{
+  ScheduleByDevice(inodes);
+}
+
+inline void FileCatalog::ScheduleByExtent(const size_t threads)
+{
+  // Look up where the first extent of each file is.  Files with no extents (or
+  // on filesystems without FIEMAP) sort after the others, by inode.
+  std::vector<uint64_t> physical(Size(), uint64_t(-1));
+  std::atomic<size_t> next(0);
+  auto lookup = [&]()
+  {
+    // Room for the request and one extent.
+    uint64_t request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+        sizeof(uint64_t) + 1];
+    struct fiemap* fm = (struct fiemap*) request;
+
+    size_t id;
+    while ((id = next.fetch_add(1)) < Size())
+    {
+      const int fd = open(Path(id), O_RDONLY);
+      if (fd == -1)
+        continue;
+
+      memset(request, 0, sizeof(request));
+      fm->fm_start = 0;
+      fm->fm_length = FIEMAP_MAX_OFFSET;
+      fm->fm_extent_count = 1;
+      if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0)
+        physical[id] = fm->fm_extents[0].fe_physical;
+      close(fd);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < std::max(threads, (size_t) 1); ++t)
+    workers.emplace_back(lookup);
+  for (std::thread& w : workers)
+    w.join();
+
+  ScheduleByDevice(physical);
+}
+
+inline void FileCatalog::ScheduleByDevice(const std::vector<uint64_t>& keys)
+{
+  order.resize(Size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  std::sort(order.begin(), order.end(),
+      [&](const uint64_t a, const uint64_t b)
+      {
+        if (devices[a] != devices[b])
+          return devices[a] < devices[b];
+        else if (keys[a] != keys[b])
+          return keys[a] < keys[b];
+        else
+          return inodes[a] < inodes[b];
+      });
+
+  // Now take files from each device in turn, so that every device has readers
+  // working on it at once.
+  std::vector<std::pair<size_t, size_t>> groups; // [start, end) in order
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    if (i == 0 || devices[order[i]] != devices[order[i - 1]])
+      groups.emplace_back(i, i);
+    groups.back().second = i + 1;
+  }
+
+  if (groups.size() > 1)
+  {
+    std::vector<uint64_t> interleaved;
+    interleaved.reserve(order.size());
+    while (interleaved.size() < order.size())
+    {
+      for (std::pair<size_t, size_t>& g : groups)
+      {
+        if (g.first < g.second)
+          interleaved.push_back(order[g.first++]);
+      }
+    }
+    order.swap(interleaved);
+  }
+}
+
+#endif
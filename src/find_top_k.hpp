@@ -27,8 +27,9 @@ inline uint32_t ComputeCutoff(
     ++it;
   }
 
-  if (it == countMap.end())
+  if (it == countMap.end() && sum <= cutoff)
   {
+    // All the bins together don't reach the cutoff.
     return 1;
   }
   else if (it != countMap.begin())
@@ -78,7 +79,8 @@ size_t FindTopK(CountsArrayType& counts,
     ++it;
   }
 
-  const size_t lastBinLimit = k - usedBeforeLastBin;
+  const size_t lastBinLimit = (usedBeforeLastBin < k) ?
+      (k - usedBeforeLastBin) : 0;
   return counts.CopyPrefixes(prefixes, minCount, lastBinLimit, prefixCounts);
 }
 
@@ -0,0 +1,88 @@
+// io_uring_queue.hpp: a minimal wrapper around a Linux io_uring instance, using
+// the raw system calls (so that we do not need liburing).  This only supports
+// what the reader threads need: opening and stat-ing files, reading into a
+// (possibly registered) buffer, and closing files.
+#ifndef PNGRAM_IO_URING_QUEUE_HPP
+#define PNGRAM_IO_URING_QUEUE_HPP
+
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stddef.h>
+
+class IoUringQueue
+{
+ public:
+  // Set up a ring with the given number of submission entries.  Throws a
+  // std::runtime_error if io_uring is not available, or if the kernel does not
+  // support all of the operations we need.
+  inline IoUringQueue(const unsigned entries);
+  inline ~IoUringQueue();
+
+  // Register a buffer so that reads can use IORING_OP_READ_FIXED.  Returns
+  // false if registration failed (e.g. because of RLIMIT_MEMLOCK); in that case
+  // the regular read operations still work.
+  inline bool RegisterBuffer(void* buffer, const size_t len);
+  bool BufferRegistered() const { return bufferRegistered; }
+
+  // Get the next free submission entry, or nullptr if the submission queue is
+  // full (in which case Submit() should be called first).
+  inline io_uring_sqe* GetSqe();
+
+  inline void PrepOpen(io_uring_sqe* sqe, const char* path, const uint64_t data);
+  inline void PrepStatx(io_uring_sqe* sqe,
+                        const char* path,
+                        struct statx* result,
+                        const uint64_t data);
+  // If a buffer is registered, `buffer` must lie inside of it.
+  inline void PrepRead(io_uring_sqe* sqe,
+                       const int fd,
+                       unsigned char* buffer,
+                       const unsigned len,
+                       const uint64_t offset,
+                       const uint64_t data);
+  inline void PrepClose(io_uring_sqe* sqe, const int fd, const uint64_t data);
+
+  // Submit all prepared entries, and wait until at least `waitFor` completions
+  // are available.
+  inline void Submit(const unsigned waitFor = 0);
+
+  // Returns false if there is no completion available.  Otherwise, `cqe` points
+  // to the completion, and CqeSeen() must be called when done with it.
+  inline bool PeekCqe(io_uring_cqe*& cqe);
+  inline void CqeSeen();
+
+  unsigned Entries() const { return sqEntries; }
+
+ private:
+  // Unmap the rings and close the ring file descriptor.
+  inline void Release();
+
+  int ringFd;
+  unsigned sqEntries;
+
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  io_uring_sqe* sqes;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  io_uring_cqe* cqes;
+
+  // Entries handed out by GetSqe() but not yet submitted.
+  unsigned sqeHead;
+  unsigned sqeTail;
+
+  bool bufferRegistered;
+};
+
+#include "io_uring_queue_impl.hpp"
+
+#endif
@@ -0,0 +1,238 @@
+// io_uring_queue_impl.hpp: implementation of IoUringQueue.
+#ifndef PNGRAM_IO_URING_QUEUE_IMPL_HPP
+#define PNGRAM_IO_URING_QUEUE_IMPL_HPP
+
+#include "io_uring_queue.hpp"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+inline IoUringQueue::IoUringQueue(const unsigned entries) :
+    ringFd(-1),
+    sqRing(MAP_FAILED),
+    sqRingSize(0),
+    cqRing(MAP_FAILED),
+    cqRingSize(0),
+    sqes((io_uring_sqe*) MAP_FAILED),
+    sqeHead(0),
+    sqeTail(0),
+    bufferRegistered(false)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(io_uring_params));
+  ringFd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ringFd < 0)
+  {
+    throw std::runtime_error(std::string("io_uring_setup() failed: ") +
+        strerror(errno));
+  }
+  sqEntries = params.sq_entries;
+
+  // Make sure that the kernel knows about every operation we use (openat,
+  // statx and read need Linux 5.6).
+  const size_t probeSize = sizeof(io_uring_probe) +
+      256 * sizeof(io_uring_probe_op);
+  io_uring_probe* probe = (io_uring_probe*) calloc(1, probeSize);
+  const int probeResult = syscall(__NR_io_uring_register, ringFd,
+      IORING_REGISTER_PROBE, probe, 256);
+  bool supported = (probeResult >= 0);
+  const uint8_t ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                          IORING_OP_READ_FIXED, IORING_OP_CLOSE };
+  for (const uint8_t op : ops)
+  {
+    if (supported && (op > probe->last_op ||
+        (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0))
+      supported = false;
+  }
+  free(probe);
+  if (!supported)
+  {
+    close(ringFd);
+    throw std::runtime_error("io_uring does not support the needed operations");
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (singleMmap)
+  {
+    sqRingSize = std::max(sqRingSize, cqRingSize);
+    cqRingSize = sqRingSize;
+  }
+
+  sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  if (sqRing != MAP_FAILED)
+  {
+    cqRing = singleMmap ? sqRing : mmap(NULL, cqRingSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+        IORING_OFF_CQ_RING);
+  }
+  if (cqRing != MAP_FAILED)
+  {
+    sqes = (io_uring_sqe*) mmap(NULL, sqEntries * sizeof(io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+        IORING_OFF_SQES);
+  }
+  if (sqes == MAP_FAILED)
+  {
+    const int err = errno;
+    Release();
+    throw std::runtime_error(std::string("could not map io_uring: ") +
+        strerror(err));
+  }
+
+  unsigned char* sq = (unsigned char*) sqRing;
+  unsigned char* cq = (unsigned char*) cqRing;
+  sqHead = (unsigned*) (sq + params.sq_off.head);
+  sqTail = (unsigned*) (sq + params.sq_off.tail);
+  sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+  sqArray = (unsigned*) (sq + params.sq_off.array);
+  cqHead = (unsigned*) (cq + params.cq_off.head);
+  cqTail = (unsigned*) (cq + params.cq_off.tail);
+  cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  sqeHead = sqeTail = *sqTail;
+}
+
+inline IoUringQueue::~IoUringQueue()
+{
+  Release();
+}
+
+inline void IoUringQueue::Release()
+{
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+  if (cqRing != MAP_FAILED && cqRing != sqRing)
+    munmap(cqRing, cqRingSize);
+  if (sqRing != MAP_FAILED)
+    munmap(sqRing, sqRingSize);
+  if (ringFd >= 0)
+    close(ringFd);
+
+  sqes = (io_uring_sqe*) MAP_FAILED;
+  cqRing = sqRing = MAP_FAILED;
+  ringFd = -1;
+}
+
+inline bool IoUringQueue::RegisterBuffer(void* buffer, const size_t len)
+{
+  iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = len;
+  bufferRegistered = (syscall(__NR_io_uring_register, ringFd,
+      IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+  return bufferRegistered;
+}
+
+inline io_uring_sqe* IoUringQueue::GetSqe()
+{
+  const unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  if (sqeTail - head >= sqEntries)
+    return nullptr;
+
+  io_uring_sqe* sqe = &sqes[sqeTail & *sqMask];
+  ++sqeTail;
+  memset(sqe, 0, sizeof(io_uring_sqe));
+  return sqe;
+}
+
+inline void IoUringQueue::PrepOpen(io_uring_sqe* sqe,
+                                   const char* path,
+                                   const uint64_t data)
+{
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) path;
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = data;
+}
+
+inline void IoUringQueue::PrepStatx(io_uring_sqe* sqe,
+                                    const char* path,
+                                    struct statx* result,
+                                    const uint64_t data)
+{
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) path;
+  sqe->len = STATX_SIZE;
+  sqe->off = (uint64_t) result;
+  sqe->user_data = data;
+}
+
+inline void IoUringQueue::PrepRead(io_uring_sqe* sqe,
+                                   const int fd,
+                                   unsigned char* buffer,
+                                   const unsigned len,
+                                   const uint64_t offset,
+                                   const uint64_t data)
+{
+  sqe->opcode = bufferRegistered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) buffer;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = 0;
+  sqe->user_data = data;
+}
+
+inline void IoUringQueue::PrepClose(io_uring_sqe* sqe,
+                                    const int fd,
+                                    const uint64_t data)
+{
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = data;
+}
+
+inline void IoUringQueue::Submit(const unsigned waitFor)
+{
+  // Move all prepared entries into the submission ring.
+  unsigned tail = *sqTail;
+  const unsigned toSubmit = sqeTail - sqeHead;
+  while (sqeHead != sqeTail)
+  {
+    sqArray[tail & *sqMask] = (sqeHead & *sqMask);
+    ++tail;
+    ++sqeHead;
+  }
+  __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+  if (toSubmit == 0 && waitFor == 0)
+    return;
+
+  int result;
+  do
+  {
+    result = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+        (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (result < 0 && errno == EINTR);
+}
+
+inline bool IoUringQueue::PeekCqe(io_uring_cqe*& cqe)
+{
+  const unsigned head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+    return false;
+
+  cqe = &cqes[head & *cqMask];
+  return true;
+}
+
+inline void IoUringQueue::CqeSeen()
+{
+  __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
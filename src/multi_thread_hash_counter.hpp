@@ -4,13 +4,50 @@
 #include <bitset>
 #include <atomic>
 #include "counts_array.hpp"
+#include "cpu_dispatch.hpp"
+#include "dirty_blocks.hpp"
+#include "numa_util.hpp"
+#include "reader_options.hpp"
+#include <vector>
 
 class MultiThreadHashCounter
 {
  public:
-  MultiThreadHashCounter();
+  // Each batch of `batchDepth` files (1 to maxBatchDepth) is collected in as
+  // many bitsets, and flushed at once; deeper batches flush less often, but
+  // take batchDepth * 2MB of bitsets.
+  //
+  // If `planes` is nonzero (4 to 16, and at least enough to count one batch),
+  // each batch is added into `planes`-bit
+  // bit-sliced counters (see addToPlanes()) instead of into the CountsArray,
+  // and the counters are only expanded into the CountsArray when another batch
+  // could overflow them; with 7 planes and batches of 8, that is every 120
+  // files.
+  //
+  // If `numaNode` is not -1, the bitsets and counters are placed on that NUMA
+  // node (which should be the node of the thread that uses the counter).
+  //
+  // `radixSet` selects how setAll() sets the bits of dense chunks (see
+  // setRadix()).
+  MultiThreadHashCounter(const size_t planes = 0,
+                         const size_t batchDepth = 8,
+                         const int numaNode = -1,
+                         const radix_set_mode radixSet =
+                             radix_set_mode::radix_off);
+  ~MultiThreadHashCounter();
 
   inline void set(const unsigned char* bytes);
+  // Set the bit for the n-gram in `bitset` (of bitsetLen elements) instead of
+  // in the current one.
+  inline void set(const unsigned char* bytes, uint64_t* bitset);
+  // Set the bits for the `count` n-grams that start at bytes[0], ...,
+  // bytes[count - 1] (in `bitset`, if given).  These use the best instruction
+  // set for the CPU (see cpu_dispatch.hpp), as do the flushes to a
+  // CountsArray.
+  inline void setAll(const unsigned char* bytes, const size_t count);
+  inline void setAll(const unsigned char* bytes,
+                     const size_t count,
+                     uint64_t* bitset);
   inline void clear();
   inline void flush(std::atomic_uint32_t* gram3_counts);
   inline void flush(CountsArray<>& countsArray);
@@ -19,8 +56,98 @@ class MultiThreadHashCounter
   inline void forceFlush(CountsArray<>& countsArray);
 
   // 2MB
-  alignas(64) uint64_t bits[8][262144];
+  static constexpr size_t bitsetLen = 262144;
+  // Bitset d of the batch is bits[d * bitsetLen] to
+  // bits[(d + 1) * bitsetLen - 1].
+  uint64_t* bits;
+  alloc_mem_state bitsMemState;
+  size_t batchDepth;
   size_t bitsIndex;
+  // The blocks of the bitsets that have anything set; flushes only visit
+  // those.
+  DirtyBlocks dirtyBlocks;
+  // The n-grams setAll() has set in this batch.  Past markLimit of them, every
+  // block is marked dirty at once, and setAll() stops marking them one by one.
+  size_t batchNgrams;
+  // Marking costs about as much as setting the bit, while a batch of dense
+  // files touches most blocks anyway: after as many n-grams as a bitset has
+  // words, flushing all blocks is cheaper than marking the rest.
+  static constexpr size_t markLimit = bitsetLen;
+
+  // The bit-sliced counters: planeBits[p * bitsetLen + i] holds bit p of the
+  // number of files (of the last slicedFiles) that each of the 64 n-grams of
+  // word i of the bitsets was in.
+  size_t planes;
+  uint64_t* planeBits;
+  alloc_mem_state planeBitsMemState;
+  DirtyBlocks planeDirtyBlocks;
+  size_t slicedFiles;
+
+  // Set the bit for the n-gram, and if Mark is true, mark its block dirty
+  // (that is only for our own bitsets).
+  template<bool Mark>
+  inline void setBit(const unsigned char* bytes, uint64_t* bitset);
+
+  // Set the bits for `count` n-grams without marking their blocks, with
+  // setRadix() or one at a time, as radixSet says.
+  inline void setUnmarked(const unsigned char* bytes,
+                          const size_t count,
+                          uint64_t* bitset);
+  // Set the bits for `count` n-grams in two passes, as in a partitioned hash
+  // join: first write their indices into radixBuffer, grouped by their top
+  // radixBits bits, then set the bits group by group.  Each group only
+  // touches its 1 / radixBuckets of the bitset (32KB), which stays in L1
+  // while the group is applied, instead of every n-gram missing somewhere in
+  // 2MB.  Whether that beats the extra pass depends on the caches and the
+  // chunk size, so radix_auto times both.
+  inline void setRadix(const unsigned char* bytes,
+                       const size_t count,
+                       uint64_t* bitset);
+  radix_set_mode radixSet;
+  std::vector<uint32_t> radixBuffer;
+  static constexpr size_t radixBits = 6;
+  static constexpr size_t radixBuckets = (size_t(1) << radixBits);
+  // Chunks with fewer n-grams are always set one at a time.
+  static constexpr size_t radixMinCount = 4096;
+  // With radix_auto, the first 2 * radixTrials big enough chunks alternate
+  // between the two ways, and the time per n-gram of each is kept.
+  static constexpr size_t radixTrials = 16;
+  size_t radixTrialCount;
+  double trialSeconds[2];
+  size_t trialNgrams[2];
+  // Whether setAll() partitions dense chunks (once radix_auto has decided).
+  bool UsesRadix() const { return radixSet == radix_set_mode::radix_on; }
+
+  // Call flushRange.operator()<Locked>(begin, end) on each range of dirty
+  // bitset indices; if the array is partitioned, these are split into ranges
+  // of the array that this thread owns, and Locked is false.
+  template<typename F>
+  inline void flushRanges(CountsArray<>& countsArray,
+                          DirtyBlocks& dirty,
+                          F&& flushRange);
+
+  // Flush all bitsets of the batch into the array (and clear them), with the
+  // kernel for batchDepth.
+  inline void flushBatch(CountsArray<>& countsArray);
+  // The flush loop over bitset indices [begin, end) of the first Depth
+  // bitsets, run by flushBatch() through RunKernel().  Unless Locked is true,
+  // the caller must own that range of the array.
+  template<size_t Depth, bool Locked>
+  inline void flushBitsets(CountsArray<>& countsArray,
+                           const size_t begin,
+                           const size_t end);
+
+  // Add words [begin, end) of the bitsets to the bit-sliced counters (and
+  // clear them).  As in a Harley-Seal popcount, carry-save adders sum 64
+  // n-grams of 8 bitsets at once with a few logical operations per bitset, and
+  // only the 4-bit sums touch the planes.
+  inline void addToPlanes(const size_t begin, const size_t end);
+  // Expand the bit-sliced counters into the array (and clear them).
+  inline void expandPlanes(CountsArray<>& countsArray);
+  template<bool Locked>
+  inline void flushPlanes(CountsArray<>& countsArray,
+                          const size_t begin,
+                          const size_t end);
 
   // Notes on things that do NOT help:
   //
@@ -4,697 +4,413 @@
 #include "multi_thread_hash_counter.hpp"
 #include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <bit>
+#include <chrono>
 
-inline MultiThreadHashCounter::MultiThreadHashCounter() :
-    bitsIndex(0)
+inline MultiThreadHashCounter::MultiThreadHashCounter(const size_t planes,
+                                                      const size_t batchDepth,
+                                                      const int numaNode,
+                                                      const radix_set_mode radixSet) :
+    batchDepth(std::clamp(batchDepth, (size_t) 1, maxBatchDepth)),
+    bitsIndex(0),
+    dirtyBlocks(bitsetLen),
+    batchNgrams(0),
+    planes(planes == 0 ? 0 : std::clamp(std::max(planes,
+        (size_t) std::bit_width(this->batchDepth)), (size_t) 4, (size_t) 16)),
+    planeBits(NULL),
+    planeDirtyBlocks(bitsetLen),
+    slicedFiles(0),
+    radixSet(radixSet),
+    radixTrialCount(0),
+    trialSeconds{ 0.0, 0.0 },
+    trialNgrams{ 0, 0 }
 {
-  clear();
+  // The bitsets (and counters) start out zeroed, but untouched: the counting
+  // thread touches them first, so they are zeroed on its node.
+  alloc_zeroed_hugepage<uint64_t>(bits, bitsMemState,
+      this->batchDepth * bitsetLen, "n-gramming");
+  if (numaNode >= 0)
+  {
+    BindToNumaNode(bits, sizeof(uint64_t) * this->batchDepth * bitsetLen,
+        numaNode);
+  }
+
+  if (this->planes > 0)
+  {
+    alloc_zeroed_hugepage<uint64_t>(planeBits, planeBitsMemState,
+        this->planes * bitsetLen, "bit-sliced counters");
+    if (numaNode >= 0)
+    {
+      BindToNumaNode(planeBits, sizeof(uint64_t) * this->planes * bitsetLen,
+          numaNode);
+    }
+  }
+}
+
+inline MultiThreadHashCounter::~MultiThreadHashCounter()
+{
+  free_hugepage<uint64_t>(bits, bitsMemState, batchDepth * bitsetLen);
+  if (planeBits != NULL)
+    free_hugepage<uint64_t>(planeBits, planeBitsMemState, planes * bitsetLen);
 }
 
 inline void MultiThreadHashCounter::set(const unsigned char* b)
+{
+  setBit<true>(b, bits + bitsIndex * bitsetLen);
+}
+
+inline void MultiThreadHashCounter::set(const unsigned char* b,
+                                        uint64_t* bitset)
+{
+  setBit<false>(b, bitset);
+}
+
+template<bool Mark>
+inline void MultiThreadHashCounter::setBit(const unsigned char* b,
+                                           uint64_t* bitset)
 {
   const size_t index = ((size_t(*b) << 16) + (size_t(*(b + 1)) << 8) +
       size_t(*(b + 2)));
 
   const size_t bitLoc = index / 64;
   const size_t bit = index & 0x3F;
-  bits[bitsIndex][bitLoc] |= (uint64_t(1) << bit);
+  bitset[bitLoc] |= (uint64_t(1) << bit);
+  if constexpr (Mark)
+    dirtyBlocks.Mark(bitLoc);
 }
 
-inline void MultiThreadHashCounter::clear()
+inline void MultiThreadHashCounter::setAll(const unsigned char* b,
+                                           const size_t count)
 {
-  memset(bits, 0, sizeof(uint64_t) * 8 * 262144);
+  RunKernel([&]()
+  {
+    uint64_t* bitset = bits + bitsIndex * bitsetLen;
+    size_t i = 0;
+    if (batchNgrams < markLimit)
+    {
+      const size_t marked = std::min(count, markLimit - batchNgrams);
+      for (; i < marked; ++i)
+        setBit<true>(b + i, bitset);
+
+      batchNgrams += marked;
+      if (batchNgrams == markLimit)
+        dirtyBlocks.MarkAll();
+    }
+
+    setUnmarked(b + i, count - i, bitset);
+  });
 }
 
-inline void MultiThreadHashCounter::flush(std::atomic_uint32_t* gramCounts)
+inline void MultiThreadHashCounter::setAll(const unsigned char* b,
+                                           const size_t count,
+                                           uint64_t* bitset)
 {
-  ++bitsIndex;
-  if (bitsIndex == 2)
-    bitsIndex = 0;
+  RunKernel([&]()
+  {
+    setUnmarked(b, count, bitset);
+  });
+}
 
-  if (bitsIndex == 1)
+inline void MultiThreadHashCounter::setUnmarked(const unsigned char* b,
+                                                const size_t count,
+                                                uint64_t* bitset)
+{
+  if (radixSet == radix_set_mode::radix_off || count < radixMinCount)
+  {
+    for (size_t i = 0; i < count; ++i)
+      setBit<false>(b + i, bitset);
     return;
+  }
+  else if (radixSet == radix_set_mode::radix_on)
+  {
+    setRadix(b, count, bitset);
+    return;
+  }
 
-  for (size_t i = 0; i < 262144; ++i)
+  // Still timing both ways (trial 0 is one at a time, trial 1 is setRadix()).
+  const size_t trial = radixTrialCount % 2;
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (trial == 0)
   {
-    __builtin_prefetch(&gramCounts[64 * (i + 1)], 1, 3);
+    for (size_t i = 0; i < count; ++i)
+      setBit<false>(b + i, bitset);
+  }
+  else
+  {
+    setRadix(b, count, bitset);
+  }
+  trialSeconds[trial] += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  trialNgrams[trial] += count;
 
-    const uint64_t& b1 = bits[0][i];
-    const uint64_t& b2 = bits[1][i];
-    if (b1 == 0 && b2 == 0)
-      continue;
+  // Only partition if it was clearly faster.
+  if (++radixTrialCount == 2 * radixTrials)
+  {
+    const double plain = trialSeconds[0] / trialNgrams[0];
+    const double radix = trialSeconds[1] / trialNgrams[1];
+    radixSet = (radix < 0.9 * plain) ? radix_set_mode::radix_on :
+        radix_set_mode::radix_off;
+  }
+}
 
-    if ((b1 & 0x0000000000000001) == 0x0000000000000001)
-      ++gramCounts[64 * i];
-    if ((b2 & 0x0000000000000001) == 0x0000000000000001)
-      ++gramCounts[64 * i];
-    if ((b1 & 0x0000000000000002) == 0x0000000000000002)
-      ++gramCounts[64 * i + 1];
-    if ((b2 & 0x0000000000000002) == 0x0000000000000002)
-      ++gramCounts[64 * i + 1];
-    if ((b1 & 0x0000000000000004) == 0x0000000000000004)
-      ++gramCounts[64 * i + 2];
-    if ((b2 & 0x0000000000000004) == 0x0000000000000004)
-      ++gramCounts[64 * i + 2];
-    if ((b1 & 0x0000000000000008) == 0x0000000000000008)
-      ++gramCounts[64 * i + 3];
-    if ((b2 & 0x0000000000000008) == 0x0000000000000008)
-      ++gramCounts[64 * i + 3];
-    if ((b1 & 0x0000000000000010) == 0x0000000000000010)
-      ++gramCounts[64 * i + 4];
-    if ((b2 & 0x0000000000000010) == 0x0000000000000010)
-      ++gramCounts[64 * i + 4];
-    if ((b1 & 0x0000000000000020) == 0x0000000000000020)
-      ++gramCounts[64 * i + 5];
-    if ((b2 & 0x0000000000000020) == 0x0000000000000020)
-      ++gramCounts[64 * i + 5];
-    if ((b1 & 0x0000000000000040) == 0x0000000000000040)
-      ++gramCounts[64 * i + 6];
-    if ((b2 & 0x0000000000000040) == 0x0000000000000040)
-      ++gramCounts[64 * i + 6];
-    if ((b1 & 0x0000000000000080) == 0x0000000000000080)
-      ++gramCounts[64 * i + 7];
-    if ((b2 & 0x0000000000000080) == 0x0000000000000080)
-      ++gramCounts[64 * i + 7];
-    if ((b1 & 0x0000000000000100) == 0x0000000000000100)
-      ++gramCounts[64 * i + 8];
-    if ((b2 & 0x0000000000000100) == 0x0000000000000100)
-      ++gramCounts[64 * i + 8];
-    if ((b1 & 0x0000000000000200) == 0x0000000000000200)
-      ++gramCounts[64 * i + 9];
-    if ((b2 & 0x0000000000000200) == 0x0000000000000200)
-      ++gramCounts[64 * i + 9];
-    if ((b1 & 0x0000000000000400) == 0x0000000000000400)
-      ++gramCounts[64 * i + 10];
-    if ((b2 & 0x0000000000000400) == 0x0000000000000400)
-      ++gramCounts[64 * i + 10];
-    if ((b1 & 0x0000000000000800) == 0x0000000000000800)
-      ++gramCounts[64 * i + 11];
-    if ((b2 & 0x0000000000000800) == 0x0000000000000800)
-      ++gramCounts[64 * i + 11];
-    if ((b1 & 0x0000000000001000) == 0x0000000000001000)
-      ++gramCounts[64 * i + 12];
-    if ((b2 & 0x0000000000001000) == 0x0000000000001000)
-      ++gramCounts[64 * i + 12];
-    if ((b1 & 0x0000000000002000) == 0x0000000000002000)
-      ++gramCounts[64 * i + 13];
-    if ((b2 & 0x0000000000002000) == 0x0000000000002000)
-      ++gramCounts[64 * i + 13];
-    if ((b1 & 0x0000000000004000) == 0x0000000000004000)
-      ++gramCounts[64 * i + 14];
-    if ((b2 & 0x0000000000004000) == 0x0000000000004000)
-      ++gramCounts[64 * i + 14];
-    if ((b1 & 0x0000000000008000) == 0x0000000000008000)
-      ++gramCounts[64 * i + 15];
-    if ((b2 & 0x0000000000008000) == 0x0000000000008000)
-      ++gramCounts[64 * i + 15];
-    if ((b1 & 0x0000000000010000) == 0x0000000000010000)
-      ++gramCounts[64 * i + 16];
-    if ((b2 & 0x0000000000010000) == 0x0000000000010000)
-      ++gramCounts[64 * i + 16];
-    if ((b1 & 0x0000000000020000) == 0x0000000000020000)
-      ++gramCounts[64 * i + 17];
-    if ((b2 & 0x0000000000020000) == 0x0000000000020000)
-      ++gramCounts[64 * i + 17];
-    if ((b1 & 0x0000000000040000) == 0x0000000000040000)
-      ++gramCounts[64 * i + 18];
-    if ((b2 & 0x0000000000040000) == 0x0000000000040000)
-      ++gramCounts[64 * i + 18];
-    if ((b1 & 0x0000000000080000) == 0x0000000000080000)
-      ++gramCounts[64 * i + 19];
-    if ((b2 & 0x0000000000080000) == 0x0000000000080000)
-      ++gramCounts[64 * i + 19];
-    if ((b1 & 0x0000000000100000) == 0x0000000000100000)
-      ++gramCounts[64 * i + 20];
-    if ((b2 & 0x0000000000100000) == 0x0000000000100000)
-      ++gramCounts[64 * i + 20];
-    if ((b1 & 0x0000000000200000) == 0x0000000000200000)
-      ++gramCounts[64 * i + 21];
-    if ((b2 & 0x0000000000200000) == 0x0000000000200000)
-      ++gramCounts[64 * i + 21];
-    if ((b1 & 0x0000000000400000) == 0x0000000000400000)
-      ++gramCounts[64 * i + 22];
-    if ((b2 & 0x0000000000400000) == 0x0000000000400000)
-      ++gramCounts[64 * i + 22];
-    if ((b1 & 0x0000000000800000) == 0x0000000000800000)
-      ++gramCounts[64 * i + 23];
-    if ((b2 & 0x0000000000800000) == 0x0000000000800000)
-      ++gramCounts[64 * i + 23];
-    if ((b1 & 0x0000000001000000) == 0x0000000001000000)
-      ++gramCounts[64 * i + 24];
-    if ((b2 & 0x0000000001000000) == 0x0000000001000000)
-      ++gramCounts[64 * i + 24];
-    if ((b1 & 0x0000000002000000) == 0x0000000002000000)
-      ++gramCounts[64 * i + 25];
-    if ((b2 & 0x0000000002000000) == 0x0000000002000000)
-      ++gramCounts[64 * i + 25];
-    if ((b1 & 0x0000000004000000) == 0x0000000004000000)
-      ++gramCounts[64 * i + 26];
-    if ((b2 & 0x0000000004000000) == 0x0000000004000000)
-      ++gramCounts[64 * i + 26];
-    if ((b1 & 0x0000000008000000) == 0x0000000008000000)
-      ++gramCounts[64 * i + 27];
-    if ((b2 & 0x0000000008000000) == 0x0000000008000000)
-      ++gramCounts[64 * i + 27];
-    if ((b1 & 0x0000000010000000) == 0x0000000010000000)
-      ++gramCounts[64 * i + 28];
-    if ((b2 & 0x0000000010000000) == 0x0000000010000000)
-      ++gramCounts[64 * i + 28];
-    if ((b1 & 0x0000000020000000) == 0x0000000020000000)
-      ++gramCounts[64 * i + 29];
-    if ((b2 & 0x0000000020000000) == 0x0000000020000000)
-      ++gramCounts[64 * i + 29];
-    if ((b1 & 0x0000000040000000) == 0x0000000040000000)
-      ++gramCounts[64 * i + 30];
-    if ((b2 & 0x0000000040000000) == 0x0000000040000000)
-      ++gramCounts[64 * i + 30];
-    if ((b1 & 0x0000000080000000) == 0x0000000080000000)
-      ++gramCounts[64 * i + 31];
-    if ((b2 & 0x0000000080000000) == 0x0000000080000000)
-      ++gramCounts[64 * i + 31];
-    if ((b1 & 0x0000000100000000) == 0x0000000100000000)
-      ++gramCounts[64 * i + 32];
-    if ((b2 & 0x0000000100000000) == 0x0000000100000000)
-      ++gramCounts[64 * i + 32];
-    if ((b1 & 0x0000000200000000) == 0x0000000200000000)
-      ++gramCounts[64 * i + 33];
-    if ((b2 & 0x0000000200000000) == 0x0000000200000000)
-      ++gramCounts[64 * i + 33];
-    if ((b1 & 0x0000000400000000) == 0x0000000400000000)
-      ++gramCounts[64 * i + 34];
-    if ((b2 & 0x0000000400000000) == 0x0000000400000000)
-      ++gramCounts[64 * i + 34];
-    if ((b1 & 0x0000000800000000) == 0x0000000800000000)
-      ++gramCounts[64 * i + 35];
-    if ((b2 & 0x0000000800000000) == 0x0000000800000000)
-      ++gramCounts[64 * i + 35];
-    if ((b1 & 0x0000001000000000) == 0x0000001000000000)
-      ++gramCounts[64 * i + 36];
-    if ((b2 & 0x0000001000000000) == 0x0000001000000000)
-      ++gramCounts[64 * i + 36];
-    if ((b1 & 0x0000002000000000) == 0x0000002000000000)
-      ++gramCounts[64 * i + 37];
-    if ((b2 & 0x0000002000000000) == 0x0000002000000000)
-      ++gramCounts[64 * i + 37];
-    if ((b1 & 0x0000004000000000) == 0x0000004000000000)
-      ++gramCounts[64 * i + 38];
-    if ((b2 & 0x0000004000000000) == 0x0000004000000000)
-      ++gramCounts[64 * i + 38];
-    if ((b1 & 0x0000008000000000) == 0x0000008000000000)
-      ++gramCounts[64 * i + 39];
-    if ((b2 & 0x0000008000000000) == 0x0000008000000000)
-      ++gramCounts[64 * i + 39];
-    if ((b1 & 0x0000010000000000) == 0x0000010000000000)
-      ++gramCounts[64 * i + 40];
-    if ((b2 & 0x0000010000000000) == 0x0000010000000000)
-      ++gramCounts[64 * i + 40];
-    if ((b1 & 0x0000020000000000) == 0x0000020000000000)
-      ++gramCounts[64 * i + 41];
-    if ((b2 & 0x0000020000000000) == 0x0000020000000000)
-      ++gramCounts[64 * i + 41];
-    if ((b1 & 0x0000040000000000) == 0x0000040000000000)
-      ++gramCounts[64 * i + 42];
-    if ((b2 & 0x0000040000000000) == 0x0000040000000000)
-      ++gramCounts[64 * i + 42];
-    if ((b1 & 0x0000080000000000) == 0x0000080000000000)
-      ++gramCounts[64 * i + 43];
-    if ((b2 & 0x0000080000000000) == 0x0000080000000000)
-      ++gramCounts[64 * i + 43];
-    if ((b1 & 0x0000100000000000) == 0x0000100000000000)
-      ++gramCounts[64 * i + 44];
-    if ((b2 & 0x0000100000000000) == 0x0000100000000000)
-      ++gramCounts[64 * i + 44];
-    if ((b1 & 0x0000200000000000) == 0x0000200000000000)
-      ++gramCounts[64 * i + 45];
-    if ((b2 & 0x0000200000000000) == 0x0000200000000000)
-      ++gramCounts[64 * i + 45];
-    if ((b1 & 0x0000400000000000) == 0x0000400000000000)
-      ++gramCounts[64 * i + 46];
-    if ((b2 & 0x0000400000000000) == 0x0000400000000000)
-      ++gramCounts[64 * i + 46];
-    if ((b1 & 0x0000800000000000) == 0x0000800000000000)
-      ++gramCounts[64 * i + 47];
-    if ((b2 & 0x0000800000000000) == 0x0000800000000000)
-      ++gramCounts[64 * i + 47];
-    if ((b1 & 0x0001000000000000) == 0x0001000000000000)
-      ++gramCounts[64 * i + 48];
-    if ((b2 & 0x0001000000000000) == 0x0001000000000000)
-      ++gramCounts[64 * i + 48];
-    if ((b1 & 0x0002000000000000) == 0x0002000000000000)
-      ++gramCounts[64 * i + 49];
-    if ((b2 & 0x0002000000000000) == 0x0002000000000000)
-      ++gramCounts[64 * i + 49];
-    if ((b1 & 0x0004000000000000) == 0x0004000000000000)
-      ++gramCounts[64 * i + 50];
-    if ((b2 & 0x0004000000000000) == 0x0004000000000000)
-      ++gramCounts[64 * i + 50];
-    if ((b1 & 0x0008000000000000) == 0x0008000000000000)
-      ++gramCounts[64 * i + 51];
-    if ((b2 & 0x0008000000000000) == 0x0008000000000000)
-      ++gramCounts[64 * i + 51];
-    if ((b1 & 0x0010000000000000) == 0x0010000000000000)
-      ++gramCounts[64 * i + 52];
-    if ((b2 & 0x0010000000000000) == 0x0010000000000000)
-      ++gramCounts[64 * i + 52];
-    if ((b1 & 0x0020000000000000) == 0x0020000000000000)
-      ++gramCounts[64 * i + 53];
-    if ((b2 & 0x0020000000000000) == 0x0020000000000000)
-      ++gramCounts[64 * i + 53];
-    if ((b1 & 0x0040000000000000) == 0x0040000000000000)
-      ++gramCounts[64 * i + 54];
-    if ((b2 & 0x0040000000000000) == 0x0040000000000000)
-      ++gramCounts[64 * i + 54];
-    if ((b1 & 0x0080000000000000) == 0x0080000000000000)
-      ++gramCounts[64 * i + 55];
-    if ((b2 & 0x0080000000000000) == 0x0080000000000000)
-      ++gramCounts[64 * i + 55];
-    if ((b1 & 0x0100000000000000) == 0x0100000000000000)
-      ++gramCounts[64 * i + 56];
-    if ((b2 & 0x0100000000000000) == 0x0100000000000000)
-      ++gramCounts[64 * i + 56];
-    if ((b1 & 0x0200000000000000) == 0x0200000000000000)
-      ++gramCounts[64 * i + 57];
-    if ((b2 & 0x0200000000000000) == 0x0200000000000000)
-      ++gramCounts[64 * i + 57];
-    if ((b1 & 0x0400000000000000) == 0x0400000000000000)
-      ++gramCounts[64 * i + 58];
-    if ((b2 & 0x0400000000000000) == 0x0400000000000000)
-      ++gramCounts[64 * i + 58];
-    if ((b1 & 0x0800000000000000) == 0x0800000000000000)
-      ++gramCounts[64 * i + 59];
-    if ((b2 & 0x0800000000000000) == 0x0800000000000000)
-      ++gramCounts[64 * i + 59];
-    if ((b1 & 0x1000000000000000) == 0x1000000000000000)
-      ++gramCounts[64 * i + 60];
-    if ((b2 & 0x1000000000000000) == 0x1000000000000000)
-      ++gramCounts[64 * i + 60];
-    if ((b1 & 0x2000000000000000) == 0x2000000000000000)
-      ++gramCounts[64 * i + 61];
-    if ((b2 & 0x2000000000000000) == 0x2000000000000000)
-      ++gramCounts[64 * i + 61];
-    if ((b1 & 0x4000000000000000) == 0x4000000000000000)
-      ++gramCounts[64 * i + 62];
-    if ((b2 & 0x4000000000000000) == 0x4000000000000000)
-      ++gramCounts[64 * i + 62];
-    if ((b1 & 0x8000000000000000) == 0x8000000000000000)
-      ++gramCounts[64 * i + 63];
-    if ((b2 & 0x8000000000000000) == 0x8000000000000000)
-      ++gramCounts[64 * i + 63];
+inline void MultiThreadHashCounter::setRadix(const unsigned char* b,
+                                             const size_t count,
+                                             uint64_t* bitset)
+{
+  // The top bits of the index are the top bits of the first byte, so count
+  // the n-grams of each group from those, and find where each group starts.
+  size_t starts[radixBuckets + 1] = { 0 };
+  for (size_t i = 0; i < count; ++i)
+    ++starts[(b[i] >> (8 - radixBits)) + 1];
+  for (size_t k = 1; k <= radixBuckets; ++k)
+    starts[k] += starts[k - 1];
+
+  if (radixBuffer.size() < count)
+    radixBuffer.resize(count);
+  uint32_t* buffer = radixBuffer.data();
+  for (size_t i = 0; i < count; ++i)
+  {
+    const uint32_t index = (uint32_t(b[i]) << 16) |
+        (uint32_t(b[i + 1]) << 8) | uint32_t(b[i + 2]);
+    buffer[starts[index >> (24 - radixBits)]++] = index;
   }
 
+  // The buffer now holds the groups in order.
+  for (size_t i = 0; i < count; ++i)
+    bitset[buffer[i] / 64] |= (uint64_t(1) << (buffer[i] & 0x3F));
+}
+
+inline void MultiThreadHashCounter::clear()
+{
+  memset(bits, 0, sizeof(uint64_t) * batchDepth * bitsetLen);
+  dirtyBlocks.Clear();
+  batchNgrams = 0;
+}
+
+inline void MultiThreadHashCounter::flush(std::atomic_uint32_t* gramCounts)
+{
+  ++bitsIndex;
+  if (bitsIndex != batchDepth)
+    return;
+
+  forceFlush(gramCounts);
+  bitsIndex = 0;
   clear();
 }
 
 inline void MultiThreadHashCounter::flush(CountsArray<>& countsArray)
 {
   ++bitsIndex;
-  if (bitsIndex == 8)
+  if (bitsIndex == batchDepth)
     bitsIndex = 0;
 
   if (bitsIndex != 0)
     return;
 
-  for (size_t i = 0; i < 262144; ++i)
+  // (The flush below marks every block clean again.)
+  batchNgrams = 0;
+  if (planes > 0)
   {
-    if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-        bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-        bits[6][i] != 0 || bits[7][i] != 0)
+    RunKernel([&]()
     {
-      countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i], bits[3][i],
-          bits[4][i], bits[5][i], bits[6][i], bits[7][i]);
-
-      bits[0][i] = 0;
-      bits[1][i] = 0;
-      bits[2][i] = 0;
-      bits[3][i] = 0;
-      bits[4][i] = 0;
-      bits[5][i] = 0;
-      bits[6][i] = 0;
-      bits[7][i] = 0;
-    }
-    //if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-    //    bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-    //    bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-    //    bits[9][i] != 0 || bits[10][i] != 0 || bits[11][i] != 0 ||
-    //    bits[12][i] != 0 || bits[13][i] != 0 || bits[14][i] != 0 ||
-    //    bits[15][i] != 0)
-    //{
-    //  countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i], bits[3][i],
-    //      bits[4][i], bits[5][i], bits[6][i], bits[7][i], bits[8][i],
-    //      bits[9][i], bits[10][i], bits[11][i], bits[12][i], bits[13][i],
-    //      bits[14][i], bits[15][i]);
-    //}
+      planeDirtyBlocks.Merge(dirtyBlocks);
+      dirtyBlocks.ForEachDirtyRange(0, bitsetLen,
+          [&](const size_t begin, const size_t end)
+          { addToPlanes(begin, end); });
+    });
+    slicedFiles += batchDepth;
+    if (slicedFiles + batchDepth > (size_t(1) << planes) - 1)
+      expandPlanes(countsArray);
+    return;
   }
+
+  flushBatch(countsArray);
 }
 
-inline void MultiThreadHashCounter::forceFlush(std::atomic_uint32_t* gramCounts)
+inline void MultiThreadHashCounter::flushBatch(CountsArray<>& countsArray)
 {
-  if (bitsIndex == 0)
-    return; // already flushed
-
-  for (size_t i = 0; i < 262144; ++i)
+  WithBatchDepth(batchDepth, [&]<size_t Depth>()
   {
-    __builtin_prefetch(&gramCounts[64 * (i + 1)], 1, 3);
+    RunKernel([&]()
+    {
+      flushRanges(countsArray, dirtyBlocks,
+          [&]<bool Locked>(const size_t begin, const size_t end)
+          { flushBitsets<Depth, Locked>(countsArray, begin, end); });
+    });
+  });
+}
 
-    const uint64_t& b = bits[0][i];
-    if (b == 0)
+template<size_t Depth, bool Locked>
+inline void MultiThreadHashCounter::flushBitsets(
+    CountsArray<>& countsArray,
+    const size_t begin,
+    const size_t end)
+{
+  for (size_t i = begin; i < end; ++i)
+  {
+    uint64_t any = 0;
+    for (size_t d = 0; d < Depth; ++d)
+      any |= bits[d * bitsetLen + i];
+    if (any == 0)
       continue;
 
-    if ((b & 0x0000000000000001) == 0x0000000000000001)
-      ++gramCounts[64 * i];
-    if ((b & 0x0000000000000002) == 0x0000000000000002)
-      ++gramCounts[64 * i + 1];
-    if ((b & 0x0000000000000004) == 0x0000000000000004)
-      ++gramCounts[64 * i + 2];
-    if ((b & 0x0000000000000008) == 0x0000000000000008)
-      ++gramCounts[64 * i + 3];
-    if ((b & 0x0000000000000010) == 0x0000000000000010)
-      ++gramCounts[64 * i + 4];
-    if ((b & 0x0000000000000020) == 0x0000000000000020)
-      ++gramCounts[64 * i + 5];
-    if ((b & 0x0000000000000040) == 0x0000000000000040)
-      ++gramCounts[64 * i + 6];
-    if ((b & 0x0000000000000080) == 0x0000000000000080)
-      ++gramCounts[64 * i + 7];
-    if ((b & 0x0000000000000100) == 0x0000000000000100)
-      ++gramCounts[64 * i + 8];
-    if ((b & 0x0000000000000200) == 0x0000000000000200)
-      ++gramCounts[64 * i + 9];
-    if ((b & 0x0000000000000400) == 0x0000000000000400)
-      ++gramCounts[64 * i + 10];
-    if ((b & 0x0000000000000800) == 0x0000000000000800)
-      ++gramCounts[64 * i + 11];
-    if ((b & 0x0000000000001000) == 0x0000000000001000)
-      ++gramCounts[64 * i + 12];
-    if ((b & 0x0000000000002000) == 0x0000000000002000)
-      ++gramCounts[64 * i + 13];
-    if ((b & 0x0000000000004000) == 0x0000000000004000)
-      ++gramCounts[64 * i + 14];
-    if ((b & 0x0000000000008000) == 0x0000000000008000)
-      ++gramCounts[64 * i + 15];
-    if ((b & 0x0000000000010000) == 0x0000000000010000)
-      ++gramCounts[64 * i + 16];
-    if ((b & 0x0000000000020000) == 0x0000000000020000)
-      ++gramCounts[64 * i + 17];
-    if ((b & 0x0000000000040000) == 0x0000000000040000)
-      ++gramCounts[64 * i + 18];
-    if ((b & 0x0000000000080000) == 0x0000000000080000)
-      ++gramCounts[64 * i + 19];
-    if ((b & 0x0000000000100000) == 0x0000000000100000)
-      ++gramCounts[64 * i + 20];
-    if ((b & 0x0000000000200000) == 0x0000000000200000)
-      ++gramCounts[64 * i + 21];
-    if ((b & 0x0000000000400000) == 0x0000000000400000)
-      ++gramCounts[64 * i + 22];
-    if ((b & 0x0000000000800000) == 0x0000000000800000)
-      ++gramCounts[64 * i + 23];
-    if ((b & 0x0000000001000000) == 0x0000000001000000)
-      ++gramCounts[64 * i + 24];
-    if ((b & 0x0000000002000000) == 0x0000000002000000)
-      ++gramCounts[64 * i + 25];
-    if ((b & 0x0000000004000000) == 0x0000000004000000)
-      ++gramCounts[64 * i + 26];
-    if ((b & 0x0000000008000000) == 0x0000000008000000)
-      ++gramCounts[64 * i + 27];
-    if ((b & 0x0000000010000000) == 0x0000000010000000)
-      ++gramCounts[64 * i + 28];
-    if ((b & 0x0000000020000000) == 0x0000000020000000)
-      ++gramCounts[64 * i + 29];
-    if ((b & 0x0000000040000000) == 0x0000000040000000)
-      ++gramCounts[64 * i + 30];
-    if ((b & 0x0000000080000000) == 0x0000000080000000)
-      ++gramCounts[64 * i + 31];
-    if ((b & 0x0000000100000000) == 0x0000000100000000)
-      ++gramCounts[64 * i + 32];
-    if ((b & 0x0000000200000000) == 0x0000000200000000)
-      ++gramCounts[64 * i + 33];
-    if ((b & 0x0000000400000000) == 0x0000000400000000)
-      ++gramCounts[64 * i + 34];
-    if ((b & 0x0000000800000000) == 0x0000000800000000)
-      ++gramCounts[64 * i + 35];
-    if ((b & 0x0000001000000000) == 0x0000001000000000)
-      ++gramCounts[64 * i + 36];
-    if ((b & 0x0000002000000000) == 0x0000002000000000)
-      ++gramCounts[64 * i + 37];
-    if ((b & 0x0000004000000000) == 0x0000004000000000)
-      ++gramCounts[64 * i + 38];
-    if ((b & 0x0000008000000000) == 0x0000008000000000)
-      ++gramCounts[64 * i + 39];
-    if ((b & 0x0000010000000000) == 0x0000010000000000)
-      ++gramCounts[64 * i + 40];
-    if ((b & 0x0000020000000000) == 0x0000020000000000)
-      ++gramCounts[64 * i + 41];
-    if ((b & 0x0000040000000000) == 0x0000040000000000)
-      ++gramCounts[64 * i + 42];
-    if ((b & 0x0000080000000000) == 0x0000080000000000)
-      ++gramCounts[64 * i + 43];
-    if ((b & 0x0000100000000000) == 0x0000100000000000)
-      ++gramCounts[64 * i + 44];
-    if ((b & 0x0000200000000000) == 0x0000200000000000)
-      ++gramCounts[64 * i + 45];
-    if ((b & 0x0000400000000000) == 0x0000400000000000)
-      ++gramCounts[64 * i + 46];
-    if ((b & 0x0000800000000000) == 0x0000800000000000)
-      ++gramCounts[64 * i + 47];
-    if ((b & 0x0001000000000000) == 0x0001000000000000)
-      ++gramCounts[64 * i + 48];
-    if ((b & 0x0002000000000000) == 0x0002000000000000)
-      ++gramCounts[64 * i + 49];
-    if ((b & 0x0004000000000000) == 0x0004000000000000)
-      ++gramCounts[64 * i + 50];
-    if ((b & 0x0008000000000000) == 0x0008000000000000)
-      ++gramCounts[64 * i + 51];
-    if ((b & 0x0010000000000000) == 0x0010000000000000)
-      ++gramCounts[64 * i + 52];
-    if ((b & 0x0020000000000000) == 0x0020000000000000)
-      ++gramCounts[64 * i + 53];
-    if ((b & 0x0040000000000000) == 0x0040000000000000)
-      ++gramCounts[64 * i + 54];
-    if ((b & 0x0080000000000000) == 0x0080000000000000)
-      ++gramCounts[64 * i + 55];
-    if ((b & 0x0100000000000000) == 0x0100000000000000)
-      ++gramCounts[64 * i + 56];
-    if ((b & 0x0200000000000000) == 0x0200000000000000)
-      ++gramCounts[64 * i + 57];
-    if ((b & 0x0400000000000000) == 0x0400000000000000)
-      ++gramCounts[64 * i + 58];
-    if ((b & 0x0800000000000000) == 0x0800000000000000)
-      ++gramCounts[64 * i + 59];
-    if ((b & 0x1000000000000000) == 0x1000000000000000)
-      ++gramCounts[64 * i + 60];
-    if ((b & 0x2000000000000000) == 0x2000000000000000)
-      ++gramCounts[64 * i + 61];
-    if ((b & 0x4000000000000000) == 0x4000000000000000)
-      ++gramCounts[64 * i + 62];
-    if ((b & 0x8000000000000000) == 0x8000000000000000)
-      ++gramCounts[64 * i + 63];
+    countsArray.IncrementBatch<Depth, Locked>(i, bits + i, bitsetLen);
+    for (size_t d = 0; d < Depth; ++d)
+      bits[d * bitsetLen + i] = 0;
   }
 }
 
-inline void MultiThreadHashCounter::forceFlush(CountsArray<>& countsArray)
+inline void MultiThreadHashCounter::forceFlush(std::atomic_uint32_t* gramCounts)
 {
-  if (bitsIndex == 1)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0)
-        countsArray.Increment(i, bits[0][i]);
-    }
-  }
-  else if (bitsIndex == 2)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0)
-        countsArray.Increment(i, bits[0][i], bits[1][i]);
-    }
-  }
-  else if (bitsIndex == 3)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 4)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i]);
-      }
-    }
-  }
-  else if (bitsIndex == 5)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 6)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], (uint64_t) 0, (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 7)
-  {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 8)
+  if (bitsIndex == 0)
+    return; // already flushed
+
+  // (When called by flush(), the whole batch has been filled.)
+  for (size_t i = 0; i < bitsetLen; ++i)
   {
-    for (size_t i = 0; i < 262144; ++i)
+    __builtin_prefetch(&gramCounts[64 * (i + 1)], 1, 3);
+
+    for (size_t d = 0; d < bitsIndex; ++d)
     {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0)
+      uint64_t b = bits[d * bitsetLen + i];
+      while (b != 0)
       {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i]);
+        ++gramCounts[64 * i + __builtin_ctzll(b)];
+        b &= (b - 1);
       }
     }
   }
-  else if (bitsIndex == 9)
+}
+
+inline void MultiThreadHashCounter::forceFlush(CountsArray<>& countsArray)
+{
+  // The bitsets past bitsIndex are empty, so the whole batch can be flushed
+  // with the same kernel as usual.
+  if (bitsIndex != 0)
   {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0,
-            (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
+    flushBatch(countsArray);
+    bitsIndex = 0;
+    batchNgrams = 0;
   }
-  else if (bitsIndex == 10)
+
+  if (slicedFiles > 0)
+    expandPlanes(countsArray);
+}
+
+template<typename F>
+inline void MultiThreadHashCounter::flushRanges(CountsArray<>& countsArray,
+                                                DirtyBlocks& dirty,
+                                                F&& flushRange)
+{
+  if (countsArray.Partitioned())
   {
-    for (size_t i = 0; i < 262144; ++i)
+    countsArray.ForEachOwnedRange(bitsetLen,
+        [&](const size_t begin, const size_t end)
     {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], (uint64_t) 0, (uint64_t) 0, (uint64_t) 0,
-            (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
+      dirty.ForEachDirtyRange(begin, end,
+          [&](const size_t runBegin, const size_t runEnd)
+          { flushRange.template operator()<false>(runBegin, runEnd); });
+    });
   }
-  else if (bitsIndex == 11)
+  else
   {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0 || bits[10][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], bits[10][i], (uint64_t) 0, (uint64_t) 0,
-            (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
+    dirty.ForEachDirtyRange(0, bitsetLen,
+        [&](const size_t runBegin, const size_t runEnd)
+        { flushRange.template operator()<true>(runBegin, runEnd); });
   }
-  else if (bitsIndex == 12)
+}
+
+inline void MultiThreadHashCounter::addToPlanes(const size_t begin,
+                                                const size_t end)
+{
+  // A carry-save adder: h and l get the high and low bits of a + b + c.
+  auto csa = [](uint64_t& h, uint64_t& l, const uint64_t a, const uint64_t b,
+      const uint64_t c)
   {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0 || bits[10][i] != 0 || bits[11][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], bits[10][i], bits[11][i], (uint64_t) 0,
-            (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 13)
+    const uint64_t u = a ^ b;
+    h = (a & b) | (u & c);
+    l = u ^ c;
+  };
+
+  for (size_t i = begin; i < end; ++i)
   {
-    for (size_t i = 0; i < 262144; ++i)
+    uint64_t any = 0;
+    for (size_t d = 0; d < batchDepth; ++d)
+      any |= bits[d * bitsetLen + i];
+    if (any == 0)
+      continue;
+
+    // Take the bitsets 8 at a time (the last group padded with zeros).
+    for (size_t g = 0; g < batchDepth; g += 8)
     {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0 || bits[10][i] != 0 || bits[11][i] != 0 ||
-          bits[12][i] != 0)
+      uint64_t w[8];
+      for (size_t k = 0; k < 8; ++k)
+        w[k] = (g + k < batchDepth) ? bits[(g + k) * bitsetLen + i] : 0;
+
+      // Sum the eight words into ones, twos, fours and eights.
+      uint64_t ones, twos, fours, eights, twosA, twosB, twosC, twosD, foursA,
+          foursB;
+      csa(twosA, ones, w[0], w[1], w[2]);
+      csa(twosB, ones, ones, w[3], w[4]);
+      csa(twosC, ones, ones, w[5], w[6]);
+      twosD = (ones & w[7]);
+      ones ^= w[7];
+      csa(foursA, twos, twosA, twosB, twosC);
+      foursB = (twos & twosD);
+      twos ^= twosD;
+      eights = (foursA & foursB);
+      fours = (foursA ^ foursB);
+
+      // Then add the sums to the counters, stopping when nothing is carried.
+      const uint64_t sums[4] = { ones, twos, fours, eights };
+      uint64_t carry = 0;
+      for (size_t p = 0; p < planes; ++p)
       {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], bits[10][i], bits[11][i], bits[12][i],
-            (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+        uint64_t& plane = planeBits[p * bitsetLen + i];
+        const uint64_t s = (p < 4) ? sums[p] : 0;
+        const uint64_t t = (plane ^ s);
+        const uint64_t nextCarry = (plane & s) | (t & carry);
+        plane = (t ^ carry);
+        carry = nextCarry;
+        if (p >= 3 && carry == 0)
+          break;
       }
     }
+
+    for (size_t d = 0; d < batchDepth; ++d)
+      bits[d * bitsetLen + i] = 0;
   }
-  else if (bitsIndex == 14)
+}
+
+inline void MultiThreadHashCounter::expandPlanes(CountsArray<>& countsArray)
+{
+  RunKernel([&]()
   {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0 || bits[10][i] != 0 || bits[11][i] != 0 ||
-          bits[12][i] != 0 || bits[13][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], bits[10][i], bits[11][i], bits[12][i],
-            bits[13][i], (uint64_t) 0, (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 15)
+    flushRanges(countsArray, planeDirtyBlocks,
+        [&]<bool Locked>(const size_t begin, const size_t end)
+        { flushPlanes<Locked>(countsArray, begin, end); });
+  });
+  slicedFiles = 0;
+}
+
+template<bool Locked>
+inline void MultiThreadHashCounter::flushPlanes(CountsArray<>& countsArray,
+                                                const size_t begin,
+                                                const size_t end)
+{
+  for (size_t i = begin; i < end; ++i)
   {
-    for (size_t i = 0; i < 262144; ++i)
-    {
-      if (bits[0][i] != 0 || bits[1][i] != 0 || bits[2][i] != 0 ||
-          bits[3][i] != 0 || bits[4][i] != 0 || bits[5][i] != 0 ||
-          bits[6][i] != 0 || bits[7][i] != 0 || bits[8][i] != 0 ||
-          bits[9][i] != 0 || bits[10][i] != 0 || bits[11][i] != 0 ||
-          bits[12][i] != 0 || bits[13][i] != 0 || bits[14][i] != 0)
-      {
-        countsArray.Increment(i, bits[0][i], bits[1][i], bits[2][i],
-            bits[3][i], bits[4][i], bits[5][i], bits[6][i], bits[7][i],
-            bits[8][i], bits[9][i], bits[10][i], bits[11][i], bits[12][i],
-            bits[13][i], bits[14][i], (uint64_t) 0);
-      }
-    }
+    uint64_t any = 0;
+    for (size_t p = 0; p < planes; ++p)
+      any |= planeBits[p * bitsetLen + i];
+    if (any == 0)
+      continue;
+
+    countsArray.IncrementSliced<Locked>(i, planeBits + i, bitsetLen, planes);
+    for (size_t p = 0; p < planes; ++p)
+      planeBits[p * bitsetLen + i] = 0;
   }
 }
 
@@ -0,0 +1,101 @@
+// numa_util.hpp: find the NUMA nodes of the machine and their CPUs, and bind
+// memory to a node.  This reads sysfs and calls mbind() directly, so there is
+// no need to link against libnuma; on other systems (or without sysfs), there
+// is one node and binding does nothing.
+#ifndef PNGRAM_NUMA_UTIL_HPP
+#define PNGRAM_NUMA_UTIL_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#ifdef __linux__
+  #include <unistd.h>
+  #include <sys/syscall.h>
+  #include <linux/mempolicy.h>
+#endif
+
+// Parse a sysfs list like "0-3,8,10-11".
+inline std::vector<size_t> ParseSysfsList(const std::string& list)
+{
+  std::vector<size_t> result;
+  std::istringstream iss(list);
+  std::string range;
+  while (std::getline(iss, range, ','))
+  {
+    if (range.empty() || range[0] < '0' || range[0] > '9')
+      continue;
+
+    const size_t dash = range.find('-');
+    const size_t first = strtoull(range.c_str(), NULL, 10);
+    const size_t last = (dash == std::string::npos) ? first :
+        strtoull(range.c_str() + dash + 1, NULL, 10);
+    for (size_t i = first; i <= last; ++i)
+      result.push_back(i);
+  }
+
+  return result;
+}
+
+// The CPUs of NUMA node `node` (empty if it has none, or we can't tell).
+inline std::vector<size_t> NumaNodeCpus(const size_t node)
+{
+  std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) +
+      "/cpulist");
+  std::string list;
+  if (!f || !std::getline(f, list))
+    return std::vector<size_t>();
+
+  return ParseSysfsList(list);
+}
+
+// The online NUMA nodes that have CPUs.  If we can't tell, this is just node 0.
+inline std::vector<size_t> NumaNodes()
+{
+  std::vector<size_t> nodes;
+  std::ifstream f("/sys/devices/system/node/online");
+  std::string list;
+  if (f && std::getline(f, list))
+  {
+    for (const size_t node : ParseSysfsList(list))
+    {
+      // Memory-only nodes don't run any of our threads.
+      if (!NumaNodeCpus(node).empty())
+        nodes.push_back(node);
+    }
+  }
+
+  if (nodes.empty())
+    nodes.push_back(0);
+  return nodes;
+}
+
+// Ask for the pages of [ptr, ptr + bytes) to come from NUMA node `node`.  This
+// has to happen before the memory is first touched.  It is only a preference:
+// if the node runs out of memory, pages come from elsewhere instead of failing.
+// Returns false if the kernel refused (e.g. there is no NUMA support).
+inline bool BindToNumaNode(void* ptr, const size_t bytes, const size_t node)
+{
+#ifdef __linux__
+  if (bytes == 0 || node >= 64)
+    return false;
+
+  // mbind() wants whole pages.
+  const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = uintptr_t(ptr) & ~(pageSize - 1);
+  const uintptr_t end = uintptr_t(ptr) + bytes;
+  const unsigned long mask = (1UL << node);
+  // (Like libnuma, pass one more than the bits in the mask.)
+  return (syscall(SYS_mbind, (void*) begin, end - begin, MPOL_PREFERRED,
+      &mask, 8 * sizeof(mask) + 1, 0) == 0);
+#else
+  (void) ptr;
+  (void) bytes;
+  (void) node;
+  return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,108 @@
+// pack_corpus.cpp: pack every file under a directory into a few large corpus
+// packs (see corpus_pack.hpp), so that compute_ngrams_full --reader=pack can
+// read the corpus with large sequential reads instead of opening every file.
+#include "file_catalog.hpp"
+#include "corpus_pack.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <thread>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || argc > 5)
+  {
+    std::cerr << "Usage: " << argv[0] << " <directory> <output_prefix> "
+        << "[pack_size_mb] [labels_file]" << std::endl;
+    std::cerr << " - packs are written to <output_prefix>.0.pack, "
+        << "<output_prefix>.1.pack, etc." << std::endl;
+    std::cerr << " - each pack is closed once it holds at least pack_size_mb "
+        << "(default 1024) MB of samples" << std::endl;
+    std::cerr << " - labels_file has lines of the form 'path,label', where "
+        << "label is an unsigned integer" << std::endl;
+    exit(1);
+  }
+
+  const std::string directory(argv[1]);
+  const std::string outputPrefix(argv[2]);
+  const size_t packSize = ((argc > 3) ? strtoull(argv[3], NULL, 10) : 1024) *
+      1024 * 1024;
+
+  std::unordered_map<std::string, uint32_t> labels;
+  if (argc > 4)
+  {
+    std::ifstream lf(argv[4]);
+    if (!lf)
+    {
+      std::cerr << "Could not open labels file " << argv[4] << "." << std::endl;
+      exit(1);
+    }
+
+    std::string line;
+    while (std::getline(lf, line))
+    {
+      const size_t comma = line.rfind(',');
+      if (comma == std::string::npos)
+        continue;
+      labels[line.substr(0, comma)] = strtoul(line.c_str() + comma + 1, NULL, 10);
+    }
+  }
+
+  // The catalog gives every file a stable ID, which is the ID the counting
+  // threads will see.
+  FileCatalog catalog;
+  catalog.Build({ directory }, std::max(1u, std::thread::hardware_concurrency()));
+  std::cout << "Packing " << catalog.Size() << " files." << std::endl;
+
+  std::vector<char> buffer(1 << 20);
+  PackWriter writer;
+  size_t packId = 0;
+  for (size_t id = 0; id < catalog.Size(); ++id)
+  {
+    const int fd = open(catalog.Path(id), O_RDONLY);
+    if (fd == -1)
+    {
+      // check errno, something went wrong
+      std::cout << "open failed! errno " << errno << "\n";
+      continue;
+    }
+
+    if (!writer.IsOpen())
+    {
+      std::ostringstream oss;
+      oss << outputPrefix << "." << packId << ".pack";
+      writer.Open(oss.str());
+    }
+
+    std::unordered_map<std::string, uint32_t>::const_iterator it =
+        labels.find(catalog.Path(id));
+    writer.BeginSample(id, (it == labels.end()) ? 0 : it->second);
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer.data(), buffer.size())) > 0)
+      writer.Write(buffer.data(), bytesRead);
+    if (bytesRead == -1)
+      std::cout << "read failed! errno " << errno << "\n";
+    writer.EndSample();
+    close(fd);
+
+    if (writer.DataBytes() >= packSize)
+    {
+      std::cout << "Wrote " << writer.Samples() << " samples to "
+          << outputPrefix << "." << packId << ".pack." << std::endl;
+      writer.Close();
+      ++packId;
+    }
+  }
+
+  if (writer.IsOpen())
+  {
+    std::cout << "Wrote " << writer.Samples() << " samples to "
+        << outputPrefix << "." << packId << ".pack." << std::endl;
+    writer.Close();
+  }
+}
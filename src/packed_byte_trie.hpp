@@ -26,8 +26,24 @@ class PackedByteTrie
 
   size_t Search(const uint8_t* prefixes) const;
 
+  // Search for the G prefixes that start at searchBytes[0], ...,
+  // searchBytes[G - 1], and store what Search() would return for each in
+  // results[0], ..., results[G - 1].  The G searches go down the trie together,
+  // one level at a time, and every step prefetches what the next step of each
+  // search needs, so their cache misses overlap instead of each search waiting
+  // for one miss per level in turn.
+  template<size_t G>
+  inline void SearchGroup(const uint8_t* searchBytes, size_t* results) const;
+
   size_t PrefixLen() const { return prefixLen; }
 
+  // The memory used by the trie's arrays.
+  size_t Bytes() const
+  {
+    return (2 + sizeof(IndexType)) * numTotalNodes +
+        sizeof(IndexType) * childrenVectorLen;
+  }
+
   //
   // Total trie size:
   //    N nodes,
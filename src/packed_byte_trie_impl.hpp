@@ -4,6 +4,7 @@
 
 #include <cstring>
 #include <algorithm>
+#include <bitset>
 
 template<typename IndexType>
 PackedByteTrie<IndexType>::PackedByteTrie(uint8_t* prefixes,
@@ -273,6 +274,113 @@ size_t PackedByteTrie<IndexType>::Search(const uint8_t* searchBytes) const
   return children[currentIndex];
 }
 
+template<typename IndexType>
+template<size_t G>
+inline void PackedByteTrie<IndexType>::SearchGroup(const uint8_t* searchBytes,
+                                                   size_t* results) const
+{
+  // The searches that can still match (active[0], ..., active[numActive - 1])
+  // and the node each is at.  Most searches fail in the first levels, so the
+  // list is compacted as they do, and we stop once it is empty.  A node that
+  // is the only child of its parent still has to have the right byte, which
+  // is only checked at the next level (once bytes[node] has been prefetched);
+  // check[g] holds that byte, or -1.
+  size_t active[G];
+  size_t numActive = 0;
+  IndexType nodes[G];
+  int check[G];
+  const IndexType* slots[G];
+  size_t b = 0;
+  if (numChildren[0] >= minChildrenForChildMap)
+  {
+    // The root's child map is used by every search and stays cached, so the
+    // first level needs no prefetching.
+    const IndexType* rootChildren = childrenVector + children[0];
+    for (size_t g = 0; g < G; ++g)
+    {
+      results[g] = size_t(-1);
+      nodes[g] = rootChildren[searchBytes[g]];
+      check[g] = -1;
+      if (nodes[g] == 0)
+        continue;
+
+      __builtin_prefetch(numChildren + nodes[g]);
+      __builtin_prefetch(children + nodes[g]);
+      active[numActive++] = g;
+    }
+    b = 1;
+  }
+  else
+  {
+    for (size_t g = 0; g < G; ++g)
+    {
+      results[g] = size_t(-1);
+      nodes[g] = 0;
+      check[g] = -1;
+      active[numActive++] = g;
+    }
+  }
+
+  for (; b < prefixLen && numActive > 0; ++b)
+  {
+    // Find where in childrenVector the next node of each search is, and
+    // prefetch it.
+    size_t kept = 0;
+    for (size_t a = 0; a < numActive; ++a)
+    {
+      const size_t g = active[a];
+      const IndexType node = nodes[g];
+      if (check[g] >= 0 && bytes[node] != check[g])
+        continue;
+
+      const size_t childCount = numChildren[node];
+      const IndexType* currentChildren = childrenVector + children[node];
+      if (childCount == 1)
+      {
+        slots[g] = currentChildren;
+        check[g] = searchBytes[g + b];
+      }
+      else if (childCount >= minChildrenForChildMap)
+      {
+        slots[g] = currentChildren + searchBytes[g + b];
+        check[g] = -1;
+      }
+      else
+      {
+        continue;
+      }
+
+      __builtin_prefetch(slots[g]);
+      active[kept++] = g;
+    }
+    numActive = kept;
+
+    // Move to those nodes, and prefetch what the loop above needs for them.
+    // (The root is nobody's child, so a child of 0 means there is none.)
+    kept = 0;
+    for (size_t a = 0; a < numActive; ++a)
+    {
+      const size_t g = active[a];
+      nodes[g] = *slots[g];
+      if (nodes[g] == 0)
+        continue;
+
+      __builtin_prefetch(numChildren + nodes[g]);
+      __builtin_prefetch(bytes + nodes[g]);
+      __builtin_prefetch(children + nodes[g]);
+      active[kept++] = g;
+    }
+    numActive = kept;
+  }
+
+  for (size_t a = 0; a < numActive; ++a)
+  {
+    const size_t g = active[a];
+    if (check[g] < 0 || bytes[nodes[g]] == check[g])
+      results[g] = children[nodes[g]];
+  }
+}
+
 template<typename IndexType>
 std::tuple<size_t, size_t> PackedByteTrie<IndexType>::ReorderPrefixes(
     uint8_t* prefixes,
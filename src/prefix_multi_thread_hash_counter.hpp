@@ -5,17 +5,52 @@
 #include <atomic>
 #include "counts_array.hpp"
 #include "alloc.hpp"
+#include "cpu_dispatch.hpp"
+#include "dirty_blocks.hpp"
+#include "numa_util.hpp"
 
 class PrefixMultiThreadHashCounter
 {
  public:
+  // Each batch of `batchDepth` files (1 to maxBatchDepth) is collected in as
+  // many bitsets, and flushed at once.  If `numaNode` is not -1, the bitsets
+  // are placed on that NUMA node.  setAll() looks up `trieGroup` (1, 4, 8, 16
+  // or 32) prefixes in the trie at once (see PackedByteTrie::SearchGroup());
+  // 0 picks that from the size of the trie (see TrieGroup()).
   PrefixMultiThreadHashCounter(const size_t elem, // number of elements we are counting
                                const PackedByteTrie<uint32_t>* prefixTrie,
-                               const size_t prefixLen);
+                               const size_t prefixLen,
+                               const size_t batchDepth = 8,
+                               const int numaNode = -1,
+                               const size_t trieGroup = 0);
   ~PrefixMultiThreadHashCounter();
 
   inline void set(const unsigned char* bytes);
-  inline void clear();
+  // Set the bit for the n-gram in `bitset` (of bitsetLen elements) instead of
+  // in the current one.
+  inline void set(const unsigned char* bytes, uint64_t* bitset);
+  // Set the bits for the `count` n-grams that start at bytes[0], ...,
+  // bytes[count - 1] (in `bitset`, if given).  These use the best instruction
+  // set for the CPU (see cpu_dispatch.hpp), as do the flushes.
+  inline void setAll(const unsigned char* bytes, const size_t count);
+  inline void setAll(const unsigned char* bytes,
+                     const size_t count,
+                     uint64_t* bitset);
+
+  // The number of lookups to interleave for `trie`, if `requested` is 0.
+  // Interleaving only pays off once the trie is too big to stay cached: for
+  // smaller tries, the out-of-order core already overlaps consecutive lookups,
+  // and a plain loop over them is faster than managing a group.
+  static size_t TrieGroup(const PackedByteTrie<uint32_t>& trie,
+                          const size_t requested = 0)
+  {
+    if (requested != 0)
+      return requested;
+    return (trie.Bytes() > autoTrieGroupBytes) ? 32 : 1;
+  }
+  // Tries bigger than this get TrieGroup() 32 (about where that got faster
+  // than single lookups in our measurements).
+  static constexpr size_t autoTrieGroupBytes = 16 * 1024 * 1024;
 
   template<bool FixedSize>
   inline void flush(CountsArray<FixedSize>& countsArray);
@@ -24,12 +59,58 @@ class PrefixMultiThreadHashCounter
   inline void forceFlush(CountsArray<FixedSize>& countsArray);
 
   // 2MB
+  // Bitset d of the batch is bits[d * bitsetLen] to
+  // bits[(d + 1) * bitsetLen - 1].
   alignas(64) uint64_t* bits;
   alloc_mem_state bitsMemState;
+  const size_t batchDepth;
   size_t bitsIndex;
   const PackedByteTrie<uint32_t>* prefixTrie;
   const size_t prefixLen;
   const size_t bitsetLen;
+  const size_t trieGroup;
+  // The blocks of the bitsets that have anything set; flushes only visit
+  // those.
+  DirtyBlocks dirtyBlocks;
+
+  // Set the bit for the n-gram, and if Mark is true, mark its block dirty
+  // (that is only for our own bitsets).
+  template<bool Mark>
+  inline void setBit(const unsigned char* bytes, uint64_t* bitset);
+  // Set the bit for the n-gram that is prefix `prefixId` followed by `last`.
+  template<bool Mark>
+  inline void setPrefixBit(const size_t prefixId,
+                           const unsigned char last,
+                           uint64_t* bitset);
+  // The loop of setAll(), with G lookups at a time (the last count % G
+  // n-grams are looked up one by one).
+  template<size_t G, bool Mark>
+  inline void setGroups(const unsigned char* bytes,
+                        const size_t count,
+                        uint64_t* bitset);
+  // Run setGroups() for trieGroup.
+  template<bool Mark>
+  inline void setAllGroups(const unsigned char* bytes,
+                           const size_t count,
+                           uint64_t* bitset);
+
+  // Call flushRange.operator()<Locked>(begin, end) on each range of dirty
+  // bitset indices; if the array is partitioned, these are split into ranges
+  // of the array that this thread owns, and Locked is false.
+  template<bool FixedSize, typename F>
+  inline void flushRanges(CountsArray<FixedSize>& countsArray, F&& flushRange);
+
+  // Flush all bitsets of the batch into the array (and clear them), with the
+  // kernel for batchDepth.
+  template<bool FixedSize>
+  inline void flushBatch(CountsArray<FixedSize>& countsArray);
+  // The flush loop over bitset indices [begin, end) of the first Depth
+  // bitsets, run by flushBatch() through RunKernel().  Unless Locked is true,
+  // the caller must own that range of the array.
+  template<size_t Depth, bool FixedSize, bool Locked>
+  inline void flushBitsets(CountsArray<FixedSize>& countsArray,
+                           const size_t begin,
+                           const size_t end);
 
   // Notes on things that do NOT help:
   //
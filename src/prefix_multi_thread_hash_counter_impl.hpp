@@ -4,28 +4,50 @@
 #include "prefix_multi_thread_hash_counter.hpp"
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 inline PrefixMultiThreadHashCounter::PrefixMultiThreadHashCounter(
     const size_t elem,
     const PackedByteTrie<uint32_t>* prefixTrieIn,
-    const size_t prefixLenIn) :
+    const size_t prefixLenIn,
+    const size_t batchDepthIn,
+    const int numaNode,
+    const size_t trieGroupIn) :
+    batchDepth(std::clamp(batchDepthIn, (size_t) 1, maxBatchDepth)),
     bitsIndex(0),
     prefixTrie(prefixTrieIn),
     prefixLen(prefixLenIn),
-    bitsetLen((elem + 63) / 64)
+    bitsetLen((elem + 63) / 64),
+    trieGroup(TrieGroup(*prefixTrieIn, trieGroupIn)),
+    dirtyBlocks(bitsetLen)
 {
-  // Allocate bitsets.  8 bitsets, one bit per element.
-  alloc_hugepage<uint64_t>(bits, bitsMemState, 8 * bitsetLen, "n-gramming");
-
-  clear();
+  // Allocate bitsets.  One per file of a batch, one bit per element.  They
+  // start out zeroed, but untouched, so that the counting thread zeroes them.
+  alloc_zeroed_hugepage<uint64_t>(bits, bitsMemState, batchDepth * bitsetLen,
+      "n-gramming");
+  if (numaNode >= 0)
+    BindToNumaNode(bits, sizeof(uint64_t) * batchDepth * bitsetLen, numaNode);
 }
 
 inline PrefixMultiThreadHashCounter::~PrefixMultiThreadHashCounter()
 {
-  free_hugepage<uint64_t>(bits, bitsMemState, 8 * bitsetLen);
+  free_hugepage<uint64_t>(bits, bitsMemState, batchDepth * bitsetLen);
 }
 
 inline void PrefixMultiThreadHashCounter::set(const unsigned char* b)
+{
+  setBit<true>(b, bits + bitsIndex * bitsetLen);
+}
+
+inline void PrefixMultiThreadHashCounter::set(const unsigned char* b,
+                                              uint64_t* bitset)
+{
+  setBit<false>(b, bitset);
+}
+
+template<bool Mark>
+inline void PrefixMultiThreadHashCounter::setBit(const unsigned char* b,
+                                                 uint64_t* bitset)
 {
   const size_t prefixId = prefixTrie->Search(b);
   if (prefixId == size_t(-1))
@@ -35,147 +57,175 @@ inline void PrefixMultiThreadHashCounter::set(const unsigned char* b)
   //  std::cout << std::hex << std::setw(2) << std::setfill('0') << (size_t) b[i];
   //std::cout << std::dec << " has prefix ID " << prefixId << "\n";
 
+  setPrefixBit<Mark>(prefixId, b[prefixLen], bitset);
+}
+
+template<bool Mark>
+inline void PrefixMultiThreadHashCounter::setPrefixBit(const size_t prefixId,
+                                                       const unsigned char last,
+                                                       uint64_t* bitset)
+{
   // Get the index of the n-gram.  Each prefix is associated with 256 possible
   // n-grams, so use the index stored in the prefix plus the last byte to get
   // the actual index in `bits`.
-  const size_t index = 256 * prefixId + b[prefixLen];
+  const size_t index = 256 * prefixId + last;
 
   const size_t bitLoc = index / 64;
   const size_t bit = index & 0x3F;
-  bits[bitsIndex * bitsetLen + bitLoc] |= (uint64_t(1) << bit);
+  bitset[bitLoc] |= (uint64_t(1) << bit);
+  if constexpr (Mark)
+    dirtyBlocks.Mark(bitLoc);
+}
+
+template<size_t G, bool Mark>
+inline void PrefixMultiThreadHashCounter::setGroups(const unsigned char* b,
+                                                    const size_t count,
+                                                    uint64_t* bitset)
+{
+  size_t i = 0;
+  if constexpr (G > 1)
+  {
+    size_t prefixIds[G];
+    for (; i + G <= count; i += G)
+    {
+      prefixTrie->template SearchGroup<G>(b + i, prefixIds);
+      for (size_t g = 0; g < G; ++g)
+      {
+        if (prefixIds[g] != size_t(-1))
+          setPrefixBit<Mark>(prefixIds[g], b[i + g + prefixLen], bitset);
+      }
+    }
+  }
+
+  for (; i < count; ++i)
+    setBit<Mark>(b + i, bitset);
+}
+
+template<bool Mark>
+inline void PrefixMultiThreadHashCounter::setAllGroups(const unsigned char* b,
+                                                       const size_t count,
+                                                       uint64_t* bitset)
+{
+  switch (trieGroup)
+  {
+    case 4:
+      setGroups<4, Mark>(b, count, bitset);
+      break;
+    case 8:
+      setGroups<8, Mark>(b, count, bitset);
+      break;
+    case 16:
+      setGroups<16, Mark>(b, count, bitset);
+      break;
+    case 32:
+      setGroups<32, Mark>(b, count, bitset);
+      break;
+    default:
+      setGroups<1, Mark>(b, count, bitset);
+      break;
+  }
 }
 
-inline void PrefixMultiThreadHashCounter::clear()
+inline void PrefixMultiThreadHashCounter::setAll(const unsigned char* b,
+                                                 const size_t count)
 {
-  memset(bits, 0, sizeof(uint64_t) * 8 * bitsetLen);
+  RunKernel([&]()
+  {
+    setAllGroups<true>(b, count, bits + bitsIndex * bitsetLen);
+  });
+}
+
+inline void PrefixMultiThreadHashCounter::setAll(const unsigned char* b,
+                                                 const size_t count,
+                                                 uint64_t* bitset)
+{
+  RunKernel([&]()
+  {
+    setAllGroups<false>(b, count, bitset);
+  });
 }
 
 template<bool FixedSize>
 inline void PrefixMultiThreadHashCounter::flush(CountsArray<FixedSize>& countsArray)
 {
   ++bitsIndex;
-  if (bitsIndex == 8)
+  if (bitsIndex == batchDepth)
     bitsIndex = 0;
 
   if (bitsIndex != 0)
     return;
 
-  for (size_t i = 0; i < bitsetLen; ++i)
-  {
-    if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-        bits[3 * bitsetLen + i] != 0 || bits[4 * bitsetLen + i] != 0 || bits[5 * bitsetLen + i] != 0 ||
-        bits[6 * bitsetLen + i] != 0 || bits[7 * bitsetLen + i] != 0)
-    {
-      countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i],
-          bits[2 * bitsetLen + i], bits[3 * bitsetLen + i], bits[4 * bitsetLen + i],
-          bits[5 * bitsetLen + i], bits[6 * bitsetLen + i], bits[7 * bitsetLen + i]);
-
-      bits[0 * bitsetLen + i] = 0;
-      bits[1 * bitsetLen + i] = 0;
-      bits[2 * bitsetLen + i] = 0;
-      bits[3 * bitsetLen + i] = 0;
-      bits[4 * bitsetLen + i] = 0;
-      bits[5 * bitsetLen + i] = 0;
-      bits[6 * bitsetLen + i] = 0;
-      bits[7 * bitsetLen + i] = 0;
-    }
-  }
+  flushBatch(countsArray);
 }
 
 template<bool FixedSize>
-inline void PrefixMultiThreadHashCounter::forceFlush(CountsArray<FixedSize>& countsArray)
+inline void PrefixMultiThreadHashCounter::flushBatch(
+    CountsArray<FixedSize>& countsArray)
 {
-  if (bitsIndex == 1)
-  {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[i] != 0)
-        countsArray.Increment(i, bits[i]);
-    }
-  }
-  else if (bitsIndex == 2)
+  WithBatchDepth(batchDepth, [&]<size_t Depth>()
   {
-    for (size_t i = 0; i < bitsetLen; ++i)
+    RunKernel([&]()
     {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0)
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i]);
-    }
-  }
-  else if (bitsIndex == 3)
-  {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i], bits[2 * bitsetLen + i],
-            (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 4)
-  {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-          bits[3 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i],
-            bits[2 * bitsetLen + i], bits[3 * bitsetLen + i]);
-      }
-    }
-  }
-  else if (bitsIndex == 5)
+      flushRanges(countsArray,
+          [&]<bool Locked>(const size_t begin, const size_t end)
+          { flushBitsets<Depth, FixedSize, Locked>(countsArray, begin, end); });
+    });
+  });
+}
+
+template<bool FixedSize, typename F>
+inline void PrefixMultiThreadHashCounter::flushRanges(
+    CountsArray<FixedSize>& countsArray,
+    F&& flushRange)
+{
+  if (countsArray.Partitioned())
   {
-    for (size_t i = 0; i < bitsetLen; ++i)
+    countsArray.ForEachOwnedRange(bitsetLen,
+        [&](const size_t begin, const size_t end)
     {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-          bits[3 * bitsetLen + i] != 0 || bits[4 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i], bits[2 * bitsetLen + i],
-            bits[3 * bitsetLen + i], bits[4 * bitsetLen + i], (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
-      }
-    }
+      dirtyBlocks.ForEachDirtyRange(begin, end,
+          [&](const size_t runBegin, const size_t runEnd)
+          { flushRange.template operator()<false>(runBegin, runEnd); });
+    });
   }
-  else if (bitsIndex == 6)
+  else
   {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-          bits[3 * bitsetLen + i] != 0 || bits[4 * bitsetLen + i] != 0 || bits[5 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i], bits[2 * bitsetLen + i],
-            bits[3 * bitsetLen + i], bits[4 * bitsetLen + i],
-            bits[5 * bitsetLen + i], (uint64_t) 0, (uint64_t) 0);
-      }
-    }
+    dirtyBlocks.ForEachDirtyRange(0, bitsetLen,
+        [&](const size_t runBegin, const size_t runEnd)
+        { flushRange.template operator()<true>(runBegin, runEnd); });
   }
-  else if (bitsIndex == 7)
-  {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-          bits[3 * bitsetLen + i] != 0 || bits[4 * bitsetLen + i] != 0 || bits[5 * bitsetLen + i] != 0 ||
-          bits[6 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i], bits[2 * bitsetLen + i],
-            bits[3 * bitsetLen + i], bits[4 * bitsetLen + i], bits[5 * bitsetLen + i], bits[6 * bitsetLen + i], (uint64_t) 0);
-      }
-    }
-  }
-  else if (bitsIndex == 8)
+}
+
+template<size_t Depth, bool FixedSize, bool Locked>
+inline void PrefixMultiThreadHashCounter::flushBitsets(
+    CountsArray<FixedSize>& countsArray,
+    const size_t begin,
+    const size_t end)
+{
+  for (size_t i = begin; i < end; ++i)
   {
-    for (size_t i = 0; i < bitsetLen; ++i)
-    {
-      if (bits[0 * bitsetLen + i] != 0 || bits[1 * bitsetLen + i] != 0 || bits[2 * bitsetLen + i] != 0 ||
-          bits[3 * bitsetLen + i] != 0 || bits[4 * bitsetLen + i] != 0 || bits[5 * bitsetLen + i] != 0 ||
-          bits[6 * bitsetLen + i] != 0 || bits[7 * bitsetLen + i] != 0)
-      {
-        countsArray.Increment(i, bits[0 * bitsetLen + i], bits[1 * bitsetLen + i], bits[2 * bitsetLen + i],
-            bits[3 * bitsetLen + i], bits[4 * bitsetLen + i], bits[5 * bitsetLen + i], bits[6 * bitsetLen + i], bits[7 * bitsetLen + i]);
-      }
-    }
+    uint64_t any = 0;
+    for (size_t d = 0; d < Depth; ++d)
+      any |= bits[d * bitsetLen + i];
+    if (any == 0)
+      continue;
+
+    countsArray.template IncrementBatch<Depth, Locked>(i, bits + i, bitsetLen);
+    for (size_t d = 0; d < Depth; ++d)
+      bits[d * bitsetLen + i] = 0;
   }
-  // not implemented for greater than 8...
+}
+
+template<bool FixedSize>
+inline void PrefixMultiThreadHashCounter::forceFlush(CountsArray<FixedSize>& countsArray)
+{
+  if (bitsIndex == 0)
+    return; // already flushed
+
+  // The bitsets past bitsIndex are empty, so the whole batch can be flushed
+  // with the same kernel as usual.
+  flushBatch(countsArray);
+  bitsIndex = 0;
 }
 
 #endif
@@ -9,22 +9,29 @@
 #include "packed_byte_trie.hpp"
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <armadillo>
 
 class PrefixSingleNgramThread
 {
  public:
+  // If `numaNode` is not -1, the thread runs on the CPUs of that NUMA node,
+  // and its counter is placed there (so `globalCounts` should be too).
   PrefixSingleNgramThread(SingleReaderThread& reader,
                           CountsArray<false>& globalCounts,
                           const size_t numPrefixes,
                           const PackedByteTrie<uint32_t>* prefixTrie,
                           const size_t n,
                           const size_t t,
-                          const size_t verbosity = 1);
+                          const size_t verbosity = 1,
+                          const int numaNode = -1);
 
   inline void RunThread();
   inline void Finish();
 
+  // When the thread finished its last flush (valid after Finish()).
+  std::chrono::steady_clock::time_point FinishTime() const { return finishTime; }
+
  private:
   SingleReaderThread& reader;
   PrefixMultiThreadHashCounter threadCounter;
@@ -37,6 +44,17 @@ class PrefixSingleNgramThread
   size_t flushCount;
   size_t t;
   size_t verbosity;
+  std::chrono::steady_clock::time_point finishTime;
+
+  // Bits for the segment of a split file we are working on (allocated when we
+  // get the first one), and how many segments we have finished.
+  uint64_t* segmentBits;
+  alloc_mem_state segmentBitsMemState;
+  size_t segmentCount;
+
+  // Merge segmentBits into the file the segment is from, and flush the file if
+  // this was the last segment of it.
+  inline void FinishSegment(FileSegment* segment);
 
   std::thread thread;
 };
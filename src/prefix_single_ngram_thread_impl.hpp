@@ -6,6 +6,7 @@
 
 #include <unistd.h>
 #include <iostream>
+#include <cstring>
 #include <sys/sysinfo.h>
 #include <sched.h>
 #include <pthread.h>
@@ -17,9 +18,11 @@ inline PrefixSingleNgramThread::PrefixSingleNgramThread(
     const PackedByteTrie<uint32_t>* prefixTrie,
     const size_t n,
     const size_t t,
-    const size_t verbosity) :
+    const size_t verbosity,
+    const int numaNode) :
   reader(reader),
-  threadCounter(numPrefixes * 256, prefixTrie, n - 1),
+  threadCounter(numPrefixes * 256, prefixTrie, n - 1,
+      reader.Options().batchDepth, numaNode, reader.Options().trieGroup),
   globalCounts(globalCounts),
   n(n),
   waitingForData(0),
@@ -28,12 +31,24 @@ inline PrefixSingleNgramThread::PrefixSingleNgramThread(
   flushCount(0),
   t(t),
   verbosity(verbosity),
+  segmentBits(NULL),
+  segmentCount(0),
   thread(&PrefixSingleNgramThread::RunThread, this)
 {
-  // The thread has now started.  Set its affinity to a physical CPU (this is
-  // specific to the uberservers which have 128 processors...).
+  // The thread has now started.  If it belongs to a NUMA node, keep it on the
+  // CPUs of that node (its counter and counts replica are there).
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
+  if (numaNode >= 0)
+  {
+    for (const size_t cpu : NumaNodeCpus(numaNode))
+      CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+    return;
+  }
+
+  // Otherwise, set its affinity to a physical CPU (this is specific to the
+  // uberservers which have 128 processors...).
   const size_t numCores = get_nprocs();
   const size_t start1 = (t % 4) * 16;
   const size_t end1 = ((t % 4) + 1) * 16 - 1;
@@ -54,6 +69,7 @@ inline void PrefixSingleNgramThread::RunThread()
   size_t fileId = (size_t(-1));
   size_t bytes;
   unsigned char* ptr = NULL;
+  FileSegment* lastSegment = NULL;
   do
   {
     // Get the next chunk and the file it corresponds to.
@@ -75,30 +91,94 @@ inline void PrefixSingleNgramThread::RunThread()
       }
     }
 
-    // Do we have to flush the file?
-    if (mustFlush)
+    // A segment of a split file is done once we see a chunk that is not part
+    // of it.
+    FileSegment* segment = done ? NULL : reader.GetChunkFileSegment();
+    if (lastSegment != NULL && segment != lastSegment)
+      FinishSegment(lastSegment);
+
+    // Do we have to flush the file?  (Segments of split files never went into
+    // threadCounter, so there is nothing to flush for them.)
+    if (mustFlush && lastSegment == NULL)
     {
       c.tic();
       threadCounter.flush(globalCounts);
       ++flushCount;
       flushTime += c.toc();
     }
+    lastSegment = segment;
 
     if (done)
       break;
 
-    // Process the chunk.
-    if (bytes >= n)
+    if (segment != NULL)
     {
-      c.tic();
-      for (size_t i = 0; i < (bytes - (n - 1)); ++i)
-        threadCounter.set(ptr + i);
-      processTime += c.toc();
+      if (segmentBits == NULL)
+      {
+        alloc_zeroed_hugepage<uint64_t>(segmentBits, segmentBitsMemState,
+            threadCounter.bitsetLen, "split file segment");
+      }
+
+      if (bytes >= n)
+      {
+        c.tic();
+        threadCounter.setAll(ptr, bytes - (n - 1), segmentBits);
+        processTime += c.toc();
+      }
+      continue;
+    }
+
+    // Process the chunk.  If small files were batched into it, each file has
+    // to be flushed before the next one starts.
+    const ChunkSegment* segments;
+    const size_t segmentCount = reader.GetChunkSegments(segments);
+    for (size_t s = 0; s < std::max(segmentCount, (size_t) 1); ++s)
+    {
+      unsigned char* segPtr = ptr;
+      size_t segBytes = bytes;
+      if (segmentCount > 0)
+      {
+        if (s > 0)
+        {
+          c.tic();
+          threadCounter.flush(globalCounts);
+          ++flushCount;
+          flushTime += c.toc();
+        }
+
+        segPtr = ptr + segments[s].offset;
+        segBytes = segments[s].bytes;
+      }
+
+      if (segBytes >= n)
+      {
+        c.tic();
+        threadCounter.setAll(segPtr, segBytes - (n - 1));
+        processTime += c.toc();
+      }
     }
   } while (!done);
 
   // flush the unflushed array if needed
   threadCounter.forceFlush(globalCounts);
+  finishTime = std::chrono::steady_clock::now();
+
+  if (segmentBits != NULL)
+    free_hugepage<uint64_t>(segmentBits, segmentBitsMemState, threadCounter.bitsetLen);
+}
+
+inline void PrefixSingleNgramThread::FinishSegment(FileSegment* segment)
+{
+  c.tic();
+  SplitFile* file = segment->file;
+  if (file->Merge(segmentBits))
+  {
+    file->Flush(globalCounts);
+    delete file;
+    ++flushCount;
+  }
+  ++segmentCount;
+  flushTime += c.toc();
 }
 
 inline void PrefixSingleNgramThread::Finish()
@@ -118,7 +198,10 @@ inline void PrefixSingleNgramThread::Finish()
 
     std::ostringstream oss;
     oss << "PrefixSingleNgramThread: " << processTime << "s processing, " << flushTime
-        << "s flushing, " << flushCount << " flushes." << std::endl;
+        << "s flushing, " << flushCount << " flushes";
+    if (segmentCount > 0)
+      oss << ", " << segmentCount << " segments of split files";
+    oss << "." << std::endl;
     std::cout << oss.str();
   }
 }
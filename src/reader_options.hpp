@@ -0,0 +1,438 @@
+// reader_options.hpp: runtime options that control how reader threads get data
+// off of the disk, and a little parser for the "--option=value" arguments that
+// select them.
+#ifndef PNGRAM_READER_OPTIONS_HPP
+#define PNGRAM_READER_OPTIONS_HPP
+
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+
+// The order in which files are handed out to reader threads (all but
+// schedule_path need a FileCatalog).
+enum struct file_schedule
+{
+  schedule_path, // in path order
+  schedule_size, // largest first
+  schedule_inode, // by device, then inode
+  schedule_extent // by device, then physical location on disk (FIEMAP)
+};
+
+// The different strategies a reader thread may use to read files.
+enum struct reader_backend
+{
+  backend_read, // blocking open()/read()/close() calls
+  backend_direct, // like backend_read, but with O_DIRECT (bypass the page cache)
+  backend_uring, // io_uring, with batched opens and several reads in flight
+  backend_mmap, // mmap() each file and hand out pointers into the mapping
+  backend_pack, // read corpus packs (see corpus_pack.hpp) sequentially
+  backend_tar // read the members of a tar stream (see tar_stream.hpp)
+};
+
+// Whether the counts arrays are replicated across NUMA nodes.
+enum struct numa_mode
+{
+  numa_auto, // replicate if the machine has more than one node
+  numa_off, // one counts array, wherever its pages land
+  numa_replicate // one counts array per node, added up before the top k
+};
+
+// How the 3-gram pass sets the bits of dense chunks (see
+// MultiThreadHashCounter::setRadix()).
+enum struct radix_set_mode
+{
+  radix_off, // one n-gram at a time, in input order
+  radix_on, // partitioned by the high bits of the index first
+  radix_auto // time both on the first chunks, and keep the faster one
+};
+
+class TarStream;
+class SplitFileQueue;
+
+struct ReaderOptions
+{
+  reader_backend backend = reader_backend::backend_read;
+
+  // Bytes in each chunk that a reader thread hands to its ngram thread (a
+  // multiple of 4096, so that O_DIRECT reads work).
+  size_t chunkSize = 65536;
+  // Bytes in the ring of chunks of each reader thread.
+  size_t ringSize = 2097152;
+  // If true, pick chunkSize and ringSize with a quick calibration read before
+  // the first pass (see reader_tuning.hpp).
+  bool autoTune = false;
+
+  // Number of reads each reader thread keeps in flight (io_uring only).
+  size_t uringQueueDepth = 16;
+  // Number of files each reader thread opens ahead of time (io_uring only).
+  size_t uringOpenDepth = 8;
+
+  // Files smaller than this are read instead of mapped (mmap only).
+  size_t mmapMinSize = 65536;
+  // Size of each range of a mapped file handed to the ngram thread.
+  size_t mmapChunkSize = 1048576;
+  // Whether to prefault the whole mapping with MAP_POPULATE (mmap only).
+  bool mmapPopulate = true;
+
+  // Size of each sequential read from a corpus pack (pack only).
+  size_t packReadSize = 8388608;
+
+  // The stream to read from (tar only).  This is set by the program, not by an
+  // option.
+  TarStream* tarStream = nullptr;
+  // Where to spool a tar stream that can't be read twice, if more than one
+  // pass is needed (tar only).
+  std::string spoolDir = "/tmp";
+
+  // Number of upcoming files each reader thread opens and asks the kernel to
+  // read ahead (read and mmap only; 0 disables readahead).
+  size_t readaheadDepth = 0;
+  // Bytes of upcoming files each reader thread may have read ahead at once.
+  size_t readaheadBudget = 67108864;
+
+  // If true, small files are packed back to back into shared chunks (read and
+  // mmap only).
+  bool batchSmallFiles = false;
+
+  // If true, files that start with a gzip (or zstd) header are decompressed
+  // as they are read (read, direct and mmap only).
+  bool decompress = false;
+
+  // Files of at least this many bytes are split into segments that several
+  // reader and ngram threads work on at once (read, direct and mmap only; 0
+  // disables splitting).
+  size_t splitThreshold = 0;
+  // Where split files are queued; this is set by the program for each pass.
+  SplitFileQueue* splitQueue = nullptr;
+
+  // If true, the counting threads flush into the counts arrays range by range,
+  // each taking ownership of a range instead of a mutex per Increment(), and
+  // starting at a different range from each other (see CountsArray).
+  bool partitionedFlush = false;
+  // How many files the counting threads collect in bitsets before each flush
+  // (1 to 32); each file of a batch takes a bitset of its own (2MB in the
+  // 3-gram pass).
+  size_t batchDepth = 8;
+  // If nonzero (4 to 16), the counting threads of the 3-gram pass add up their
+  // files in this many planes of bit-sliced counters, and only flush into the
+  // counts array when the counters could overflow (about every
+  // 2^counterPlanes files).
+  size_t counterPlanes = 0;
+  // Whether the counting threads of the 3-gram pass first partition the
+  // n-grams of dense chunks by the part of the bitset they fall in.
+  radix_set_mode radixSet = radix_set_mode::radix_off;
+  // If true, the counts arrays store 16-bit counts, with an overflow table for
+  // the few that get bigger (see CountsArray).
+  bool narrowCounts = false;
+  // How many trie lookups the counting threads of the 4-gram and later passes
+  // interleave (1, 4, 8, 16 or 32), or 0 to decide from the size of the trie;
+  // see PackedByteTrie::SearchGroup().
+  size_t trieGroup = 0;
+  // If the counts arrays are replicated, each counting thread flushes into the
+  // replica on its own NUMA node (and runs there), and the replicas are added
+  // up at the end of the pass.
+  numa_mode numa = numa_mode::numa_auto;
+
+  // If true, list all files once in a FileCatalog and reuse it for every pass.
+  bool useCatalog = false;
+  // If set, load the catalog from this file (or build it and save it here if
+  // the file does not exist).  Implies useCatalog.
+  std::string catalogFile;
+  // Threads to use when building the catalog; 0 means one per reader thread.
+  size_t catalogThreads = 0;
+  // The order to hand out files in.  Anything but schedule_path implies
+  // useCatalog (which is where file sizes, inodes and devices come from).
+  file_schedule schedule = file_schedule::schedule_path;
+  // If nonzero, at most this many reader threads work on the same device at
+  // once.  Implies useCatalog.  A thread gives up its device when it asks for
+  // its next file, so this can't be combined with readahead or with io_uring
+  // opening more than one file ahead (see CheckReaderOptions()).
+  size_t readersPerDevice = 0;
+};
+
+// Print the options understood by ParseReaderOption().
+inline void PrintReaderOptions(std::ostream& os)
+{
+  os << "Reader options:" << std::endl;
+  os << " --reader=read|direct|uring|mmap|pack|tar: how to read files (default "
+      << "read; pack expects a directory of packs made by pack_corpus, and tar "
+      << "expects a tar file, or - for stdin)" << std::endl;
+  os << " --chunk_size=N: bytes per chunk, a multiple of 4096 (default 65536)"
+      << std::endl;
+  os << " --ring_size=N: bytes of chunks per reader thread (default 2097152)"
+      << std::endl;
+  os << " --auto_tune=0|1: pick the chunk and ring sizes by timing some reads "
+      << "first (default 0)" << std::endl;
+  os << " --uring_depth=N: reads in flight per reader thread (default 16)"
+      << std::endl;
+  os << " --uring_open_depth=N: files opened ahead per reader thread "
+      << "(default 8)" << std::endl;
+  os << " --mmap_min_size=N: read files smaller than N bytes instead of "
+      << "mapping them (default 65536)" << std::endl;
+  os << " --mmap_chunk_size=N: bytes of a mapped file per chunk (default "
+      << "1048576)" << std::endl;
+  os << " --mmap_populate=0|1: prefault mappings with MAP_POPULATE (default 1)"
+      << std::endl;
+  os << " --pack_read_size=N: bytes per read from a corpus pack (default "
+      << "8388608)" << std::endl;
+  os << " --readahead=N: files to open and read ahead per reader thread "
+      << "(default 0)" << std::endl;
+  os << " --readahead_budget=N: bytes to read ahead per reader thread "
+      << "(default 67108864)" << std::endl;
+  os << " --batch_small_files=0|1: pack small files together into chunks "
+      << "(default 0)" << std::endl;
+  os << " --spool_dir=D: where to keep a copy of a tar stream from stdin "
+      << "for later passes (default /tmp)" << std::endl;
+  os << " --decompress=0|1: decompress gzip/zstd files while reading them "
+      << "(default 0)" << std::endl;
+  os << " --split_threshold=N: split files of at least N bytes across "
+      << "several threads (default 0, never)" << std::endl;
+  os << " --flush=striped|partitioned: lock the counts array per increment, "
+      << "or give flushing threads ownership of ranges of it (default striped)"
+      << std::endl;
+  os << " --batch_depth=N: files per flush of each counting thread, 1 to 32 "
+      << "(default 8)" << std::endl;
+  os << " --counter_planes=B: count up to 2^B - 1 files in bit-sliced "
+      << "counters before each flush, 4 to 16 (3-gram pass only; default 0, "
+      << "flush every batch)" << std::endl;
+  os << " --radix_set=0|1|auto: partition the 3-grams of a chunk by bitset "
+      << "region before setting their bits; auto times both ways and keeps "
+      << "the faster (default 0)" << std::endl;
+  os << " --narrow_counts=0|1: keep 16-bit counts (plus an overflow table) "
+      << "to halve the counts arrays (default 0)" << std::endl;
+  os << " --trie_group=G: prefixes to look up at once in the 4-gram and later "
+      << "passes, 1, 4, 8, 16 or 32 (default 0: 32 for tries over 16MB, "
+      << "otherwise 1)" << std::endl;
+  os << " --numa=auto|off|replicate: keep a counts array per NUMA node and add "
+      << "them up after each pass (default auto, replicate if there is more "
+      << "than one node)" << std::endl;
+  os << " --catalog=0|1: list files once and reuse the list for every pass "
+      << "(default 0)" << std::endl;
+  os << " --catalog_file=F: load the file list from F, or build it and save it "
+      << "to F" << std::endl;
+  os << " --catalog_threads=N: threads for building the file list (default: "
+      << "n_threads)" << std::endl;
+  os << " --schedule=path|size|inode|extent: hand out files in path order, "
+      << "largest first, or in inode or on-disk order (default path)"
+      << std::endl;
+  os << " --readers_per_device=N: at most N reader threads per device "
+      << "(default 0, no limit; not with --readahead, or --reader=uring "
+      << "unless --uring_open_depth=1)" << std::endl;
+}
+
+// Parse an argument of the form "--option=value" into `opts`.  Returns false if
+// the argument is not a reader option we know about.
+inline bool ParseReaderOption(const std::string& arg, ReaderOptions& opts)
+{
+  const size_t eq = arg.find('=');
+  if (arg.substr(0, 2) != "--" || eq == std::string::npos)
+    return false;
+
+  const std::string name = arg.substr(2, eq - 2);
+  const std::string value = arg.substr(eq + 1);
+  if (name == "reader")
+  {
+    if (value == "read")
+      opts.backend = reader_backend::backend_read;
+    else if (value == "direct")
+      opts.backend = reader_backend::backend_direct;
+    else if (value == "uring")
+      opts.backend = reader_backend::backend_uring;
+    else if (value == "mmap")
+      opts.backend = reader_backend::backend_mmap;
+    else if (value == "pack")
+      opts.backend = reader_backend::backend_pack;
+    else if (value == "tar")
+      opts.backend = reader_backend::backend_tar;
+    else
+      return false;
+  }
+  else if (name == "chunk_size")
+  {
+    // Leave room for an aligned O_DIRECT read after the n - 1 bytes carried
+    // over from the previous chunk.
+    const size_t size = std::max(8192ULL, strtoull(value.c_str(), NULL, 10));
+    opts.chunkSize = (size + 4095) / 4096 * 4096;
+  }
+  else if (name == "ring_size")
+  {
+    opts.ringSize = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "auto_tune")
+  {
+    opts.autoTune = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "uring_depth")
+  {
+    opts.uringQueueDepth = std::max(1, atoi(value.c_str()));
+  }
+  else if (name == "uring_open_depth")
+  {
+    opts.uringOpenDepth = std::max(1, atoi(value.c_str()));
+  }
+  else if (name == "mmap_min_size")
+  {
+    opts.mmapMinSize = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "mmap_chunk_size")
+  {
+    // Chunks must be much bigger than the n - 1 bytes of overlap.
+    opts.mmapChunkSize = std::max(4096ULL, strtoull(value.c_str(), NULL, 10));
+  }
+  else if (name == "mmap_populate")
+  {
+    opts.mmapPopulate = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "pack_read_size")
+  {
+    opts.packReadSize = std::max(65536ULL, strtoull(value.c_str(), NULL, 10));
+  }
+  else if (name == "readahead")
+  {
+    opts.readaheadDepth = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "readahead_budget")
+  {
+    opts.readaheadBudget = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "batch_small_files")
+  {
+    opts.batchSmallFiles = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "spool_dir")
+  {
+    opts.spoolDir = value;
+  }
+  else if (name == "decompress")
+  {
+    opts.decompress = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "split_threshold")
+  {
+    opts.splitThreshold = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "flush")
+  {
+    if (value == "striped")
+      opts.partitionedFlush = false;
+    else if (value == "partitioned")
+      opts.partitionedFlush = true;
+    else
+      return false;
+  }
+  else if (name == "batch_depth")
+  {
+    opts.batchDepth = std::clamp((size_t) strtoull(value.c_str(), NULL, 10),
+        (size_t) 1, (size_t) 32);
+  }
+  else if (name == "counter_planes")
+  {
+    opts.counterPlanes = strtoull(value.c_str(), NULL, 10);
+    if (opts.counterPlanes > 0)
+      opts.counterPlanes = std::clamp(opts.counterPlanes, (size_t) 4,
+          (size_t) 16);
+  }
+  else if (name == "radix_set")
+  {
+    if (value == "0")
+      opts.radixSet = radix_set_mode::radix_off;
+    else if (value == "1")
+      opts.radixSet = radix_set_mode::radix_on;
+    else if (value == "auto")
+      opts.radixSet = radix_set_mode::radix_auto;
+    else
+      return false;
+  }
+  else if (name == "narrow_counts")
+  {
+    opts.narrowCounts = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "trie_group")
+  {
+    opts.trieGroup = strtoull(value.c_str(), NULL, 10);
+    if (opts.trieGroup != 0 && opts.trieGroup != 1 && opts.trieGroup != 4 &&
+        opts.trieGroup != 8 && opts.trieGroup != 16 && opts.trieGroup != 32)
+      return false;
+  }
+  else if (name == "numa")
+  {
+    if (value == "auto")
+      opts.numa = numa_mode::numa_auto;
+    else if (value == "off")
+      opts.numa = numa_mode::numa_off;
+    else if (value == "replicate")
+      opts.numa = numa_mode::numa_replicate;
+    else
+      return false;
+  }
+  else if (name == "catalog")
+  {
+    opts.useCatalog = (atoi(value.c_str()) != 0);
+  }
+  else if (name == "catalog_file")
+  {
+    opts.useCatalog = true;
+    opts.catalogFile = value;
+  }
+  else if (name == "catalog_threads")
+  {
+    opts.catalogThreads = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (name == "schedule")
+  {
+    if (value == "path")
+      opts.schedule = file_schedule::schedule_path;
+    else if (value == "size")
+      opts.schedule = file_schedule::schedule_size;
+    else if (value == "inode")
+      opts.schedule = file_schedule::schedule_inode;
+    else if (value == "extent")
+      opts.schedule = file_schedule::schedule_extent;
+    else
+      return false;
+
+    if (opts.schedule != file_schedule::schedule_path)
+      opts.useCatalog = true;
+  }
+  else if (name == "readers_per_device")
+  {
+    opts.readersPerDevice = strtoull(value.c_str(), NULL, 10);
+    if (opts.readersPerDevice > 0)
+      opts.useCatalog = true;
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+// Check that the options in `opts` work together; if not, say why on `os` and
+// return false.
+inline bool CheckReaderOptions(const ReaderOptions& opts, std::ostream& os)
+{
+  bool ok = true;
+  // The device limit counts a reader thread against the device of the last
+  // file it was handed, until it asks for another; a thread with several files
+  // in flight would escape the limit (and one that waited for a device while
+  // holding files on another could deadlock with its peers).
+  if (opts.readersPerDevice > 0 && opts.readaheadDepth > 0)
+  {
+    os << "--readers_per_device can't be used with --readahead." << std::endl;
+    ok = false;
+  }
+
+  if (opts.readersPerDevice > 0 &&
+      opts.backend == reader_backend::backend_uring && opts.uringOpenDepth > 1)
+  {
+    os << "--readers_per_device needs --uring_open_depth=1 with "
+        << "--reader=uring." << std::endl;
+    ok = false;
+  }
+
+  return ok;
+}
+
+#endif
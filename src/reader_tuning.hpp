@@ -0,0 +1,141 @@
+// reader_tuning.hpp: pick the chunk and ring sizes of reader threads by timing
+// a few reads of the corpus before the first pass.  The best values depend a
+// lot on the storage: local NVMe drives do fine with small chunks and a small
+// ring, while network filesystems want bigger reads, and more of them buffered
+// to ride out the slow ones.
+#ifndef PNGRAM_READER_TUNING_HPP
+#define PNGRAM_READER_TUNING_HPP
+
+#include "reader_options.hpp"
+#include "alloc.hpp"
+#include <filesystem>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Read the start of `files` with each candidate chunk size (dropping them from
+// the page cache first, so that the reads go to the device), then set
+// options.chunkSize to the smallest candidate whose throughput is within 10%
+// of the best, and options.ringSize so that the ring holds enough data to
+// cover the slowest read we saw.  If nothing could be read, the options are
+// left alone.
+inline void AutoTuneReaderOptions(ReaderOptions& options,
+                                  const std::vector<std::filesystem::path>& files,
+                                  const size_t verbosity)
+{
+  const std::vector<size_t> candidates = { 65536, 262144, 1048576, 4194304 };
+  // Bytes to read with each candidate.
+  const size_t budget = 33554432;
+  const size_t maxRingSize = 67108864;
+
+  const size_t bufferSize = candidates.back();
+  unsigned char* buffer;
+  alloc_mem_state bufferMemState;
+  alloc_hugepage<unsigned char>(buffer, bufferMemState, bufferSize,
+      "reader calibration");
+
+  bool direct = (options.backend == reader_backend::backend_direct);
+  std::vector<double> throughputs(candidates.size(), 0.0);
+  std::vector<double> meanLatencies(candidates.size(), 0.0);
+  std::vector<double> maxLatencies(candidates.size(), 0.0);
+  for (size_t c = 0; c < candidates.size(); ++c)
+  {
+    size_t bytes = 0;
+    size_t reads = 0;
+    double time = 0.0;
+    for (const std::filesystem::path& p : files)
+    {
+      int fd = open(p.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+      if (fd == -1 && direct && errno == EINVAL)
+      {
+        direct = false;
+        fd = open(p.c_str(), O_RDONLY);
+      }
+      if (fd == -1)
+        continue;
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      size_t offset = 0;
+      while (bytes < budget)
+      {
+        const std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        ssize_t bytesRead = pread(fd, buffer, candidates[c], offset);
+        if (bytesRead == -1 && direct && errno == EINVAL)
+        {
+          direct = false;
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+          continue;
+        }
+        const double latency = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        if (bytesRead <= 0)
+          break;
+
+        bytes += bytesRead;
+        offset += bytesRead;
+        time += latency;
+        ++reads;
+        maxLatencies[c] = std::max(maxLatencies[c], latency);
+        if (size_t(bytesRead) < candidates[c])
+          break;
+      }
+
+      close(fd);
+      if (bytes >= budget)
+        break;
+    }
+
+    if (reads > 0 && time > 0.0)
+    {
+      throughputs[c] = bytes / time;
+      meanLatencies[c] = time / reads;
+    }
+
+    if (verbosity > 0)
+    {
+      std::ostringstream oss;
+      oss << "Reader calibration: " << candidates[c] << "-byte reads: "
+          << (throughputs[c] / 1048576.0) << " MB/s over " << reads
+          << " reads (mean latency " << (meanLatencies[c] * 1e6)
+          << "us, max " << (maxLatencies[c] * 1e6) << "us)." << std::endl;
+      std::cout << oss.str();
+    }
+  }
+
+  free_hugepage<unsigned char>(buffer, bufferMemState, bufferSize);
+
+  const double best = *std::max_element(throughputs.begin(),
+      throughputs.end());
+  if (best == 0.0)
+  {
+    std::cout << "Reader calibration: nothing could be read; keeping chunk "
+        << "size " << options.chunkSize << " and ring size "
+        << options.ringSize << "." << std::endl;
+    return;
+  }
+
+  size_t chosen = 0;
+  while (throughputs[chosen] < 0.9 * best)
+    ++chosen;
+
+  // Like a bandwidth-delay product: while one read takes as long as the slowest
+  // one we saw, the ngram thread can keep working through what is buffered.
+  const size_t chunkSize = candidates[chosen];
+  const size_t stallChunks = size_t(std::ceil(2.0 * maxLatencies[chosen] /
+      meanLatencies[chosen]));
+  const size_t ringChunks = std::min(std::max(stallChunks, size_t(32)),
+      std::max(maxRingSize / chunkSize, size_t(4)));
+
+  options.chunkSize = chunkSize;
+  options.ringSize = ringChunks * chunkSize;
+  std::cout << "Reader calibration: using chunk size " << options.chunkSize
+      << " and ring size " << options.ringSize << " (" << ringChunks
+      << " chunks)." << std::endl;
+}
+
+#endif
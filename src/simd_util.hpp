@@ -9,6 +9,7 @@ typedef uint64_t u512 __attribute__((vector_size(64)));
 typedef  int64_t i512 __attribute__((vector_size(64)));
 typedef uint32_t u32_512 __attribute__((vector_size(64)));
 typedef  int32_t i32_512 __attribute__((vector_size(64)));
+typedef uint16_t u16_256 __attribute__((vector_size(32)));
 
 #define PRINT_U512(x, name) \
     { \
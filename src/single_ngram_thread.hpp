@@ -7,20 +7,27 @@
 #include "single_reader_thread.hpp"
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <armadillo>
 
 class SingleNgramThread
 {
  public:
+  // If `numaNode` is not -1, the thread runs on the CPUs of that NUMA node,
+  // and its counter is placed there (so `globalCounts` should be too).
   SingleNgramThread(SingleReaderThread& reader,
                     CountsArray<>& globalCounts,
                     const size_t n,
                     const size_t t,
-                    const size_t verbosity = 1);
+                    const size_t verbosity = 1,
+                    const int numaNode = -1);
 
   inline void RunThread();
   inline void Finish();
 
+  // When the thread finished its last flush (valid after Finish()).
+  std::chrono::steady_clock::time_point FinishTime() const { return finishTime; }
+
  private:
   SingleReaderThread& reader;
   MultiThreadHashCounter threadCounter;
@@ -33,6 +40,17 @@ class SingleNgramThread
   size_t flushCount;
   size_t t;
   size_t verbosity;
+  std::chrono::steady_clock::time_point finishTime;
+
+  // Bits for the segment of a split file we are working on (allocated when we
+  // get the first one), and how many segments we have finished.
+  uint64_t* segmentBits;
+  alloc_mem_state segmentBitsMemState;
+  size_t segmentCount;
+
+  // Merge segmentBits into the file the segment is from, and flush the file if
+  // this was the last segment of it.
+  inline void FinishSegment(FileSegment* segment);
 
   std::thread thread;
 };
@@ -1,12 +1,31 @@
 // single_reader_thread.hpp: Definition of SingleReaderThread, which reads
 // through files and puts bytes into a buffer.  This expects that only one
-// thread is reading at a time.
+// thread is reading at a time.  The way files are read (blocking read() calls,
+// with or without O_DIRECT, io_uring, mmap(), sequential reads of corpus
+// packs, or a tar stream) is selected at runtime with ReaderOptions.
 #ifndef PNGRAM_SINGLE_READER_THREAD_HPP
 #define PNGRAM_SINGLE_READER_THREAD_HPP
 
 #include "directory_iterator.hpp"
+#include "reader_options.hpp"
+#include "io_uring_queue.hpp"
+#include "corpus_pack.hpp"
+#include "decompressor.hpp"
+#include "tar_stream.hpp"
+#include "split_file.hpp"
+#include "alloc.hpp"
 #include <thread>
 #include <atomic>
+#include <deque>
+
+// A part of a chunk that holds (the end of) one file, when small files are
+// batched together into one chunk.
+struct ChunkSegment
+{
+  size_t offset; // from the start of the chunk
+  size_t bytes;
+  size_t fileId;
+};
 
 class SingleReaderThread
 {
@@ -14,34 +33,186 @@ class SingleReaderThread
   inline SingleReaderThread(DirectoryIterator& directory,
                             const size_t n,
                             const size_t t,
-                            const size_t verbosity = 1);
+                            const size_t verbosity = 1,
+                            const ReaderOptions& options = ReaderOptions());
   inline ~SingleReaderThread();
 
   inline void RunThread();
 
+  const ReaderOptions& Options() const { return options; }
+
   // returns NULL if there is no chunk right now for ptr, and returns false if
   // reading is done and there are no more chunks
   inline bool GetNextChunk(unsigned char*& ptr, size_t& bytes, size_t& file_id);
 
-  // read 4KB at a time
-  static constexpr size_t chunkSize = 4096;
-  static constexpr size_t totalBufferSize = (1 << 18); // buffer up to 256KB of data
-  static constexpr size_t numChunks = totalBufferSize / chunkSize;
+  // If small files were batched into the chunk that GetNextChunk() just
+  // returned, get the files in it and return how many there are.  `file_id`
+  // from GetNextChunk() is the ID of the last one, and its return value says
+  // whether the first one is a new file.  Returns 0 if the whole chunk is from
+  // one file.
+  inline size_t GetChunkSegments(const ChunkSegment*& segments) const;
+
+  // If the chunk that GetNextChunk() just returned is part of a segment of a
+  // split file (see split_file.hpp), get that segment; otherwise, NULL.
+  inline FileSegment* GetChunkFileSegment() const;
+
+  // O_DIRECT reads are aligned to this (a multiple of any block size we will
+  // see).
+  static constexpr size_t directAlignment = 4096;
+  // At most this many files are batched into one chunk.
+  static constexpr size_t maxChunkSegments = 256;
+  // The ring always has at least this many chunks.
+  static constexpr size_t minChunks = 4;
+  // Compressed files are read this much at a time.
+  static constexpr size_t decompressInputSize = (1 << 20);
 
  private:
+  // Read files with blocking open()/read()/lseek() calls.
+  inline void RunReadThread();
+  // Read files through io_uring.
+  inline void RunUringThread(IoUringQueue& ring);
+  // Map files into memory and hand out pointers into the mappings.
+  inline void RunMmapThread();
+  // Read corpus packs with large sequential reads, and split them back up into
+  // the samples they hold.
+  inline void RunPackThread();
+  // Read the members of a tar stream (ReaderOptions::tarStream).
+  inline void RunTarThread();
+
+  // Get the next file from the DirectoryIterator and open it (with O_DIRECT, if
+  // `direct` is set on return).  If readahead is enabled, this also opens and
+  // starts reading the next few files.  Returns false if there are no more
+  // files.
+  inline bool OpenNextFile(std::filesystem::path& p,
+                           size_t& fileId,
+                           int& fd,
+                           bool& direct);
+  // Read an open file into chunks with read() calls.  If `direct` is true, the
+  // file was opened with O_DIRECT.
+  inline void ReadFileChunks(const int fd, const size_t fileId, bool direct);
+  // Read a file into chunks, where readFn(buffer, len) reads up to `len` bytes
+  // and returns how many it read (fewer only at the end of the file) or -1.
+  // `direct` says whether reads must go to aligned addresses; readFn may clear
+  // it.  Returns the number of chunks handed to the ngram thread.
+  template<typename ReadFn>
+  inline size_t ReadChunks(const size_t fileId,
+                           const bool& direct,
+                           ReadFn readFn);
+  // If the open file is big enough, split it into segments and read the first
+  // one; the rest are queued for any reader thread to pick up.  Returns false
+  // if the file was not split.
+  inline bool SplitFileChunks(const std::filesystem::path& p,
+                              const size_t fileId,
+                              const int fd,
+                              const bool direct);
+  // If another reader thread split a file, open it and read one of its queued
+  // segments.  Returns false if there was none.
+  inline bool ReadQueuedSegment();
+  // Whether any segments of split files are waiting for a reader thread.
+  inline bool SegmentsPending();
+  // Read one segment of an open file into chunks.
+  inline void ReadSegmentChunks(FileSegment& segment,
+                                const int fd,
+                                bool direct);
+  // Read the first bytes of an open file into decompressInput (`inLen` is set
+  // to how many there were), and guess its compression from them.
+  inline compression_type DetectCompression(const int fd,
+                                            bool& direct,
+                                            size_t& inLen);
+  // Decompress an open file into chunks.  The first `inLen` bytes of the file
+  // are already in decompressInput.
+  inline void ReadCompressedFileChunks(const int fd,
+                                       const size_t fileId,
+                                       const compression_type type,
+                                       size_t inLen,
+                                       bool direct);
+  // Wait for a free chunk in localBuffer, and copy the last `carry` bytes of
+  // the previous chunk to its start.
+  inline unsigned char* NextCopyChunk(const size_t carry);
+  // Hand a chunk to the ngram thread.
+  inline void PublishChunk(unsigned char* chunk,
+                           const size_t bytes,
+                           const size_t fileId);
+  // Add (the end of) a file to the chunk at readChunkId, which is kept open so
+  // that more small files can follow it.
+  inline void AddSegment(const size_t offset,
+                         const size_t bytes,
+                         const size_t fileId);
+  // Hand the open batched chunk (if there is one) to the ngram thread.
+  inline void FlushBatch();
+  // The ID of the first file in a chunk.
+  inline size_t FirstFileId(const size_t chunk) const;
+  // Note that O_DIRECT does not work here, so we stop trying it.
+  inline void DirectUnsupported();
+  // Wait until the chunk at readChunkId can be written to.
+  inline void WaitForFreeChunk();
+  // Unmap the file whose last chunk is `chunk`, if there is one.
+  inline void ReleaseMapping(const size_t chunk);
+
+  // Files are read ReaderOptions::chunkSize bytes at a time (consecutive chunks
+  // of a file overlap by n - 1 bytes), into a ring of numChunks chunks.
+  const size_t chunkSize;
+  const size_t numChunks;
+  const size_t totalBufferSize;
+
   DirectoryIterator& dIter;
   unsigned char* localBuffer;
+  alloc_mem_state localBufferMemState;
   size_t* chunkSizes;
   size_t* chunkFileIds;
+  // Where each chunk's data is: either in localBuffer, or in a mapped file.
+  unsigned char** chunkPtrs;
+  // If a chunk is the last one of a mapped file, the mapping to release once
+  // the chunk is done.
+  unsigned char** chunkMaps;
+  size_t* chunkMapLens;
   std::atomic<size_t> readChunkId;
   std::atomic<size_t> processChunkId;
+
+  // maxChunkSegments entries per chunk; chunkSegmentCounts[c] is 0 unless
+  // files were batched into chunk c.
+  ChunkSegment* chunkSegments;
+  size_t* chunkSegmentCounts;
+  // The segment of a split file that each chunk holds part of (or NULL), and
+  // the segment being read right now.
+  FileSegment** chunkFileSegments;
+  FileSegment* currentSegment;
+  // Whether the chunk at readChunkId is being filled with small files, and how
+  // much of it is used.
+  bool batchOpen;
+  size_t batchFill;
+
+  // Files that have been opened, and that the kernel was asked to start
+  // reading, before we need them.
+  struct ReadaheadFile
+  {
+    std::filesystem::path path;
+    size_t fileId;
+    int fd;
+    size_t advised; // bytes of the file we asked the kernel to read ahead
+  };
+  std::deque<ReadaheadFile> readahead;
+  size_t readaheadBytes;
   size_t n;
   size_t waitingForChunks;
+  bool directUnsupported;
   size_t verbosity;
+  ReaderOptions options;
 
-  std::thread thread;
+  // Compressed input is read into decompressInput and decompressed into chunks.
+  Decompressor decompressor;
+  unsigned char* decompressInput;
+  alloc_mem_state decompressInputMemState;
+  bool zstdWarning;
+  double decompressTime;
+  size_t decompressedFiles;
+  size_t compressedBytes;
+  size_t decompressedBytes;
+  // This must be initialized before the thread starts, since a reader that gets
+  // no files will set it right away.
+  std::atomic<bool> finished;
 
-  bool finished;
+  std::thread thread;
 };
 
 #include "single_reader_thread_impl.hpp"
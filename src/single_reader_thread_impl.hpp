@@ -6,27 +6,60 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <sched.h>
 #include <sys/sysinfo.h>
 #include <pthread.h>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include "alloc.hpp"
 
 inline SingleReaderThread::SingleReaderThread(DirectoryIterator& iterIn,
                                               const size_t n,
                                               const size_t t,
-                                              const size_t verbosity) :
+                                              const size_t verbosity,
+                                              const ReaderOptions& options) :
+    chunkSize(options.chunkSize),
+    numChunks(std::max(options.ringSize / options.chunkSize, minChunks)),
+    totalBufferSize(chunkSize * numChunks),
     dIter(iterIn),
-    localBuffer(new unsigned char[totalBufferSize]),
     chunkSizes(new size_t[numChunks]),
     chunkFileIds(new size_t[numChunks]),
+    chunkPtrs(new unsigned char*[numChunks]),
+    chunkMaps(new unsigned char*[numChunks]),
+    chunkMapLens(new size_t[numChunks]),
     readChunkId(0),
     processChunkId(numChunks - 1),
+    chunkSegments(new ChunkSegment[numChunks * maxChunkSegments]),
+    chunkSegmentCounts(new size_t[numChunks]),
+    chunkFileSegments(new FileSegment*[numChunks]),
+    currentSegment(nullptr),
+    batchOpen(false),
+    batchFill(0),
+    readaheadBytes(0),
     n(n),
     waitingForChunks(0),
-    thread(&SingleReaderThread::RunThread, this),
-    finished(false),
-    verbosity(verbosity)
+    directUnsupported(false),
+    verbosity(verbosity),
+    options(options),
+    decompressInput(nullptr),
+    zstdWarning(false),
+    decompressTime(0.0),
+    decompressedFiles(0),
+    compressedBytes(0),
+    decompressedBytes(0),
+    finished(false)
 {
+  // The ring is aligned (to 2MB, if we get huge pages), which is also what
+  // O_DIRECT reads need.
+  alloc_hugepage<unsigned char>(localBuffer, localBufferMemState,
+      totalBufferSize, "reader buffer");
+  thread = std::thread(&SingleReaderThread::RunThread, this);
+
   // The thread has now started.  Set its affinity to a physical CPU (this is
   // specific to the uberservers which have 128 processors...).
   cpu_set_t cpuset;
@@ -52,29 +85,824 @@ inline SingleReaderThread::~SingleReaderThread()
   while (processChunkId < readChunkId)
     usleep(1000);
 
-  if (verbosity > 1)
+  // If readers wait a lot, the ring is too small (or the ngram threads are the
+  // bottleneck); this shows whether --chunk_size and --ring_size are right.
+  if (verbosity > 0)
   {
     std::ostringstream oss;
     oss << "SingleReaderThread: " << waitingForChunks
-        << " iterations waiting on a chunk to be available." << std::endl;
+        << " iterations waiting on a chunk to be available (" << numChunks
+        << " chunks of " << chunkSize << " bytes)." << std::endl;
+    std::cout << oss.str();
+  }
+
+  if (decompressedFiles > 0 && verbosity > 0)
+  {
+    std::ostringstream oss;
+    oss << "SingleReaderThread: " << decompressTime << "s decompressing "
+        << decompressedFiles << " files (" << compressedBytes << " bytes to "
+        << decompressedBytes << " bytes)." << std::endl;
     std::cout << oss.str();
   }
 
-  delete[] localBuffer;
+  // The ngram thread is done with every chunk now, so any files that are still
+  // mapped can be unmapped.
+  for (size_t c = 0; c < numChunks; ++c)
+    ReleaseMapping(c);
+
+  free_hugepage<unsigned char>(localBuffer, localBufferMemState,
+      totalBufferSize);
+  if (decompressInput != nullptr)
+  {
+    free_hugepage<unsigned char>(decompressInput, decompressInputMemState,
+        decompressInputSize);
+  }
   delete[] chunkSizes;
   delete[] chunkFileIds;
+  delete[] chunkPtrs;
+  delete[] chunkMaps;
+  delete[] chunkMapLens;
+  delete[] chunkSegments;
+  delete[] chunkSegmentCounts;
+  delete[] chunkFileSegments;
 }
 
 inline void SingleReaderThread::RunThread()
+{
+  // By default, each chunk lives in its own part of localBuffer.
+  for (size_t c = 0; c < numChunks; ++c)
+  {
+    chunkPtrs[c] = localBuffer + c * chunkSize;
+    chunkMaps[c] = nullptr;
+    chunkMapLens[c] = 0;
+    chunkSegmentCounts[c] = 0;
+    chunkFileSegments[c] = nullptr;
+  }
+
+  // This is aligned, so compressed files can be read with O_DIRECT too.
+  if (options.decompress)
+  {
+    alloc_hugepage<unsigned char>(decompressInput, decompressInputMemState,
+        decompressInputSize, "decompression buffer");
+  }
+
+  if (options.backend == reader_backend::backend_mmap)
+  {
+    RunMmapThread();
+    finished = true;
+    return;
+  }
+  else if (options.backend == reader_backend::backend_pack)
+  {
+    RunPackThread();
+    finished = true;
+    return;
+  }
+  else if (options.backend == reader_backend::backend_tar)
+  {
+    RunTarThread();
+    finished = true;
+    return;
+  }
+  else if (options.backend == reader_backend::backend_uring &&
+      options.decompress)
+  {
+    std::ostringstream oss;
+    oss << "SingleReaderThread: io_uring does not support --decompress; "
+        << "using read() instead." << std::endl;
+    std::cout << oss.str();
+  }
+  else if (options.backend == reader_backend::backend_uring)
+  {
+    try
+    {
+      // Enough entries for every read, open, statx and close we might have in
+      // flight at once.
+      IoUringQueue ring(options.uringQueueDepth + 3 * options.uringOpenDepth);
+      RunUringThread(ring);
+      finished = true;
+      return;
+    }
+    catch (const std::runtime_error& e)
+    {
+      std::ostringstream oss;
+      oss << "SingleReaderThread: io_uring unavailable (" << e.what()
+          << "); falling back to read()." << std::endl;
+      std::cout << oss.str();
+    }
+  }
+
+  RunReadThread();
+  finished = true;
+}
+
+inline void SingleReaderThread::RunReadThread()
 {
   std::filesystem::path p;
   size_t i;
-  while (dIter.get_next(p, i))
+  int fd;
+  bool direct;
+  while (true)
+  {
+    // Segments of split files come first, so that the files they belong to
+    // are finished (and flushed) as soon as possible.
+    if (ReadQueuedSegment())
+      continue;
+
+    if (!OpenNextFile(p, i, fd, direct))
+    {
+      // Another reader thread may have split a file since we last looked.
+      if (SegmentsPending())
+        continue;
+      break;
+    }
+
+    if (options.decompress)
+    {
+      size_t inLen;
+      const compression_type type = DetectCompression(fd, direct, inLen);
+      if (type != compression_type::compression_none)
+      {
+        ReadCompressedFileChunks(fd, i, type, inLen, direct);
+        close(fd);
+        continue;
+      }
+    }
+
+    if (!SplitFileChunks(p, i, fd, direct))
+      ReadFileChunks(fd, i, direct);
+    close(fd);
+  }
+
+  // Hand off any small files still waiting in a batched chunk.
+  FlushBatch();
+}
+
+inline bool SingleReaderThread::OpenNextFile(std::filesystem::path& p,
+                                             size_t& i,
+                                             int& fd,
+                                             bool& direct)
+{
+  // O_DIRECT skips the page cache (and the copy out of it), so there is no
+  // point in reading ahead into the page cache for it.
+  direct = (options.backend == reader_backend::backend_direct) &&
+      !directUnsupported;
+  const bool useReadahead = (options.readaheadDepth > 0) && !direct;
+
+  // Open the next few files ahead of time and ask the kernel to start reading
+  // them, so that the device stays busy while we work on the current file.
+  while (useReadahead && readahead.size() < options.readaheadDepth &&
+      (readahead.empty() || readaheadBytes < options.readaheadBudget))
+  {
+    ReadaheadFile f;
+    if (!dIter.get_next(f.path, f.fileId))
+      break;
+
+    f.fd = open(f.path.c_str(), O_RDONLY);
+    if (f.fd == -1)
+    {
+      // check errno, something went wrong
+      std::cout << "open failed! errno " << errno << "\n";
+      continue;
+    }
+
+    struct stat st;
+    f.advised = 0;
+    if (fstat(f.fd, &st) == 0 && readaheadBytes < options.readaheadBudget)
+    {
+      f.advised = std::min(size_t(st.st_size),
+          options.readaheadBudget - readaheadBytes);
+      posix_fadvise(f.fd, 0, f.advised, POSIX_FADV_WILLNEED);
+    }
+
+    readaheadBytes += f.advised;
+    readahead.push_back(std::move(f));
+  }
+
+  while (true)
   {
+    if (useReadahead || !readahead.empty())
+    {
+      if (readahead.empty())
+        return false;
+
+      ReadaheadFile& f = readahead.front();
+      p = std::move(f.path);
+      i = f.fileId;
+      fd = f.fd;
+      direct = false;
+      readaheadBytes -= f.advised;
+      readahead.pop_front();
+    }
+    else
+    {
+      if (!dIter.get_next(p, i))
+        return false;
+
+      fd = open(p.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+      if (fd == -1 && direct && errno == EINVAL)
+      {
+        // Not every filesystem supports O_DIRECT; if it is rejected, just read
+        // normally.
+        DirectUnsupported();
+        direct = false;
+        fd = open(p.c_str(), O_RDONLY);
+      }
+
+      if (fd == -1)
+      {
+        // check errno, something went wrong
+        std::cout << "open failed! errno " << errno << "\n";
+        continue;
+      }
+    }
+
     if (i % 10000 == 0 && verbosity > 0)
       std::cout << "Reading file " << i << "..." << std::endl;
 
-    int fd = open(p.c_str(), O_RDONLY); // TODO: O_DIRECT
+    return true;
+  }
+}
+
+inline void SingleReaderThread::DirectUnsupported()
+{
+  if (!directUnsupported && verbosity > 0)
+  {
+    std::ostringstream oss;
+    oss << "SingleReaderThread: O_DIRECT not supported; falling back to "
+        << "buffered reads." << std::endl;
+    std::cout << oss.str();
+  }
+
+  directUnsupported = true;
+}
+
+inline void SingleReaderThread::WaitForFreeChunk()
+{
+  // A chunk that small files are being batched into is at readChunkId, so hand
+  // it off first.
+  FlushBatch();
+
+  // Wait, if needed.
+  while (((readChunkId + 1) % numChunks) == processChunkId)
+  {
+    usleep(1000);
+    ++waitingForChunks;
+  }
+
+  // The ngram thread is done with whatever was in this chunk before, so if it
+  // was the last chunk of a mapped file, the file can be unmapped.
+  ReleaseMapping(readChunkId);
+  chunkSegmentCounts[readChunkId] = 0;
+  chunkFileSegments[readChunkId] = nullptr;
+}
+
+inline void SingleReaderThread::AddSegment(const size_t offset,
+                                           const size_t bytes,
+                                           const size_t fileId)
+{
+  ChunkSegment& s = chunkSegments[readChunkId * maxChunkSegments +
+      chunkSegmentCounts[readChunkId]];
+  s.offset = offset;
+  s.bytes = bytes;
+  s.fileId = fileId;
+  ++chunkSegmentCounts[readChunkId];
+  batchOpen = true;
+  batchFill = offset + bytes;
+}
+
+inline void SingleReaderThread::FlushBatch()
+{
+  if (!batchOpen)
+    return;
+
+  const size_t count = chunkSegmentCounts[readChunkId];
+  const ChunkSegment* segments = chunkSegments + readChunkId * maxChunkSegments;
+  if (count == 1)
+  {
+    // Only one file ended up here, so this is just a regular chunk.
+    chunkPtrs[readChunkId] = localBuffer + readChunkId * chunkSize +
+        segments[0].offset;
+    chunkSizes[readChunkId] = segments[0].bytes;
+    chunkSegmentCounts[readChunkId] = 0;
+  }
+  else
+  {
+    chunkPtrs[readChunkId] = localBuffer + readChunkId * chunkSize;
+    chunkSizes[readChunkId] = batchFill;
+  }
+  chunkFileIds[readChunkId] = segments[count - 1].fileId;
+
+  readChunkId = ((readChunkId + 1) % numChunks);
+  batchOpen = false;
+}
+
+inline void SingleReaderThread::ReleaseMapping(const size_t chunk)
+{
+  if (chunkMaps[chunk] != nullptr)
+  {
+    munmap(chunkMaps[chunk], chunkMapLens[chunk]);
+    chunkMaps[chunk] = nullptr;
+    chunkMapLens[chunk] = 0;
+  }
+}
+
+inline void SingleReaderThread::ReadFileChunks(const int fd,
+                                               const size_t i,
+                                               bool direct)
+{
+  // Each chunk has to start with the last n - 1 bytes of the previous chunk so
+  // that no n-gram is lost at a chunk boundary.  Instead of seeking backwards
+  // and reading those bytes again, copy them from the previous chunk.
+  //
+  // O_DIRECT reads must go to an aligned address and be a multiple of the
+  // block size, so in that case the read always goes to the first aligned
+  // address after the carried-over bytes.
+  if (direct && n - 1 > directAlignment)
+  {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    direct = false;
+  }
+
+  ReadChunks(i, direct, [&](unsigned char* buffer, const size_t len)
+  {
+    ssize_t bytesRead = read(fd, buffer, len);
+    if (bytesRead == -1 && direct && errno == EINVAL)
+    {
+      // Some filesystems accept O_DIRECT at open() time but not for reads.
+      // Reading from here on without it is fine; the file offset is
+      // unchanged.
+      DirectUnsupported();
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      direct = false;
+      bytesRead = read(fd, buffer, len);
+    }
+
+    return bytesRead;
+  });
+}
+
+template<typename ReadFn>
+inline size_t SingleReaderThread::ReadChunks(const size_t i,
+                                             const bool& direct,
+                                             ReadFn readFn)
+{
+  // If small files are batched, a file that ends partway through a chunk
+  // leaves the rest of the chunk open for the next files.  (O_DIRECT reads
+  // can't go to arbitrary offsets, so they are never batched, and neither are
+  // segments of split files, which are not whole files.)
+  const bool batch = options.batchSmallFiles && !direct &&
+      (currentSegment == nullptr);
+
+  const unsigned char* carryFrom = nullptr;
+  size_t carry = 0;
+  size_t published = 0;
+  while (true)
+  {
+    unsigned char* chunk;
+    unsigned char* readStart;
+    if (batchOpen && carry == 0 && batch)
+    {
+      // Start this file right after the previous one.
+      chunk = localBuffer + readChunkId * chunkSize;
+      readStart = chunk + batchFill;
+    }
+    else
+    {
+      WaitForFreeChunk();
+      chunk = localBuffer + readChunkId * chunkSize;
+      readStart = chunk + (direct ? directAlignment : carry);
+    }
+
+    const size_t readLen = chunkSize - (readStart - chunk);
+    if (carry > 0)
+      memcpy(readStart - carry, carryFrom, carry);
+
+    const ssize_t bytesRead = readFn(readStart, readLen);
+    if (bytesRead == -1)
+    {
+      // error
+      std::cout << "read failed! errno " << errno << "\n";
+      break;
+    }
+    else if (bytesRead == 0)
+    {
+      // The file ended exactly at the end of the last chunk, so there is
+      // nothing new here.
+      break;
+    }
+
+    // advance to next chunk
+    const size_t bytes = carry + bytesRead;
+    if (batch && (batchOpen || size_t(bytesRead) < readLen))
+    {
+      // Either the file ended here and other files can follow it in this
+      // chunk, or it filled up what was left of a batched chunk.
+      AddSegment(readStart - carry - chunk, bytes, i);
+      ++published;
+      if (size_t(bytesRead) < readLen)
+      {
+        // Keep the chunk open, unless there's no room for another file.
+        if (chunkSegmentCounts[readChunkId] == maxChunkSegments ||
+            chunkSize - batchFill < n)
+          FlushBatch();
+        break;
+      }
+
+      FlushBatch();
+    }
+    else
+    {
+      chunkPtrs[readChunkId] = readStart - carry;
+      chunkSizes[readChunkId] = bytes;
+      chunkFileIds[readChunkId] = i;
+      chunkFileSegments[readChunkId] = currentSegment;
+
+      readChunkId = ((readChunkId + 1) % numChunks);
+      ++published;
+    }
+
+    // A short read from a regular file means we hit the end of the file, so we
+    // don't need another read() to find that out.  (This holds for O_DIRECT
+    // too: the tail of the file comes back as a short read, and for tar
+    // members.)
+    if (size_t(bytesRead) < readLen)
+      break;
+
+    carry = std::min(n - 1, bytes);
+    carryFrom = readStart + bytesRead - carry;
+  }
+
+  return published;
+}
+
+inline bool SingleReaderThread::SplitFileChunks(const std::filesystem::path& p,
+                                                const size_t i,
+                                                const int fd,
+                                                const bool direct)
+{
+  if (options.splitQueue == nullptr)
+    return false;
+
+  struct stat st;
+  FileSegment* first;
+  if (fstat(fd, &st) != 0 ||
+      !options.splitQueue->Split(p, i, st.st_size, first))
+    return false;
+
+  if (verbosity > 1)
+  {
+    std::ostringstream oss;
+    oss << "SingleReaderThread: splitting file " << i << " (" << st.st_size
+        << " bytes) into " << first->file->Segments().size() << " segments."
+        << std::endl;
+    std::cout << oss.str();
+  }
+
+  ReadSegmentChunks(*first, fd, direct);
+  return true;
+}
+
+inline bool SingleReaderThread::ReadQueuedSegment()
+{
+  FileSegment* segment;
+  if (options.splitQueue == nullptr || !options.splitQueue->Next(segment))
+    return false;
+
+  bool direct = (options.backend == reader_backend::backend_direct) &&
+      !directUnsupported;
+  const std::filesystem::path& p = segment->file->Path();
+  int fd = open(p.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+  if (fd == -1 && direct && errno == EINVAL)
+  {
+    DirectUnsupported();
+    direct = false;
+    fd = open(p.c_str(), O_RDONLY);
+  }
+
+  if (fd == -1)
+  {
+    // check errno, something went wrong
+    std::cout << "open failed! errno " << errno << "\n";
+  }
+
+  // Even if the file could not be opened, the segment still has to reach the
+  // ngram thread, or the file would never be finished.
+  ReadSegmentChunks(*segment, fd, direct);
+  if (fd != -1)
+    close(fd);
+  return true;
+}
+
+inline bool SingleReaderThread::SegmentsPending()
+{
+  return (options.splitQueue != nullptr) && options.splitQueue->Pending();
+}
+
+inline void SingleReaderThread::ReadSegmentChunks(FileSegment& segment,
+                                                  const int fd,
+                                                  bool direct)
+{
+  if (direct && n - 1 > directAlignment)
+  {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    direct = false;
+  }
+
+  const size_t i = segment.file->FileId();
+  size_t pos = segment.start;
+  currentSegment = &segment;
+  const size_t published = ReadChunks(i, direct,
+      [&](unsigned char* buffer, const size_t len)
+  {
+    const size_t want = std::min(len, segment.end - pos);
+    if (want == 0)
+      return ssize_t(0);
+
+    // O_DIRECT reads have to be a multiple of the block size (which `len`
+    // is), so we may read past the end of the segment and drop the rest.
+    const size_t readLen = direct ? std::min(len, (want + directAlignment - 1) /
+        directAlignment * directAlignment) : want;
+    ssize_t bytesRead = pread(fd, buffer, readLen, pos);
+    if (bytesRead == -1 && direct && errno == EINVAL)
+    {
+      DirectUnsupported();
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      direct = false;
+      bytesRead = pread(fd, buffer, want, pos);
+    }
+
+    if (bytesRead == -1)
+      return bytesRead;
+
+    bytesRead = std::min(size_t(bytesRead), want);
+    pos += bytesRead;
+    return bytesRead;
+  });
+  currentSegment = nullptr;
+
+  // The ngram thread finishes a segment when it sees it, so it has to get at
+  // least one (possibly empty) chunk of it.
+  if (published == 0)
+  {
+    unsigned char* chunk = NextCopyChunk(0);
+    chunkFileSegments[readChunkId] = &segment;
+    PublishChunk(chunk, 0, i);
+  }
+}
+
+inline unsigned char* SingleReaderThread::NextCopyChunk(const size_t carry)
+{
+  WaitForFreeChunk();
+  unsigned char* chunk = localBuffer + readChunkId * chunkSize;
+  if (carry > 0)
+  {
+    const size_t prev = (readChunkId + numChunks - 1) % numChunks;
+    memcpy(chunk, chunkPtrs[prev] + chunkSizes[prev] - carry, carry);
+  }
+
+  return chunk;
+}
+
+inline void SingleReaderThread::PublishChunk(unsigned char* chunk,
+                                             const size_t bytes,
+                                             const size_t fileId)
+{
+  chunkPtrs[readChunkId] = chunk;
+  chunkSizes[readChunkId] = bytes;
+  chunkFileIds[readChunkId] = fileId;
+  readChunkId = ((readChunkId + 1) % numChunks);
+}
+
+inline compression_type SingleReaderThread::DetectCompression(const int fd,
+                                                              bool& direct,
+                                                              size_t& inLen)
+{
+  // Read a whole aligned block, so that this works with O_DIRECT.
+  ssize_t bytesRead = pread(fd, decompressInput, directAlignment, 0);
+  if (bytesRead == -1 && direct && errno == EINVAL)
+  {
+    DirectUnsupported();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    direct = false;
+    bytesRead = pread(fd, decompressInput, directAlignment, 0);
+  }
+
+  inLen = (bytesRead == -1) ? 0 : bytesRead;
+  const compression_type type = Decompressor::Detect(decompressInput, inLen);
+  if (!Decompressor::Supported(type))
+  {
+    if (!zstdWarning)
+    {
+      std::ostringstream oss;
+      oss << "SingleReaderThread: not built with zstd support (see the "
+          << "Makefile); reading zstd files without decompressing them."
+          << std::endl;
+      std::cout << oss.str();
+      zstdWarning = true;
+    }
+
+    return compression_type::compression_none;
+  }
+
+  return type;
+}
+
+inline void SingleReaderThread::ReadCompressedFileChunks(
+    const int fd,
+    const size_t i,
+    const compression_type type,
+    size_t inLen,
+    bool direct)
+{
+  decompressor.Start(type);
+  ++decompressedFiles;
+
+  // Decompressed data goes into chunks just like ReadFileChunks() would put
+  // it: each chunk starts with the last n - 1 bytes of the previous one.
+  size_t inPos = 0;
+  size_t offset = inLen;
+  bool inputDone = (inLen < directAlignment);
+  unsigned char* chunk = nullptr;
+  size_t fill = 0;
+  size_t carry = 0;
+  while (true)
+  {
+    if (inPos == inLen && !inputDone)
+    {
+      const ssize_t bytesRead = pread(fd, decompressInput, decompressInputSize,
+          offset);
+      if (bytesRead == -1 && direct && errno == EINVAL)
+      {
+        DirectUnsupported();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = false;
+        continue;
+      }
+
+      if (bytesRead == -1)
+      {
+        std::cout << "read failed! errno " << errno << "\n";
+        inputDone = true;
+      }
+      else
+      {
+        inPos = 0;
+        inLen = bytesRead;
+        offset += bytesRead;
+        inputDone = (size_t(bytesRead) < decompressInputSize);
+      }
+    }
+
+    if (chunk == nullptr)
+    {
+      chunk = NextCopyChunk(carry);
+      fill = carry;
+    }
+
+    const size_t oldFill = fill;
+    const size_t oldInPos = inPos;
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const bool ok = decompressor.Decompress(decompressInput, inLen, inPos,
+        chunk, chunkSize, fill);
+    decompressTime += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    // If nothing happened and no more input is coming, the stream is over.
+    const bool stuck = (fill == oldFill && inPos == oldInPos &&
+        (inputDone || inPos < inLen));
+    if (!ok)
+    {
+      std::cout << "decompression failed for file " << i << "\n";
+    }
+
+    if (fill == chunkSize || !ok || stuck)
+    {
+      if (fill > carry)
+      {
+        PublishChunk(chunk, fill, i);
+        decompressedBytes += fill - carry;
+        carry = std::min(n - 1, fill);
+      }
+      chunk = nullptr;
+    }
+
+    if (!ok || stuck)
+      break;
+  }
+
+  compressedBytes += offset;
+}
+
+inline void SingleReaderThread::RunMmapThread()
+{
+  std::filesystem::path p;
+  size_t i;
+  int fd;
+  bool direct;
+  while (true)
+  {
+    if (ReadQueuedSegment())
+      continue;
+
+    if (!OpenNextFile(p, i, fd, direct))
+    {
+      if (SegmentsPending())
+        continue;
+      break;
+    }
+
+    if (options.decompress)
+    {
+      size_t inLen;
+      const compression_type type = DetectCompression(fd, direct, inLen);
+      if (type != compression_type::compression_none)
+      {
+        ReadCompressedFileChunks(fd, i, type, inLen, direct);
+        close(fd);
+        continue;
+      }
+    }
+
+    // Segments of split files are read, not mapped.
+    if (SplitFileChunks(p, i, fd, false))
+    {
+      close(fd);
+      continue;
+    }
+
+    // Setting up (and tearing down) a mapping costs more than just copying a
+    // small file, so read small files into localBuffer as usual.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+        size_t(st.st_size) < options.mmapMinSize)
+    {
+      ReadFileChunks(fd, i, false);
+      close(fd);
+      continue;
+    }
+
+    const size_t fileSize = st.st_size;
+    unsigned char* map = (unsigned char*) mmap(NULL, fileSize, PROT_READ,
+        MAP_PRIVATE | (options.mmapPopulate ? MAP_POPULATE : 0), fd, 0);
+    if (map == (unsigned char*) MAP_FAILED)
+    {
+      ReadFileChunks(fd, i, false);
+      close(fd);
+      continue;
+    }
+
+    // The mapping stays valid after the file is closed.
+    close(fd);
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+
+    // Hand out pointers into the mapping.  The mapping is contiguous, so
+    // overlapping chunks by n - 1 bytes costs nothing.
+    size_t offset = 0;
+    bool lastChunk = false;
+    while (!lastChunk)
+    {
+      WaitForFreeChunk();
+
+      const size_t len = std::min(options.mmapChunkSize, fileSize - offset);
+      lastChunk = (offset + len >= fileSize);
+      chunkPtrs[readChunkId] = map + offset;
+      chunkSizes[readChunkId] = len;
+      chunkFileIds[readChunkId] = i;
+      if (lastChunk)
+      {
+        // Unmap the file once the ngram thread is done with this chunk.
+        chunkMaps[readChunkId] = map;
+        chunkMapLens[readChunkId] = fileSize;
+      }
+
+      readChunkId = ((readChunkId + 1) % numChunks);
+      offset += options.mmapChunkSize - (n - 1);
+    }
+  }
+
+  // Hand off any small files still waiting in a batched chunk.
+  FlushBatch();
+}
+
+inline void SingleReaderThread::RunPackThread()
+{
+  // Sample data is read into this buffer in large pieces, and then copied into
+  // chunks.  The copy is cheap next to opening every sample separately.
+  const size_t packReadSize = options.packReadSize;
+  unsigned char* packBuffer;
+  alloc_mem_state packBufferMemState;
+  alloc_hugepage<unsigned char>(packBuffer, packBufferMemState, packReadSize,
+      "pack buffer");
+
+  std::filesystem::path p;
+  size_t i;
+  PackHeader header;
+  std::vector<PackIndexEntry> index;
+  while (dIter.get_next(p, i))
+  {
+    int fd = open(p.c_str(), O_RDONLY);
     if (fd == -1)
     {
       // check errno, something went wrong
@@ -82,49 +910,405 @@ inline void SingleReaderThread::RunThread()
       continue;
     }
 
-    // read into buffer
-    ssize_t bytesRead = 0;
-    do
+    if (!ReadPackIndex(fd, header, index))
     {
-      // Wait, if needed.
-      while (((readChunkId + 1) % numChunks) == processChunkId)
+      std::cout << "Skipping " << p << ", which is not a corpus pack.\n";
+      close(fd);
+      continue;
+    }
+
+    if (verbosity > 0)
+    {
+      std::ostringstream oss;
+      oss << "Reading pack " << p << " (" << index.size() << " samples)..."
+          << std::endl;
+      std::cout << oss.str();
+    }
+
+    posix_fadvise(fd, 0, header.indexOffset, POSIX_FADV_SEQUENTIAL);
+
+    // The part of the pack that is in packBuffer.
+    size_t bufferStart = 0;
+    size_t bufferLen = 0;
+    for (const PackIndexEntry& e : index)
+    {
+      // Fill chunks exactly like ReadFileChunks() would, carrying the last
+      // n - 1 bytes of each chunk into the next.
+      unsigned char* chunk = nullptr;
+      size_t fill = 0;
+      size_t carry = 0;
+      size_t pos = e.offset;
+      const size_t end = e.offset + e.length;
+      while (pos < end)
+      {
+        if (pos < bufferStart || pos >= bufferStart + bufferLen)
+        {
+          // Samples are in offset order, so this just continues reading
+          // through the pack.
+          bufferStart = pos;
+          const ssize_t bytesRead = pread(fd, packBuffer,
+              std::min(packReadSize, size_t(header.indexOffset - pos)), pos);
+          if (bytesRead <= 0)
+          {
+            if (bytesRead == -1)
+              std::cout << "read failed! errno " << errno << "\n";
+            bufferLen = 0;
+            break;
+          }
+          bufferLen = bytesRead;
+        }
+
+        if (chunk == nullptr)
+        {
+          chunk = NextCopyChunk(carry);
+          fill = carry;
+        }
+
+        const size_t len = std::min(std::min(end, bufferStart + bufferLen) - pos,
+            chunkSize - fill);
+        memcpy(chunk + fill, packBuffer + (pos - bufferStart), len);
+        fill += len;
+        pos += len;
+
+        if (fill == chunkSize || pos == end)
+        {
+          PublishChunk(chunk, fill, e.fileId);
+          carry = std::min(n - 1, fill);
+          chunk = nullptr;
+        }
+      }
+
+      // If a read failed partway through a sample, publish what we have.
+      if (chunk != nullptr && fill > carry)
+        PublishChunk(chunk, fill, e.fileId);
+    }
+
+    close(fd);
+  }
+
+  free_hugepage<unsigned char>(packBuffer, packBufferMemState, packReadSize);
+}
+
+inline void SingleReaderThread::RunTarThread()
+{
+  // The archive can only be read in order, so reader threads take turns
+  // reading whole members out of it.
+  TarStream& tar = *options.tarStream;
+  const bool direct = false;
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock(tar.Mutex());
+    size_t i, size;
+    if (!tar.NextMember(i, size))
+      break;
+
+    if (i % 10000 == 0 && verbosity > 0)
+      std::cout << "Reading file " << i << "..." << std::endl;
+
+    ReadChunks(i, direct, [&](unsigned char* buffer, const size_t len)
+        { return tar.Read(buffer, len); });
+  }
+
+  // Hand off any small files still waiting in a batched chunk.
+  FlushBatch();
+}
+
+inline void SingleReaderThread::RunUringThread(IoUringQueue& ring)
+{
+  // Reads go straight into the ring of chunks, so register it with the kernel
+  // if we can; if not (e.g. RLIMIT_MEMLOCK is too small), regular reads work
+  // too.
+  if (!ring.RegisterBuffer(localBuffer, totalBufferSize) && verbosity > 1)
+  {
+    std::ostringstream oss;
+    oss << "SingleReaderThread: could not register io_uring buffer; using "
+        << "unregistered reads." << std::endl;
+    std::cout << oss.str();
+  }
+
+  // Each completion's user data holds the operation type in the upper 32 bits
+  // and the file slot (or chunk, for reads) in the lower 32 bits.
+  constexpr uint64_t opOpen = 1;
+  constexpr uint64_t opStatx = 2;
+  constexpr uint64_t opRead = 3;
+  constexpr uint64_t opClose = 4;
+
+  // Files we have asked io_uring to open, in the order the DirectoryIterator
+  // gave them to us.  This is a circular buffer: `fileHead` is the oldest file
+  // we have not finished with, and `assignIndex` (relative to `fileHead`) is
+  // the file whose chunks we are currently handing out reads for.
+  struct UringFile
+  {
+    std::string path;
+    size_t fileId;
+    int fd;
+    bool failed;
+    size_t pending; // open and statx operations not yet completed
+    struct statx stx;
+    size_t nextOffset;
+    size_t readsInFlight;
+    bool done;
+  };
+  const size_t openDepth = options.uringOpenDepth;
+  std::vector<UringFile> files(openDepth);
+  size_t fileHead = 0;
+  size_t fileCount = 0;
+  size_t assignIndex = 0;
+
+  std::vector<uint8_t> chunkReady(numChunks, 0);
+  std::vector<size_t> chunkFile(numChunks, 0);
+  // Where each chunk starts in its file, and how many bytes it should hold and
+  // already holds: a read may return fewer bytes than asked for before the end
+  // of the file, and then we ask for the rest.
+  std::vector<size_t> chunkOffset(numChunks, 0);
+  std::vector<size_t> chunkWanted(numChunks, 0);
+  std::vector<size_t> chunkFilled(numChunks, 0);
+  // The next chunk that we will read into; chunks in [readChunkId,
+  // assignChunkId) have reads in flight or are waiting for an earlier chunk.
+  size_t assignChunkId = readChunkId;
+  size_t inFlight = 0;
+  size_t readsInFlight = 0;
+  bool moreFiles = true;
+
+  auto getSqe = [&]()
+  {
+    io_uring_sqe* sqe = ring.GetSqe();
+    if (sqe == nullptr)
+    {
+      ring.Submit();
+      sqe = ring.GetSqe();
+    }
+    return sqe;
+  };
+
+  // Close a file once every chunk has been read, or if it could not be read.
+  auto finishFile = [&](UringFile& f, const size_t slot)
+  {
+    if (f.done || f.readsInFlight > 0)
+      return;
+
+    if (f.fd >= 0)
+    {
+      io_uring_sqe* sqe = getSqe();
+      if (sqe != nullptr)
+      {
+        ring.PrepClose(sqe, f.fd, (opClose << 32) | slot);
+        ++inFlight;
+      }
+      else
+      {
+        close(f.fd);
+      }
+      f.fd = -1;
+    }
+    f.done = true;
+  };
+
+  while (true)
+  {
+    // Ask for more files to be opened, if there is room.
+    while (moreFiles && fileCount < openDepth)
+    {
+      std::filesystem::path p;
+      size_t i;
+      if (!dIter.get_next(p, i))
       {
-        usleep(1000);
-        ++waitingForChunks;
+        moreFiles = false;
+        break;
       }
 
-      bytesRead = read(fd, localBuffer + readChunkId * chunkSize, chunkSize);
-      if (bytesRead > 0)
+      if (i % 10000 == 0 && verbosity > 0)
+        std::cout << "Reading file " << i << "..." << std::endl;
+
+      const size_t slot = (fileHead + fileCount) % openDepth;
+      UringFile& f = files[slot];
+      f.path = p.string();
+      f.fileId = i;
+      f.fd = -1;
+      f.failed = false;
+      f.pending = 2;
+      f.nextOffset = 0;
+      f.readsInFlight = 0;
+      f.done = false;
+      ++fileCount;
+
+      io_uring_sqe* sqe = getSqe();
+      ring.PrepOpen(sqe, f.path.c_str(), (opOpen << 32) | slot);
+      sqe = getSqe();
+      ring.PrepStatx(sqe, f.path.c_str(), &f.stx, (opStatx << 32) | slot);
+      inFlight += 2;
+    }
+
+    // Hand out reads for the chunks of open files, in order.
+    while (assignIndex < fileCount && readsInFlight < options.uringQueueDepth)
+    {
+      const size_t slot = (fileHead + assignIndex) % openDepth;
+      UringFile& f = files[slot];
+      if (f.pending > 0)
+        break; // We have to wait for this file to be opened.
+
+      const size_t fileSize = f.stx.stx_size;
+      if (f.failed || f.nextOffset >= fileSize)
       {
-        // advance to next chunk
-        chunkSizes[readChunkId] = bytesRead;
-        chunkFileIds[readChunkId] = i;
+        // Nothing (more) to read from this file.
+        f.nextOffset = fileSize;
+        finishFile(f, slot);
+        ++assignIndex;
+        continue;
+      }
+
+      // Wait, if needed.
+      if (((assignChunkId + 1) % numChunks) == processChunkId)
+        break;
+
+      io_uring_sqe* sqe = getSqe();
+      if (sqe == nullptr)
+        break;
+
+      const size_t len = std::min(chunkSize, fileSize - f.nextOffset);
+      ring.PrepRead(sqe, f.fd, localBuffer + assignChunkId * chunkSize, len,
+          f.nextOffset, (opRead << 32) | assignChunkId);
+      chunkFileIds[assignChunkId] = f.fileId;
+      chunkFile[assignChunkId] = slot;
+      chunkOffset[assignChunkId] = f.nextOffset;
+      chunkWanted[assignChunkId] = len;
+      chunkFilled[assignChunkId] = 0;
+      ++f.readsInFlight;
+      ++readsInFlight;
+      ++inFlight;
+
+      // The next chunk overlaps this one by n - 1 bytes, so that no n-gram is
+      // split across chunks.
+      if (f.nextOffset + len >= fileSize)
+        f.nextOffset = fileSize;
+      else
+        f.nextOffset += chunkSize - (n - 1);
+
+      assignChunkId = ((assignChunkId + 1) % numChunks);
+    }
 
-        readChunkId = ((readChunkId + 1) % numChunks);
+    // Forget about files that we are completely done with.
+    while (fileCount > 0 && files[fileHead].done)
+    {
+      fileHead = ((fileHead + 1) % openDepth);
+      --fileCount;
+      --assignIndex;
+    }
 
-        // rewind for next read, but first check to see if we're at the end of
-        // the file
-        unsigned char byte;
-        size_t testBytes = read(fd, &byte, 1);
-        if (testBytes != 0)
+    if (inFlight == 0)
+    {
+      if (!moreFiles && fileCount == 0)
+        break;
+
+      // We can't do anything until the ngram thread frees up a chunk.
+      usleep(1000);
+      ++waitingForChunks;
+      continue;
+    }
+
+    ring.Submit(1);
+
+    io_uring_cqe* cqe;
+    while (ring.PeekCqe(cqe))
+    {
+      const uint64_t op = (cqe->user_data >> 32);
+      const size_t index = (cqe->user_data & 0xFFFFFFFF);
+      const int result = cqe->res;
+      ring.CqeSeen();
+      --inFlight;
+
+      if (op == opOpen || op == opStatx)
+      {
+        UringFile& f = files[index];
+        if (result < 0)
         {
-          off_t o = -n;
-          off_t pos = lseek(fd, o, SEEK_CUR);
-          if (lseek(fd, o, SEEK_CUR) == -1)
-            std::cout << "lseek fail!\n";
+          if (!f.failed)
+          {
+            std::cout << (op == opOpen ? "open" : "statx") << " failed! errno "
+                << -result << "\n";
+          }
+          f.failed = true;
         }
+        else if (op == opOpen)
+        {
+          f.fd = result;
+        }
+
+        --f.pending;
       }
-      else if (bytesRead == -1)
+      else if (op == opRead)
       {
-        // error
-        std::cout << "read failed! errno " << errno << "\n";
+        UringFile& f = files[chunkFile[index]];
+        if (result < 0)
+          std::cout << "read failed! errno " << -result << "\n";
+        else
+          chunkFilled[index] += result;
+
+        // On a short read, read the rest into the same chunk before handing
+        // it out: the next chunk starts n - 1 bytes before where this one was
+        // meant to end, so a partial chunk would drop the n-grams in between.
+        if (result > 0 && chunkFilled[index] < chunkWanted[index])
+        {
+          io_uring_sqe* sqe = getSqe();
+          if (sqe != nullptr)
+          {
+            ring.PrepRead(sqe, f.fd,
+                localBuffer + index * chunkSize + chunkFilled[index],
+                chunkWanted[index] - chunkFilled[index],
+                chunkOffset[index] + chunkFilled[index],
+                (opRead << 32) | index);
+            ++inFlight;
+            continue;
+          }
+
+          // No room in the ring; read the rest here.
+          while (chunkFilled[index] < chunkWanted[index])
+          {
+            const ssize_t bytesRead = pread(f.fd,
+                localBuffer + index * chunkSize + chunkFilled[index],
+                chunkWanted[index] - chunkFilled[index],
+                chunkOffset[index] + chunkFilled[index]);
+            if (bytesRead <= 0)
+              break;
+            chunkFilled[index] += bytesRead;
+          }
+        }
+
+        chunkSizes[index] = chunkFilled[index];
+        chunkReady[index] = 1;
+
+        --f.readsInFlight;
+        --readsInFlight;
+        if (f.nextOffset >= f.stx.stx_size)
+          finishFile(f, chunkFile[index]);
       }
-    } while (bytesRead > 0);
+    }
 
-    close(fd);
+    // Make chunks available to the ngram thread, in order.
+    while (readChunkId != assignChunkId && chunkReady[readChunkId])
+    {
+      chunkReady[readChunkId] = 0;
+      readChunkId = ((readChunkId + 1) % numChunks);
+    }
   }
+}
 
-  finished = true;
+inline size_t SingleReaderThread::FirstFileId(const size_t chunk) const
+{
+  return (chunkSegmentCounts[chunk] == 0) ? chunkFileIds[chunk] :
+      chunkSegments[chunk * maxChunkSegments].fileId;
+}
+
+inline FileSegment* SingleReaderThread::GetChunkFileSegment() const
+{
+  return chunkFileSegments[processChunkId];
+}
+
+inline size_t SingleReaderThread::GetChunkSegments(
+    const ChunkSegment*& segments) const
+{
+  segments = chunkSegments + processChunkId * maxChunkSegments;
+  return chunkSegmentCounts[processChunkId];
 }
 
 inline bool SingleReaderThread::GetNextChunk(unsigned char*& ptr,
@@ -148,12 +1332,13 @@ inline bool SingleReaderThread::GetNextChunk(unsigned char*& ptr,
         return true;
       }
 
-      ptr = localBuffer + processChunkId * chunkSize;
+      ptr = chunkPtrs[processChunkId];
       bytes = chunkSizes[processChunkId];
       const size_t oldFileId = fileId;
       fileId = chunkFileIds[processChunkId];
 
-      return ((fileId != oldFileId) && (oldFileId != size_t(-1)));
+      return ((FirstFileId(processChunkId) != oldFileId) &&
+          (oldFileId != size_t(-1)));
     }
     else
     {
@@ -169,6 +1354,16 @@ inline bool SingleReaderThread::GetNextChunk(unsigned char*& ptr,
     // Reading is not finished yet.
     if (((processChunkId + 1) % numChunks) == readChunkId)
     {
+      // The ngram thread takes a NULL chunk with no file ID to mean that we
+      // are done, so if it has not seen any chunk yet, wait here until the
+      // first one is read (or until we find there is nothing to read).
+      if (fileId == size_t(-1))
+      {
+        while (!finished && ((processChunkId + 1) % numChunks) == readChunkId)
+          usleep(100);
+        return GetNextChunk(ptr, bytes, fileId);
+      }
+
       // Wait for chunk to be available.
       ptr = nullptr;
       bytes = 0;
@@ -178,12 +1373,13 @@ inline bool SingleReaderThread::GetNextChunk(unsigned char*& ptr,
     {
       processChunkId = ((processChunkId + 1) % numChunks);
 
-      ptr = localBuffer + processChunkId * chunkSize;
+      ptr = chunkPtrs[processChunkId];
       bytes = chunkSizes[processChunkId];
       const size_t oldFileId = fileId;
       fileId = chunkFileIds[processChunkId];
 
-      return ((fileId != oldFileId) && (oldFileId != size_t(-1)));
+      return ((FirstFileId(processChunkId) != oldFileId) &&
+          (oldFileId != size_t(-1)));
     }
   }
 }
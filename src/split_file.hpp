@@ -0,0 +1,112 @@
+// split_file.hpp: support for splitting very large files into segments, so
+// that several reader/ngram thread pairs can work on one file at once instead
+// of it going at the speed of a single core.  Each ngram thread sets the bits
+// for the segment it gets in a partial bitset of its own; the partials are
+// OR-ed into the file's bitset, and when the last segment is done the file is
+// flushed into the CountsArray once, just like an unsplit file would be.
+#ifndef PNGRAM_SPLIT_FILE_HPP
+#define PNGRAM_SPLIT_FILE_HPP
+
+#include "counts_array.hpp"
+#include "alloc.hpp"
+#include "cpu_dispatch.hpp"
+#include <filesystem>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <vector>
+
+class SplitFile;
+
+// A range of bytes of a split file.  Consecutive segments overlap by n - 1
+// bytes, so that no n-gram is lost at a segment boundary.
+struct FileSegment
+{
+  SplitFile* file;
+  size_t start;
+  size_t end;
+};
+
+class SplitFile
+{
+ public:
+  inline SplitFile(const std::filesystem::path& path,
+                   const size_t fileId,
+                   const size_t size,
+                   const size_t segmentSize,
+                   const size_t n,
+                   const size_t bitsetLen);
+  inline ~SplitFile();
+
+  // OR the partial bitset of one segment into the file's bitset, and clear
+  // the partial.  Returns true if that was the last segment; then the caller
+  // must Flush() the file and delete it.
+  inline bool Merge(uint64_t* partial);
+
+  // Count every n-gram that was seen anywhere in the file once.
+  template<bool FixedSize>
+  inline void Flush(CountsArray<FixedSize>& countsArray);
+
+  const std::filesystem::path& Path() const { return path; }
+  size_t FileId() const { return fileId; }
+  std::vector<FileSegment>& Segments() { return segments; }
+
+ private:
+  std::filesystem::path path;
+  size_t fileId;
+  std::vector<FileSegment> segments;
+  std::atomic<size_t> segmentsLeft;
+
+  uint64_t* bits;
+  alloc_mem_state bitsMemState;
+  size_t bitsetLen;
+};
+
+// The segments of split files that no reader thread has taken yet.  One of
+// these is shared by all reader threads in a pass.
+class SplitFileQueue
+{
+ public:
+  // Files of at least `threshold` bytes are split into at most `maxSegments`
+  // segments.  `bitsetLen` is the number of uint64_ts in the bitsets of the
+  // ngram threads.
+  inline SplitFileQueue(const size_t threshold,
+                        const size_t maxSegments,
+                        const size_t n,
+                        const size_t bitsetLen);
+
+  // If a file of `size` bytes is big enough, split it, queue all segments but
+  // the first for other reader threads, and return the first one.  Returns
+  // false if the file should not be split.
+  inline bool Split(const std::filesystem::path& path,
+                    const size_t fileId,
+                    const size_t size,
+                    FileSegment*& first);
+
+  // Take a queued segment.  Returns false if there are none right now.
+  inline bool Next(FileSegment*& segment);
+  // Whether there are any queued segments.
+  inline bool Pending();
+
+  // How many files have been split.
+  size_t SplitFiles() const { return splitFiles; }
+
+  // Segments are never smaller than this (unless the file is).
+  static constexpr size_t minSegmentSize = (1 << 20);
+  // Segments start at multiples of this, so they can be read with O_DIRECT.
+  static constexpr size_t segmentAlignment = 4096;
+
+ private:
+  size_t threshold;
+  size_t maxSegments;
+  size_t n;
+  size_t bitsetLen;
+
+  std::mutex mutex;
+  std::deque<FileSegment*> queue;
+  std::atomic<size_t> splitFiles;
+};
+
+#include "split_file_impl.hpp"
+
+#endif
@@ -0,0 +1,139 @@
+// split_file_impl.hpp: implementation of SplitFile and SplitFileQueue.
+#ifndef PNGRAM_SPLIT_FILE_IMPL_HPP
+#define PNGRAM_SPLIT_FILE_IMPL_HPP
+
+#include "split_file.hpp"
+#include <cstring>
+#include <algorithm>
+
+inline SplitFile::SplitFile(const std::filesystem::path& path,
+                            const size_t fileId,
+                            const size_t size,
+                            const size_t segmentSize,
+                            const size_t n,
+                            const size_t bitsetLen) :
+    path(path),
+    fileId(fileId),
+    bitsetLen(bitsetLen)
+{
+  for (size_t start = 0; start < size; start += segmentSize)
+  {
+    FileSegment s;
+    s.file = this;
+    s.start = start;
+    s.end = std::min(size, start + segmentSize + (n - 1));
+    segments.push_back(s);
+
+    if (s.end == size)
+      break;
+  }
+  segmentsLeft = segments.size();
+
+  alloc_zeroed_hugepage<uint64_t>(bits, bitsMemState, bitsetLen, "split file");
+}
+
+inline SplitFile::~SplitFile()
+{
+  free_hugepage<uint64_t>(bits, bitsMemState, bitsetLen);
+}
+
+inline bool SplitFile::Merge(uint64_t* partial)
+{
+  // Other segments may be merged at the same time.
+  for (size_t i = 0; i < bitsetLen; ++i)
+  {
+    if (partial[i] != 0)
+    {
+      __atomic_fetch_or(&bits[i], partial[i], __ATOMIC_RELAXED);
+      partial[i] = 0;
+    }
+  }
+
+  return (segmentsLeft.fetch_sub(1, std::memory_order_acq_rel) == 1);
+}
+
+template<bool FixedSize>
+inline void SplitFile::Flush(CountsArray<FixedSize>& countsArray)
+{
+  RunKernel([&]()
+  {
+    if (countsArray.Partitioned())
+    {
+      countsArray.ForEachOwnedRange(bitsetLen,
+          [&](const size_t begin, const size_t end)
+      {
+        for (size_t i = begin; i < end; ++i)
+        {
+          if (bits[i] != 0)
+            countsArray.template Increment<false>(i, bits[i]);
+        }
+      });
+    }
+    else
+    {
+      for (size_t i = 0; i < bitsetLen; ++i)
+      {
+        if (bits[i] != 0)
+          countsArray.Increment(i, bits[i]);
+      }
+    }
+  });
+}
+
+inline SplitFileQueue::SplitFileQueue(const size_t threshold,
+                                      const size_t maxSegments,
+                                      const size_t n,
+                                      const size_t bitsetLen) :
+    threshold(threshold),
+    maxSegments(maxSegments),
+    n(n),
+    bitsetLen(bitsetLen),
+    splitFiles(0)
+{
+}
+
+inline bool SplitFileQueue::Split(const std::filesystem::path& path,
+                                  const size_t fileId,
+                                  const size_t size,
+                                  FileSegment*& first)
+{
+  if (threshold == 0 || size < threshold || maxSegments < 2)
+    return false;
+
+  const size_t segments = std::min(maxSegments, size / minSegmentSize);
+  if (segments < 2)
+    return false;
+
+  const size_t segmentSize = (((size + segments - 1) / segments) +
+      segmentAlignment - 1) / segmentAlignment * segmentAlignment;
+  SplitFile* file = new SplitFile(path, fileId, size, segmentSize, n,
+      bitsetLen);
+  ++splitFiles;
+
+  std::vector<FileSegment>& s = file->Segments();
+  first = &s[0];
+  std::unique_lock<std::mutex> lock(mutex);
+  for (size_t i = 1; i < s.size(); ++i)
+    queue.push_back(&s[i]);
+
+  return true;
+}
+
+inline bool SplitFileQueue::Next(FileSegment*& segment)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  if (queue.empty())
+    return false;
+
+  segment = queue.front();
+  queue.pop_front();
+  return true;
+}
+
+inline bool SplitFileQueue::Pending()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return !queue.empty();
+}
+
+#endif
@@ -0,0 +1,71 @@
+// tar_stream.hpp: reads the members of a tar archive one after another from a
+// file descriptor (which may be a pipe, such as stdin), so that a tar stream
+// can be n-grammed without extracting it first.  Each regular file in the
+// archive is one document; everything else is skipped.
+#ifndef PNGRAM_TAR_STREAM_HPP
+#define PNGRAM_TAR_STREAM_HPP
+
+#include "corpus_pack.hpp"
+#include <sys/types.h>
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+class TarStream
+{
+ public:
+  // The file descriptor is not closed by the TarStream.
+  inline TarStream(const int fd);
+
+  // Returns false if the stream can't be read again from the start (e.g. if it
+  // is a pipe).
+  inline bool Seekable() const;
+  // Go back to the start of the stream, so it can be read again.
+  inline bool Rewind();
+
+  // Skip whatever is left of the current member, and move to the next regular
+  // file.  Returns false at the end of the archive (or on an error).  Files
+  // are numbered in order, starting at 0.
+  inline bool NextMember(size_t& fileId, size_t& size);
+
+  // Read up to `len` bytes of the current member.  Fewer bytes are only
+  // returned at the end of the member.  Returns -1 on an error.
+  inline ssize_t Read(unsigned char* buffer, const size_t len);
+
+  // Also write every member to `writer` (which must be open), so the archive
+  // can be read again later as a pack.  Pass NULL to stop.
+  inline void SpoolTo(PackWriter* writer);
+  // Finish spooling the last member.
+  inline void FinishSpool();
+
+  // Only one thread can read from the stream at a time.
+  std::mutex& Mutex() { return mutex; }
+
+ private:
+  // Read exactly `len` bytes of the archive (fewer only at the end of the
+  // stream).  Returns -1 on an error.
+  inline ssize_t ReadRaw(unsigned char* out, const size_t len);
+  // Skip `len` bytes of the archive.
+  inline bool SkipRaw(size_t len);
+  // Parse a numeric header field (octal, or base-256 for large values).
+  static inline size_t ParseNumber(const unsigned char* field, const size_t len);
+
+  int fd;
+  std::vector<unsigned char> buffer;
+  size_t bufferPos;
+  size_t bufferLen;
+
+  // Bytes left in the current member, and padding after it.
+  size_t remaining;
+  size_t padding;
+  size_t memberCount;
+  bool inMember;
+  bool ended;
+
+  PackWriter* spool;
+  std::mutex mutex;
+};
+
+#include "tar_stream_impl.hpp"
+
+#endif
@@ -0,0 +1,243 @@
+// tar_stream_impl.hpp: implementation of TarStream.
+#ifndef PNGRAM_TAR_STREAM_IMPL_HPP
+#define PNGRAM_TAR_STREAM_IMPL_HPP
+
+#include "tar_stream.hpp"
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+inline TarStream::TarStream(const int fd) :
+    fd(fd),
+    buffer(1 << 20),
+    bufferPos(0),
+    bufferLen(0),
+    remaining(0),
+    padding(0),
+    memberCount(0),
+    inMember(false),
+    ended(false),
+    spool(nullptr)
+{
+}
+
+inline bool TarStream::Seekable() const
+{
+  return (lseek(fd, 0, SEEK_CUR) != -1);
+}
+
+inline bool TarStream::Rewind()
+{
+  if (lseek(fd, 0, SEEK_SET) == -1)
+    return false;
+
+  FinishSpool();
+  bufferPos = bufferLen = 0;
+  remaining = padding = 0;
+  memberCount = 0;
+  ended = false;
+  return true;
+}
+
+inline ssize_t TarStream::ReadRaw(unsigned char* out, const size_t len)
+{
+  size_t done = 0;
+  while (done < len)
+  {
+    if (bufferPos == bufferLen)
+    {
+      // Big reads can skip the buffer.
+      if (len - done >= buffer.size())
+      {
+        const ssize_t bytesRead = read(fd, out + done, len - done);
+        if (bytesRead == -1 && errno == EINTR)
+          continue;
+        else if (bytesRead == -1)
+          return -1;
+        else if (bytesRead == 0)
+          break;
+
+        done += bytesRead;
+        continue;
+      }
+
+      const ssize_t bytesRead = read(fd, buffer.data(), buffer.size());
+      if (bytesRead == -1 && errno == EINTR)
+        continue;
+      else if (bytesRead == -1)
+        return -1;
+      else if (bytesRead == 0)
+        break;
+
+      bufferPos = 0;
+      bufferLen = bytesRead;
+    }
+
+    const size_t len2 = std::min(len - done, bufferLen - bufferPos);
+    memcpy(out + done, buffer.data() + bufferPos, len2);
+    bufferPos += len2;
+    done += len2;
+  }
+
+  return done;
+}
+
+inline bool TarStream::SkipRaw(size_t len)
+{
+  unsigned char scratch[4096];
+  while (len > 0)
+  {
+    const ssize_t bytesRead = ReadRaw(scratch, std::min(len, sizeof(scratch)));
+    if (bytesRead <= 0)
+      return false;
+    len -= bytesRead;
+  }
+
+  return true;
+}
+
+inline size_t TarStream::ParseNumber(const unsigned char* field,
+                                     const size_t len)
+{
+  size_t result = 0;
+  if (field[0] & 0x80)
+  {
+    // GNU base-256 encoding, for values that don't fit in octal.
+    result = (field[0] & 0x7f);
+    for (size_t i = 1; i < len; ++i)
+      result = (result << 8) | field[i];
+    return result;
+  }
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (field[i] >= '0' && field[i] <= '7')
+      result = (result << 3) | (field[i] - '0');
+    else if (field[i] != ' ' || result != 0)
+      break;
+  }
+
+  return result;
+}
+
+inline bool TarStream::NextMember(size_t& fileId, size_t& size)
+{
+  if (ended)
+    return false;
+
+  // Skip whatever the reader didn't read of the last member (and spool it, so
+  // the spooled copy is complete).
+  while (remaining > 0)
+  {
+    unsigned char scratch[4096];
+    if (Read(scratch, std::min(remaining, sizeof(scratch))) <= 0)
+    {
+      ended = true;
+      return false;
+    }
+  }
+  FinishSpool();
+  if (!SkipRaw(padding))
+  {
+    ended = true;
+    return false;
+  }
+  padding = 0;
+
+  while (true)
+  {
+    unsigned char header[512];
+    if (ReadRaw(header, 512) != 512)
+    {
+      ended = true;
+      return false;
+    }
+
+    // The archive ends with zero blocks.
+    bool allZero = true;
+    for (size_t i = 0; i < 512 && allZero; ++i)
+      allZero = (header[i] == 0);
+    if (allZero)
+    {
+      ended = true;
+      return false;
+    }
+
+    // The checksum treats its own field as spaces.
+    size_t sum = 0;
+    for (size_t i = 0; i < 512; ++i)
+      sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    if (sum != ParseNumber(header + 148, 8))
+    {
+      std::cerr << "TarStream: bad header checksum; stopping." << std::endl;
+      ended = true;
+      return false;
+    }
+
+    const size_t memberSize = ParseNumber(header + 124, 12);
+    const size_t memberPadding = (512 - (memberSize % 512)) % 512;
+    const char type = header[156];
+    if (type == '0' || type == '\0' || type == '7')
+    {
+      fileId = memberCount++;
+      size = memberSize;
+      remaining = memberSize;
+      padding = memberPadding;
+      if (spool != nullptr)
+      {
+        spool->BeginSample(fileId);
+        inMember = true;
+      }
+      return true;
+    }
+
+    // Directories, links, long names, pax headers, etc.: skip.
+    if (!SkipRaw(memberSize + memberPadding))
+    {
+      ended = true;
+      return false;
+    }
+  }
+}
+
+inline ssize_t TarStream::Read(unsigned char* out, const size_t len)
+{
+  const ssize_t bytesRead = ReadRaw(out, std::min(len, remaining));
+  if (bytesRead == -1)
+    return -1;
+
+  if (size_t(bytesRead) < std::min(len, remaining))
+  {
+    // The archive was cut off.
+    std::cerr << "TarStream: archive ends in the middle of a file."
+        << std::endl;
+    remaining = 0;
+    padding = 0;
+    ended = true;
+  }
+  else
+  {
+    remaining -= bytesRead;
+  }
+
+  if (spool != nullptr && bytesRead > 0)
+    spool->Write(out, bytesRead);
+  return bytesRead;
+}
+
+inline void TarStream::SpoolTo(PackWriter* writer)
+{
+  FinishSpool();
+  spool = writer;
+}
+
+inline void TarStream::FinishSpool()
+{
+  if (spool != nullptr && inMember)
+    spool->EndSample();
+  inMember = false;
+}
+
+#endif